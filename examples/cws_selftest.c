@@ -0,0 +1,845 @@
+/**
+ * Drives the WebSocket server with a built-in client over a Unix socket.
+ * Checks the handshake, fragmentation, control frames between fragments, masks, 64-bit lengths, invalid UTF-8 and
+ * close codes, then measures echo throughput and p50/p99 latency at a few message sizes, and what permessage-deflate costs and saves.
+ * Last it restarts the server with `CWS_SEND_QUEUE_DROP` to check that dropped compressed frames do not break the ones after them.
+ * Usage: cws_selftest [backend], where backend is one of the `CWS_BACKEND_*` values. Exits with 1 if a check failed.
+ */
+
+#include "cws.h"
+#include <errno.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef CWS_HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#define OP_CONTINUATION 0x0
+#define OP_TEXT 0x1
+#define OP_BINARY 0x2
+#define OP_CLOSE 0x8
+#define OP_PING 0x9
+#define OP_PONG 0xA
+#define RSV1 0x40
+
+#define MAX_MESSAGE_SIZE (1 << 20)
+#define ACK_ONLY 0xFF
+#define FLOOD 0xFE
+#define FLOOD_COUNT 256
+#define FLOOD_SIZE 4096
+
+static char socket_path[sizeof(((struct sockaddr_un*)0)->sun_path)];
+static int failures = 0;
+static int opened = 0;
+static int closed = 0;
+static int dropped = 0;
+
+#define CHECK(cond, name)                                                                                                                            \
+  do {                                                                                                                                               \
+    if (!(cond)) {                                                                                                                                   \
+      failures++;                                                                                                                                    \
+      fprintf(stderr, "FAIL %s (%s:%d)\n", name, __FILE__, __LINE__);                                                                                \
+    }                                                                                                                                                \
+  } while (0)
+
+/**
+ * | Server |
+ */
+
+static void on_open(cws_client_t* client)
+{
+  (void)client;
+  __atomic_add_fetch(&opened, 1, __ATOMIC_SEQ_CST);
+}
+
+static void on_close(cws_client_t* client)
+{
+  (void)client;
+  __atomic_add_fetch(&closed, 1, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * Fills `out` with message `index` of a flood. Random bytes that differ per message follow the index, so the messages do not
+ * compress much, and the second half is the same in all of them, so each one refers back to the one before.
+ */
+static void flood_message(unsigned char* out, uint32_t index)
+{
+  uint32_t seed = index;
+  memcpy(out, &index, sizeof(index));
+  for (size_t i = sizeof(index); i < FLOOD_SIZE; i++) {
+    if (i == FLOOD_SIZE / 2) seed = 0;
+    seed = seed * 1664525 + 1013904223;
+    out[i] = seed >> 24;
+  }
+}
+
+/**
+ * Echoes every message, binary messages starting with `ACK_ONLY` only get an empty one back.
+ * Binary messages starting with `FLOOD` get `FLOOD_COUNT` messages back at once, more than the send queue takes.
+ */
+static void on_message(cws_client_t* client, const unsigned char* msg, uint64_t msg_size, int type)
+{
+  if (type == CWS_TYPE_BINARY && msg_size > 0 && msg[0] == ACK_ONLY) {
+    cws_send(client, NULL, 0, type);
+    return;
+  }
+  if (type == CWS_TYPE_BINARY && msg_size > 0 && msg[0] == FLOOD) {
+    unsigned char flood[FLOOD_SIZE];
+    for (uint32_t i = 0; i < FLOOD_COUNT; i++) {
+      flood_message(flood, i);
+      if (cws_send(client, (const char*)flood, sizeof(flood), type) == CWS_SEND_DROPPED) {
+        __atomic_add_fetch(&dropped, 1, __ATOMIC_SEQ_CST);
+      }
+    }
+    return;
+  }
+  cws_send(client, (const char*)msg, msg_size, type);
+}
+
+/**
+ * | Client |
+ */
+
+static uint64_t now_us()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int write_all(int fd, const void* buf, size_t size)
+{
+  const unsigned char* p = buf;
+  while (size > 0) {
+    ssize_t n = send(fd, p, size, 0);
+    if (n <= 0) {
+      if (n < 0 && errno == EINTR) continue;
+      return -1;
+    }
+    p += n;
+    size -= n;
+  }
+  return 0;
+}
+
+static int read_all(int fd, void* buf, size_t size)
+{
+  unsigned char* p = buf;
+  while (size > 0) {
+    ssize_t n = recv(fd, p, size, 0);
+    if (n <= 0) {
+      if (n < 0 && errno == EINTR) continue;
+      return -1;
+    }
+    p += n;
+    size -= n;
+  }
+  return 0;
+}
+
+/**
+ * Connects and upgrades, returns the socket or -1. `extensions` is offered and has to be accepted if it is set.
+ * The request is written `chunk` bytes at a time if `chunk` is not 0.
+ */
+static int client_connect_split(const char* extensions, size_t chunk)
+{
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) return -1;
+
+  struct sockaddr_un address = {.sun_family = AF_UNIX};
+  memcpy(address.sun_path, socket_path, strlen(socket_path) + 1);
+  struct timeval timeout = {.tv_sec = 5};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  if (connect(fd, (struct sockaddr*)&address, sizeof(address)) < 0) {
+    close(fd);
+    return -1;
+  }
+
+  // The key and its accept value are the example from RFC 6455
+  char request[512];
+  snprintf(request, sizeof(request),
+           "GET / HTTP/1.1\r\nHost: localhost\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+           "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\nSec-WebSocket-Version: 13\r\n%s%s%s\r\n",
+           extensions != NULL ? "Sec-WebSocket-Extensions: " : "", extensions != NULL ? extensions : "", extensions != NULL ? "\r\n" : "");
+  char response[1024];
+  size_t size = 0;
+  size_t request_size = strlen(request);
+  for (size_t sent = 0; sent < request_size; sent += chunk) {
+    if (chunk == 0 || chunk > request_size - sent) chunk = request_size - sent;
+    if (write_all(fd, request + sent, chunk) < 0) {
+      close(fd);
+      return -1;
+    }
+  }
+  // Read byte by byte so nothing after the response is consumed
+  while (size < sizeof(response) - 1 && (size < 4 || memcmp(response + size - 4, "\r\n\r\n", 4) != 0)) {
+    if (read_all(fd, response + size, 1) < 0) break;
+    size++;
+  }
+  response[size] = '\0';
+
+  if (strncmp(response, "HTTP/1.1 101", 12) != 0 || strstr(response, "Sec-WebSocket-Accept: s3pPLMBiTxaQ9kYGzzhZRbK+xOo=\r\n") == NULL ||
+      (extensions != NULL && strstr(response, extensions) == NULL)) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static int client_connect(const char* extensions)
+{
+  return client_connect_split(extensions, 0);
+}
+
+/* Builds a frame into `out` and returns its size, only the header if `payload` is NULL. `out` needs room for `size` + 14 bytes. */
+static size_t encode_frame(unsigned char* out, int fin, int opcode, const void* payload, uint64_t size, int masked)
+{
+  static uint32_t seed = 0x9e3779b9;
+  size_t n = 0;
+  out[n++] = (fin ? 0x80 : 0) | opcode;
+  if (size <= 125) {
+    out[n++] = (masked ? 0x80 : 0) | (unsigned char)size;
+  } else if (size <= 65535) {
+    out[n++] = (masked ? 0x80 : 0) | 126;
+    out[n++] = size >> 8;
+    out[n++] = size & 255;
+  } else {
+    out[n++] = (masked ? 0x80 : 0) | 127;
+    for (int i = 0; i < 8; i++) {
+      out[n++] = (size >> (56 - i * 8)) & 255;
+    }
+  }
+
+  unsigned char mask[4] = {0};
+  if (masked) {
+    seed = seed * 1664525 + 1013904223;
+    memcpy(mask, &seed, 4);
+    memcpy(out + n, mask, 4);
+    n += 4;
+  }
+  if (payload == NULL) {
+    return n;
+  }
+  const unsigned char* p = payload;
+  for (uint64_t i = 0; i < size; i++) {
+    out[n + i] = p[i] ^ mask[i & 3];
+  }
+  return n + size;
+}
+
+static int send_frame(int fd, int fin, int opcode, const void* payload, uint64_t size)
+{
+  unsigned char* frame = malloc(size + 14);
+  if (frame == NULL) return -1;
+  size_t n = encode_frame(frame, fin, opcode, payload, size, 1);
+  int ret = write_all(fd, frame, n);
+  free(frame);
+  return ret;
+}
+
+/* Reads one frame, the payload is allocated and has to be freed. Returns the opcode, with `RSV1` set if it is compressed, or -1. */
+static int recv_frame(int fd, unsigned char** payload_out, uint64_t* size_out)
+{
+  unsigned char header[8];
+  if (read_all(fd, header, 2) < 0) return -1;
+  // Frames from the server are never masked
+  if (header[1] & 0x80) return -1;
+
+  int opcode = header[0] & (RSV1 | 0x0F);
+  uint64_t size = header[1] & 0x7F;
+  if (size == 126) {
+    if (read_all(fd, header, 2) < 0) return -1;
+    size = ((uint64_t)header[0] << 8) | header[1];
+  } else if (size == 127) {
+    if (read_all(fd, header, 8) < 0) return -1;
+    size = 0;
+    for (int i = 0; i < 8; i++) {
+      size = (size << 8) | header[i];
+    }
+  }
+
+  unsigned char* payload = malloc(size + 1);
+  if (payload == NULL || read_all(fd, payload, size) < 0) {
+    free(payload);
+    return -1;
+  }
+  *payload_out = payload;
+  *size_out = size;
+  return opcode;
+}
+
+/* Reads frames until a close frame and returns its status code, 1005 if it had none or -1 if the connection ended */
+static int recv_close_code(int fd)
+{
+  for (;;) {
+    unsigned char* payload;
+    uint64_t size;
+    int opcode = recv_frame(fd, &payload, &size);
+    if (opcode < 0) return -1;
+    int code = size >= 2 ? (payload[0] << 8) | payload[1] : 1005;
+    free(payload);
+    if (opcode == OP_CLOSE) return code;
+  }
+}
+
+/* Reads one frame and compares it with the expected one */
+static int expect_frame(int fd, int opcode, const void* payload, uint64_t size)
+{
+  unsigned char* got;
+  uint64_t got_size;
+  int got_opcode = recv_frame(fd, &got, &got_size);
+  if (got_opcode < 0) return 0;
+  int ok = got_opcode == opcode && got_size == size && memcmp(got, payload, size) == 0;
+  free(got);
+  return ok;
+}
+
+/**
+ * | Conformance |
+ */
+
+static void test_handshake()
+{
+  int fd = client_connect(NULL);
+  CHECK(fd >= 0, "handshake");
+  if (fd < 0) return;
+
+  int split = client_connect_split(NULL, 1);
+  CHECK(split >= 0, "handshake split into single bytes");
+  if (split >= 0) close(split);
+
+  // A request that is not an upgrade gets an error instead
+  int plain = socket(AF_UNIX, SOCK_STREAM, 0);
+  struct sockaddr_un address = {.sun_family = AF_UNIX};
+  memcpy(address.sun_path, socket_path, strlen(socket_path) + 1);
+  struct timeval timeout = {.tv_sec = 5};
+  setsockopt(plain, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  char response[16] = {0};
+  const char* request = "GET / HTTP/1.1\r\nHost: localhost\r\n\r\n";
+  if (connect(plain, (struct sockaddr*)&address, sizeof(address)) == 0 && write_all(plain, request, strlen(request)) == 0) {
+    read_all(plain, response, 12);
+  }
+  CHECK(strncmp(response, "HTTP/1.1 4", 10) == 0, "plain request refused");
+  close(plain);
+  close(fd);
+}
+
+static void test_messages()
+{
+  int fd = client_connect(NULL);
+  if (fd < 0) return;
+
+  send_frame(fd, 1, OP_TEXT, "hello", 5);
+  CHECK(expect_frame(fd, OP_TEXT, "hello", 5), "masked text echo");
+
+  send_frame(fd, 1, OP_BINARY, "", 0);
+  CHECK(expect_frame(fd, OP_BINARY, "", 0), "empty binary echo");
+
+  // Fragments with a ping and an empty continuation in between, the pong comes first
+  send_frame(fd, 0, OP_TEXT, "Hel", 3);
+  send_frame(fd, 1, OP_PING, "p1", 2);
+  send_frame(fd, 0, OP_CONTINUATION, "", 0);
+  send_frame(fd, 1, OP_CONTINUATION, "lo", 2);
+  CHECK(expect_frame(fd, OP_PONG, "p1", 2), "pong between fragments");
+  CHECK(expect_frame(fd, OP_TEXT, "Hello", 5), "fragmented text");
+
+  // A multi-byte character split across fragments
+  send_frame(fd, 0, OP_TEXT, "\xe2\x82", 2);
+  send_frame(fd, 1, OP_CONTINUATION, "\xac", 1);
+  CHECK(expect_frame(fd, OP_TEXT, "\xe2\x82\xac", 3), "utf-8 split across fragments");
+
+  // 16-bit and 64-bit lengths, the frame is written a few bytes at a time
+  unsigned char* data = malloc(70000);
+  for (size_t i = 0; i < 70000; i++) data[i] = (unsigned char)(i * 7);
+  uint64_t sizes[] = {126, 65535, 65536, 70000};
+  unsigned char* frame = malloc(70000 + 14);
+  for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+    size_t n = encode_frame(frame, 1, OP_BINARY, data, sizes[s], 1);
+    for (size_t i = 0; i < n; i += 4093) {
+      write_all(fd, frame + i, n - i < 4093 ? n - i : 4093);
+    }
+    char name[64];
+    snprintf(name, sizeof(name), "binary echo of %llu bytes", (unsigned long long)sizes[s]);
+    CHECK(expect_frame(fd, OP_BINARY, data, sizes[s]), name);
+  }
+  free(frame);
+
+  // Fragments of a binary message with a 64-bit length each
+  send_frame(fd, 0, OP_BINARY, data, 65536);
+  send_frame(fd, 1, OP_CONTINUATION, data + 65536, 70000 - 65536);
+  CHECK(expect_frame(fd, OP_BINARY, data, 70000), "fragmented binary");
+  free(data);
+
+  // A close with a valid code is echoed
+  send_frame(fd, 1, OP_CLOSE, "\x03\xe8" "bye", 5);
+  CHECK(recv_close_code(fd) == 1000, "close 1000 echoed");
+  close(fd);
+}
+
+/* Sends `frames` and expects the server to close with `code` */
+static void expect_failure(const char* name, int code, void (*frames)(int fd))
+{
+  int fd = client_connect(NULL);
+  if (fd < 0) {
+    CHECK(0, name);
+    return;
+  }
+  frames(fd);
+  int got = recv_close_code(fd);
+  if (got != code) {
+    fprintf(stderr, "  %s: expected close %d, got %d\n", name, code, got);
+  }
+  CHECK(got == code, name);
+  close(fd);
+}
+
+static void unmasked_frame(int fd)
+{
+  unsigned char frame[16];
+  size_t n = encode_frame(frame, 1, OP_TEXT, "hi", 2, 0);
+  write_all(fd, frame, n);
+}
+
+static void reserved_opcode(int fd)
+{
+  send_frame(fd, 1, 0x3, "", 0);
+}
+
+static void rsv_bits(int fd)
+{
+  unsigned char frame[16];
+  size_t n = encode_frame(frame, 1, OP_TEXT, "hi", 2, 1);
+  frame[0] |= 0x20;
+  write_all(fd, frame, n);
+}
+
+static void fragmented_ping(int fd)
+{
+  send_frame(fd, 0, OP_PING, "", 0);
+}
+
+static void long_ping(int fd)
+{
+  char payload[126] = {0};
+  send_frame(fd, 1, OP_PING, payload, sizeof(payload));
+}
+
+static void continuation_first(int fd)
+{
+  send_frame(fd, 1, OP_CONTINUATION, "x", 1);
+}
+
+static void text_inside_fragments(int fd)
+{
+  send_frame(fd, 0, OP_TEXT, "a", 1);
+  send_frame(fd, 1, OP_TEXT, "b", 1);
+}
+
+static void invalid_utf8(int fd)
+{
+  send_frame(fd, 1, OP_TEXT, "\xc0\xaf", 2);
+}
+
+static void invalid_utf8_fragment(int fd)
+{
+  send_frame(fd, 0, OP_TEXT, "ok", 2);
+  send_frame(fd, 0, OP_CONTINUATION, "\xed\xa0\x80", 3);
+}
+
+static void invalid_close_reason(int fd)
+{
+  send_frame(fd, 1, OP_CLOSE, "\x03\xe8\xff", 3);
+}
+
+static void too_big(int fd)
+{
+  unsigned char header[14];
+  // Only the header is sent, the size alone has to be refused
+  size_t n = encode_frame(header, 1, OP_BINARY, NULL, (uint64_t)MAX_MESSAGE_SIZE + 1, 1);
+  write_all(fd, header, n);
+}
+
+static void too_big_fragments(int fd)
+{
+  char* data = calloc(1, MAX_MESSAGE_SIZE / 2 + 1);
+  send_frame(fd, 0, OP_BINARY, data, MAX_MESSAGE_SIZE / 2 + 1);
+  send_frame(fd, 1, OP_CONTINUATION, data, MAX_MESSAGE_SIZE / 2 + 1);
+  free(data);
+}
+
+static void invalid_close_code(int fd)
+{
+  send_frame(fd, 1, OP_CLOSE, "\x03\xed", 2);
+}
+
+static void private_close_code(int fd)
+{
+  send_frame(fd, 1, OP_CLOSE, "\x0f\xa0", 2);
+}
+
+static void empty_close(int fd)
+{
+  send_frame(fd, 1, OP_CLOSE, "", 0);
+}
+
+static void test_failures()
+{
+  expect_failure("unmasked frame", 1002, unmasked_frame);
+  expect_failure("reserved opcode", 1002, reserved_opcode);
+  expect_failure("reserved bits", 1002, rsv_bits);
+  expect_failure("fragmented control frame", 1002, fragmented_ping);
+  expect_failure("control frame over 125 bytes", 1002, long_ping);
+  expect_failure("continuation without a message", 1002, continuation_first);
+  expect_failure("new message inside fragments", 1002, text_inside_fragments);
+  expect_failure("invalid utf-8", 1007, invalid_utf8);
+  expect_failure("invalid utf-8 in a fragment", 1007, invalid_utf8_fragment);
+  // A close frame is not answered with another one, the connection is just dropped
+  expect_failure("invalid utf-8 close reason", -1, invalid_close_reason);
+  expect_failure("message too big", 1009, too_big);
+  expect_failure("fragments too big", 1009, too_big_fragments);
+  expect_failure("reserved close code", 1002, invalid_close_code);
+  expect_failure("private close code echoed", 4000, private_close_code);
+  expect_failure("empty close echoed", 1005, empty_close);
+}
+
+/**
+ * | Throughput |
+ */
+
+static int compare_u64(const void* a, const void* b)
+{
+  uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+  return x < y ? -1 : x > y;
+}
+
+/**
+ * Keeps `window` messages in flight to measure throughput, then sends one at a time to measure the round trip.
+ * With `receive_only` the server only acknowledges each message, which leaves the receive path (reads and unmasking) alone.
+ */
+static void bench(size_t size, int count, int window, int receive_only)
+{
+  int fd = client_connect(NULL);
+  if (fd < 0) {
+    CHECK(0, "bench connect");
+    return;
+  }
+
+  unsigned char* payload = malloc(size);
+  unsigned char* frame = malloc(size + 14);
+  memset(payload, 'x', size);
+  payload[0] = receive_only ? ACK_ONLY : 'x';
+  uint64_t reply_size = receive_only ? 0 : size;
+  size_t n = encode_frame(frame, 1, OP_BINARY, payload, size, 1);
+
+  uint64_t start = now_us();
+  int sent = 0, received = 0;
+  while (received < count) {
+    while (sent < count && sent - received < window) {
+      if (write_all(fd, frame, n) < 0) break;
+      sent++;
+    }
+    unsigned char* got;
+    uint64_t got_size;
+    if (recv_frame(fd, &got, &got_size) != OP_BINARY || got_size != reply_size) {
+      CHECK(0, "bench echo");
+      break;
+    }
+    free(got);
+    received++;
+  }
+  double seconds = (now_us() - start) / 1e6;
+
+  int rounds = count < 1000 ? count : 1000;
+  uint64_t* samples = malloc(rounds * sizeof(uint64_t));
+  int sampled = 0;
+  for (; sampled < rounds; sampled++) {
+    start = now_us();
+    write_all(fd, frame, n);
+    unsigned char* got;
+    uint64_t got_size;
+    if (recv_frame(fd, &got, &got_size) < 0) break;
+    free(got);
+    samples[sampled] = now_us() - start;
+  }
+  qsort(samples, sampled, sizeof(uint64_t), compare_u64);
+
+  printf("%s %8zu bytes x %6d: %9.0f msg/s %9.1f MB/s", receive_only ? "receive" : "echo   ", size, received, received / seconds,
+         received * (double)size / seconds / 1e6);
+  if (sampled > 0) printf(", round trip p50 %6" PRIu64 " us p99 %6" PRIu64 " us", samples[sampled / 2], samples[sampled * 99 / 100]);
+  printf("\n");
+
+  free(samples);
+  free(frame);
+  free(payload);
+  close(fd);
+}
+
+/* Connects, upgrades and disconnects `rounds` times, with the request written whole or `chunk` bytes at a time. */
+static void bench_handshake(int rounds, size_t chunk)
+{
+  uint64_t start = now_us();
+  int done = 0;
+  for (; done < rounds; done++) {
+    int fd = client_connect_split(NULL, chunk);
+    if (fd < 0) {
+      CHECK(0, "handshake bench connect");
+      break;
+    }
+    close(fd);
+  }
+  double seconds = (now_us() - start) / 1e6;
+  char request[32] = "whole request";
+  if (chunk > 0) snprintf(request, sizeof(request), "%zu B writes", chunk);
+  printf("handshake %-13s x %6d: %9.0f handshakes/s, %7.1f us each\n", request, done, done / seconds, seconds * 1e6 / done);
+}
+
+#ifdef CWS_HAVE_ZLIB
+/**
+ * Echoes `count` messages without and with permessage-deflate, to weigh the CPU it costs against the bytes it saves.
+ * The client compresses what it sends and inflates the replies, both sides keep their context between messages.
+ */
+static void bench_deflate(const char* name, const unsigned char* payload, size_t size, int count)
+{
+  double plain_us = 0;
+  for (int compressed = 0; compressed < 2; compressed++) {
+    int fd = client_connect(compressed ? "permessage-deflate" : NULL);
+    if (fd < 0) {
+      CHECK(0, "deflate bench connect");
+      return;
+    }
+
+    z_stream deflater = {0}, inflater = {0};
+    deflateInit2(&deflater, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
+    inflateInit2(&inflater, -15);
+    size_t capacity = deflateBound(&deflater, size) + 16;
+    unsigned char* body = malloc(capacity);
+    unsigned char* frame = malloc(capacity + 14);
+    unsigned char* inflated = malloc(size + 1);
+    uint64_t wire_bytes = 0;
+
+    uint64_t start = now_us();
+    for (int i = 0; i < count; i++) {
+      size_t body_size = size;
+      if (compressed) {
+        deflater.next_in = (unsigned char*)payload;
+        deflater.avail_in = size;
+        deflater.next_out = body;
+        deflater.avail_out = capacity;
+        deflate(&deflater, Z_SYNC_FLUSH);
+        // The empty block that ends a flush is left out, RFC 7692 7.2.1
+        body_size = capacity - deflater.avail_out - 4;
+      }
+      size_t n = encode_frame(frame, 1, OP_BINARY, compressed ? body : payload, body_size, 1);
+      frame[0] |= compressed ? RSV1 : 0;
+      if (write_all(fd, frame, n) < 0) break;
+
+      unsigned char* got;
+      uint64_t got_size;
+      int opcode = recv_frame(fd, &got, &got_size);
+      wire_bytes += body_size + got_size;
+      int ok = 0;
+      if (opcode == (OP_BINARY | RSV1)) {
+        got = realloc(got, got_size + 4);
+        memcpy(got + got_size, "\x00\x00\xff\xff", 4);
+        inflater.next_in = got;
+        inflater.avail_in = got_size + 4;
+        inflater.next_out = inflated;
+        inflater.avail_out = size + 1;
+        ok = inflate(&inflater, Z_SYNC_FLUSH) == Z_OK && size + 1 - inflater.avail_out == size && memcmp(inflated, payload, size) == 0;
+      } else if (opcode == OP_BINARY) {
+        ok = got_size == size && memcmp(got, payload, size) == 0;
+      }
+      free(got);
+      if (!ok) {
+        CHECK(0, "deflate bench echo");
+        break;
+      }
+    }
+    double us = (double)(now_us() - start) / count;
+    if (!compressed) plain_us = us;
+
+    printf("%-8s %8zu bytes x %6d: %s %7.1f us per echo, %5.1f%% of the bytes", name, size, count, compressed ? "deflate" : "plain  ", us,
+           100.0 * wire_bytes / (2.0 * size * count));
+    if (compressed) printf(", %+.1f us", us - plain_us);
+    printf("\n");
+
+    deflateEnd(&deflater);
+    inflateEnd(&inflater);
+    free(inflated);
+    free(frame);
+    free(body);
+    close(fd);
+  }
+}
+
+/* Inflates a compressed frame from the server with the context of the connection, returns the size or -1 */
+static int64_t inflate_frame(z_stream* inflater, unsigned char* payload, uint64_t size, unsigned char* out, size_t out_size)
+{
+  unsigned char* data = realloc(payload, size + 4);
+  if (data == NULL) {
+    free(payload);
+    return -1;
+  }
+  memcpy(data + size, "\x00\x00\xff\xff", 4);
+  inflater->next_in = data;
+  inflater->avail_in = size + 4;
+  inflater->next_out = out;
+  inflater->avail_out = out_size;
+  int ret = inflate(inflater, Z_SYNC_FLUSH);
+  free(data);
+  return ret == Z_OK && inflater->avail_in == 0 ? (int64_t)(out_size - inflater->avail_out) : -1;
+}
+
+/**
+ * Has the server flood a compressed client that does not read, with `CWS_SEND_QUEUE_DROP` set.
+ * Frames may be dropped, but the ones that arrive and an echo after them have to inflate with the one context of the connection.
+ */
+static void test_deflate_drop(int threads)
+{
+  int fd = client_connect("permessage-deflate");
+  CHECK(fd >= 0, "deflate drop connect");
+  if (fd < 0) return;
+
+  z_stream inflater = {0};
+  inflateInit2(&inflater, -15);
+  unsigned char expected[FLOOD_SIZE];
+  unsigned char inflated[FLOOD_SIZE + 1];
+  unsigned char request = FLOOD;
+  send_frame(fd, 1, OP_BINARY, &request, 1);
+  // Give the server time to fill the socket and the queue before anything is read
+  usleep(200 * 1000);
+
+  // Whatever arrived is read until nothing more comes
+  struct timeval timeout = {.tv_usec = 500 * 1000};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  int received = 0, ok = 1;
+  int64_t last = -1;
+  unsigned char* got;
+  uint64_t got_size;
+  while (ok && recv_frame(fd, &got, &got_size) >= 0) {
+    uint32_t index = 0;
+    ok = inflate_frame(&inflater, got, got_size, inflated, sizeof(inflated)) == FLOOD_SIZE;
+    if (ok) memcpy(&index, inflated, sizeof(index));
+    ok = ok && index > last && index < FLOOD_COUNT;
+    if (ok) {
+      flood_message(expected, index);
+      ok = memcmp(inflated, expected, FLOOD_SIZE) == 0;
+      last = index;
+      received++;
+    }
+  }
+  CHECK(ok && errno == EAGAIN, "dropped compressed frames leave the rest intact");
+  CHECK(received + __atomic_load_n(&dropped, __ATOMIC_SEQ_CST) == FLOOD_COUNT, "every flood message sent or dropped");
+  // A thread per client blocks until the client reads, nothing is ever queued
+  CHECK(threads || received < FLOOD_COUNT, "flood dropped messages");
+
+  timeout.tv_sec = 5;
+  timeout.tv_usec = 0;
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  // The last message of the flood again, the server's context refers back to it whether it was dropped or not
+  flood_message(expected, FLOOD_COUNT - 1);
+  expected[0] = 'x';
+  send_frame(fd, 1, OP_BINARY, expected, FLOOD_SIZE);
+  int opcode = recv_frame(fd, &got, &got_size);
+  int64_t n = opcode == (OP_BINARY | RSV1) ? inflate_frame(&inflater, got, got_size, inflated, sizeof(inflated)) : -1;
+  if (opcode >= 0 && opcode != (OP_BINARY | RSV1)) free(got);
+  CHECK(n == FLOOD_SIZE && memcmp(inflated, expected, FLOOD_SIZE) == 0, "compressed echo after dropped frames");
+  printf("deflate flood %d of %d messages dropped\n", FLOOD_COUNT - received, FLOOD_COUNT);
+
+  inflateEnd(&inflater);
+  close(fd);
+}
+#endif
+
+/* Starts the server on `socket_path`, `CWS_SEND_QUEUE_DROP` comes with a queue and socket buffer of a few frames */
+static int start_server(int backend, int send_queue_policy)
+{
+  cws_endpoint_t endpoint = {.type = CWS_ENDPOINT_UNIX, .path = socket_path};
+  int drop = send_queue_policy == CWS_SEND_QUEUE_DROP;
+  int ret = cws_start((cws_server_t){
+      .endpoints = &endpoint,
+      .endpoint_count = 1,
+      .backend = backend,
+      .max_message_size = MAX_MESSAGE_SIZE,
+      .send_queue_max_bytes = drop ? 4 * FLOOD_SIZE : 0,
+      .send_queue_policy = send_queue_policy,
+      .ping_interval_ms = -1,
+      .send_buffer_size = drop ? FLOOD_SIZE : 0,
+      .on_open = on_open,
+      .on_close = on_close,
+      .on_message = on_message,
+  });
+  if (ret != CWS_START_SUCCESS) {
+    fprintf(stderr, "cws_start failed: %d\n", ret);
+  }
+  return ret;
+}
+
+int main(int argc, char** argv)
+{
+  int backend = argc > 1 ? atoi(argv[1]) : CWS_BACKEND_DEFAULT;
+  // The failure tests keep writing after the server closed the connection
+  signal(SIGPIPE, SIG_IGN);
+  snprintf(socket_path, sizeof(socket_path), "/tmp/cws-selftest-%d.sock", (int)getpid());
+
+  if (start_server(backend, CWS_SEND_QUEUE_DISCONNECT) != CWS_START_SUCCESS) {
+    return 1;
+  }
+
+  cws_stats_t stats;
+  cws_get_stats(&stats);
+  printf("backend %d\n", stats.backend);
+
+  test_handshake();
+  test_messages();
+  test_failures();
+
+  bench(16, 100000, 64, 0);
+  bench(1024, 50000, 64, 0);
+  bench(64 * 1024, 5000, 2, 0);
+  bench(MAX_MESSAGE_SIZE, 200, 1, 0);
+  bench(64 * 1024, 20000, 16, 1);
+  bench(MAX_MESSAGE_SIZE, 1000, 16, 1);
+  bench_handshake(5000, 0);
+  bench_handshake(5000, 16);
+
+#ifdef CWS_HAVE_ZLIB
+  // The same player update over and over is the best case for context takeover, covers are already compressed
+  const char* metadata = "1 7 7|YouTube|Some Song Title \\| Live|The Artist|The Album|https://i.ytimg.com/vi/abcdefghijk/hqdefault.jpg|"
+                         "0|123|245|80|0|1|0|1|7|1|1|1|1|1|0|1|1|1700000000000|1700000012345|1700000012345";
+  bench_deflate("metadata", (const unsigned char*)metadata, strlen(metadata), 20000);
+  unsigned char* cover = malloc(100 * 1024);
+  uint32_t seed = 1;
+  for (size_t i = 0; i < 100 * 1024; i++) {
+    seed = seed * 1664525 + 1013904223;
+    cover[i] = seed >> 24;
+  }
+  bench_deflate("cover", cover, 100 * 1024, 500);
+  free(cover);
+
+  // A small queue and socket buffer that drop most of a flood
+  cws_stop();
+  if (start_server(backend, CWS_SEND_QUEUE_DROP) != CWS_START_SUCCESS) {
+    return 1;
+  }
+  test_deflate_drop(stats.backend == CWS_BACKEND_THREADS);
+#endif
+
+  cws_stop();
+  CHECK(opened > 0 && opened == closed, "on_open and on_close paired");
+
+  if (failures > 0) {
+    fprintf(stderr, "%d checks failed\n", failures);
+    return 1;
+  }
+  printf("all checks passed\n");
+  return 0;
+}
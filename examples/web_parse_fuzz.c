@@ -0,0 +1,526 @@
+/**
+ * Fuzz and benchmark harness for the WEB message parsers: the span based text parser (revision 3 and deltas)
+ * and the revision 4 TLV parser. web.c is included so its static parsers can be called directly,
+ * the functions it needs from the rest of the library are stubbed below.
+ *
+ * With libFuzzer:  clang -g -O1 -fsanitize=fuzzer,address,undefined -DWEB_FUZZ_LIBFUZZER -DWNP_BUILD_PLATFORM_WEB \
+ *                    -Iinclude -Isrc -Ideps examples/web_parse_fuzz.c -o web_parse_fuzz
+ * Without it the same entry point is fed generated messages: web_parse_fuzz [iterations], or input files to replay
+ * them. `web_parse_fuzz bench` times the parsers on typical messages.
+ */
+
+#define THREAD_IMPLEMENTATION
+#include "web.c"
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * | Stubs |
+ */
+
+wnp_player_t WNP_DEFAULT_PLAYER = {0};
+
+void __wnp_get_args(wnp_args_t* args_out)
+{
+  memset(args_out, 0, sizeof(wnp_args_t));
+}
+
+int __wnp_start_update_cycle(wnp_player_t players_out[WNP_MAX_PLAYERS])
+{
+  (void)players_out;
+  return 0;
+}
+
+int __wnp_add_player(wnp_player_t* player)
+{
+  (void)player;
+  return -1;
+}
+
+void __wnp_update_player(wnp_player_t* player)
+{
+  (void)player;
+}
+
+void __wnp_remove_player(int player_id)
+{
+  (void)player_id;
+}
+
+void __wnp_end_update_cycle()
+{
+}
+
+bool __wnp_write_cover(int player_id, void* data, uint64_t size)
+{
+  (void)player_id;
+  (void)data;
+  (void)size;
+  return false;
+}
+
+FILE* __wnp_open_cover(int player_id, char tmp_path_out[WNP_STR_LEN])
+{
+  (void)player_id;
+  (void)tmp_path_out;
+  return NULL;
+}
+
+bool __wnp_close_cover(int player_id, FILE* file, const char tmp_path[WNP_STR_LEN], bool commit)
+{
+  (void)player_id;
+  (void)file;
+  (void)tmp_path;
+  (void)commit;
+  return false;
+}
+
+bool __wnp_get_cover_path(int player_id, char cover_path_out[WNP_STR_LEN])
+{
+  (void)player_id;
+  (void)cover_path_out;
+  return false;
+}
+
+void __wnp_set_event_result(int event_id, wnp_event_result_t result)
+{
+  (void)event_id;
+  (void)result;
+}
+
+int cws_start(cws_server_t server)
+{
+  (void)server;
+  return CWS_START_THREAD_FAILED;
+}
+
+int cws_stop()
+{
+  return 0;
+}
+
+int cws_send(cws_client_t* client, const char* msg, uint64_t size, int type)
+{
+  (void)client;
+  (void)msg;
+  (void)size;
+  (void)type;
+  return -1;
+}
+
+void cws_set_data(cws_client_t* client, void* data)
+{
+  (void)client;
+  (void)data;
+}
+
+void* cws_get_data(cws_client_t* client)
+{
+  (void)client;
+  return NULL;
+}
+
+int cws_get_stats(cws_stats_t* out)
+{
+  (void)out;
+  return -1;
+}
+
+/**
+ * | Fuzzing |
+ */
+
+#define FUZZ_ASSERT(cond)                                                                                                                            \
+  do {                                                                                                                                               \
+    if (!(cond)) {                                                                                                                                   \
+      fprintf(stderr, "web_parse_fuzz: %s failed at line %d\n", #cond, __LINE__);                                                                    \
+      abort();                                                                                                                                       \
+    }                                                                                                                                                \
+  } while (0)
+
+typedef struct {
+  wnp_player_t player;
+  _web_platform_data_t platform_data;
+} fuzz_player_t;
+
+static void fuzz_player_init(fuzz_player_t* p)
+{
+  memset(p, 0, sizeof(fuzz_player_t));
+  p->player.platform = WNP_PLATFORM_WEB;
+  p->player._platform_data = &p->platform_data;
+}
+
+static bool fuzz_player_equal(const fuzz_player_t* a, const fuzz_player_t* b)
+{
+  return memcmp(&a->player, &b->player, offsetof(wnp_player_t, _platform_data)) == 0 && a->platform_data.port_id == b->platform_data.port_id;
+}
+
+/* Every string field has to stay terminated within its buffer */
+static void fuzz_check_strings(const wnp_player_t* player)
+{
+  const char* strs[] = {player->name, player->title, player->artist, player->album, player->cover_src};
+  for (size_t i = 0; i < sizeof(strs) / sizeof(strs[0]); i++) {
+    FUZZ_ASSERT(memchr(strs[i], '\0', WNP_STR_LEN) != NULL);
+  }
+}
+
+static void fuzz_text(const char* data, size_t size, uint32_t fields)
+{
+  // An exact-size copy, so sanitizers catch any read past the span, and to check the message is left untouched
+  char* text = malloc(size > 0 ? size : 1);
+  memcpy(text, data, size);
+
+  fuzz_player_t p;
+  fuzz_player_init(&p);
+  uint32_t changed = _web_parse_player_text(&p.player, (_web_span_t){text, size}, fields);
+  FUZZ_ASSERT((changed & ~fields) == 0);
+  FUZZ_ASSERT(memcmp(text, data, size) == 0);
+  fuzz_check_strings(&p.player);
+
+  // Every field is set at most once, so the same message again changes nothing
+  fuzz_player_t again = p;
+  again.player._platform_data = &again.platform_data;
+  FUZZ_ASSERT(_web_parse_player_text(&again.player, (_web_span_t){text, size}, fields) == 0);
+  FUZZ_ASSERT(fuzz_player_equal(&p, &again));
+  free(text);
+}
+
+static void fuzz_binary(const unsigned char* data, size_t size)
+{
+  unsigned char* copy = malloc(size > 0 ? size : 1);
+  memcpy(copy, data, size);
+
+  fuzz_player_t p, before;
+  fuzz_player_init(&p);
+  _web_assign_str(p.player.title, "unchanged");
+  before = p;
+
+  uint32_t changed;
+  bool ok = _web_parse_player_binary(&p.player, copy, size, &changed);
+  if (!ok) {
+    // Malformed messages are rejected as a whole
+    FUZZ_ASSERT(fuzz_player_equal(&p, &before));
+  } else {
+    FUZZ_ASSERT((changed & ~WNP_ALL_PLAYER_FIELDS) == 0);
+    // A repeated tag can set a field back, so only the other direction holds
+    FUZZ_ASSERT(changed != 0 || fuzz_player_equal(&p, &before));
+  }
+  fuzz_check_strings(&p.player);
+  free(copy);
+}
+
+/* Escapes NUL separated strings into the string fields of a message, parsing it has to give back the same strings */
+static void fuzz_roundtrip(const char* data, size_t size)
+{
+  char expected[5][WNP_STR_LEN] = {{0}};
+  char* text = malloc(16 + 5 * 2 * WNP_STR_LEN);
+  size_t n = 0;
+  text[n++] = '7';
+  text[n++] = '|';
+
+  size_t pos = 0;
+  for (int field = 0; field < 5; field++) {
+    size_t len = 0;
+    while (pos < size && data[pos] != '\0') {
+      // A '\' at the end would escape the separator and '\1' first means an empty value, the extension sends neither
+      if (len < WNP_STR_LEN - 1 && !(len == 0 && data[pos] == '\1')) expected[field][len++] = data[pos];
+      pos++;
+    }
+    pos++;
+    while (len > 0 && expected[field][len - 1] == '\\') expected[field][--len] = '\0';
+
+    for (size_t i = 0; i < len; i++) {
+      if (expected[field][i] == '|') text[n++] = '\\';
+      text[n++] = expected[field][i];
+    }
+    text[n++] = '|';
+  }
+
+  fuzz_player_t p;
+  fuzz_player_init(&p);
+  _web_parse_player_text(&p.player, (_web_span_t){text, n}, WNP_ALL_PLAYER_FIELDS);
+  FUZZ_ASSERT(p.platform_data.port_id == 7);
+  const char* got[] = {p.player.name, p.player.title, p.player.artist, p.player.album, p.player.cover_src};
+  for (int field = 0; field < 5; field++) {
+    FUZZ_ASSERT(strcmp(got[field], expected[field]) == 0);
+  }
+  free(text);
+}
+
+/* The splitters have to consume the whole span and only return pieces of it */
+static void fuzz_spans(const char* data, size_t size)
+{
+  for (int mode = 0; mode < 2; mode++) {
+    _web_span_t rest = {data, size};
+    size_t consumed = 0;
+    while (rest.size > 0) {
+      size_t before = rest.size;
+      _web_span_t token = mode == 0 ? _web_span_next(&rest, ' ') : _web_span_next_field(&rest);
+      FUZZ_ASSERT(token.data >= data && token.data + token.size <= data + size);
+      FUZZ_ASSERT(rest.size < before);
+      consumed += before - rest.size;
+
+      int64_t value;
+      _web_span_int(token, &value);
+    }
+    FUZZ_ASSERT(consumed == size);
+  }
+}
+
+/* The first byte picks the check, a delta mask follows it for text deltas */
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+{
+  if (size < 1) return 0;
+
+  uint8_t mode = data[0] % 4;
+  data++;
+  size--;
+
+  if (mode == 0) {
+    fuzz_text((const char*)data, size, WNP_ALL_PLAYER_FIELDS);
+  } else if (mode == 1) {
+    if (size < 4) return 0;
+    uint32_t fields = (uint32_t)_web_read_le(data, 4) & WNP_ALL_PLAYER_FIELDS;
+    fuzz_text((const char*)data + 4, size - 4, fields);
+  } else if (mode == 2) {
+    fuzz_binary(data, size);
+  } else {
+    fuzz_roundtrip((const char*)data, size);
+  }
+  fuzz_spans((const char*)data, size);
+  return 0;
+}
+
+#ifndef WEB_FUZZ_LIBFUZZER
+
+/**
+ * | Standalone driver |
+ */
+
+#include <time.h>
+
+static uint64_t rng_state = 88172645463325252ULL;
+
+static uint64_t rng()
+{
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 7;
+  rng_state ^= rng_state << 17;
+  return rng_state;
+}
+
+/* Pipe separated fields with numbers, escapes and long strings */
+static size_t generate_text(unsigned char* out, size_t capacity)
+{
+  static const char alphabet[] = "a|\\\\||0123456789-+ \t\x01x";
+  size_t n = 0;
+  size_t fields = rng() % 30;
+  for (size_t i = 0; i < fields && n + 40 < capacity; i++) {
+    int kind = rng() % 4;
+    if (kind == 0) {
+      n += snprintf((char*)out + n, capacity - n, "%lld", (long long)(rng() % 4000000001ULL) - 2000000000LL);
+    } else if (kind == 1) {
+      n += snprintf((char*)out + n, capacity - n, "%llu", (unsigned long long)rng() >> (rng() % 64));
+    } else {
+      size_t len = rng() % (kind == 3 ? 700 : 12);
+      for (size_t j = 0; j < len && n + 2 < capacity; j++) {
+        out[n++] = alphabet[rng() % (sizeof(alphabet) - 1)];
+      }
+    }
+    if (rng() % 8) out[n++] = '|';
+  }
+  return n;
+}
+
+/* Tag, length, value triples for known and unknown tags, sometimes cut short or with a wrong length */
+static size_t generate_binary(unsigned char* out, size_t capacity)
+{
+  size_t n = 0;
+  size_t fields = rng() % 30;
+  for (size_t i = 0; i < fields && n + 1024 < capacity; i++) {
+    uint8_t tag = rng() % (WNP_PLAYER_FIELDS + 4);
+    size_t len = rng() % 4 == 0 ? rng() % 700 : rng() % 10;
+    if (rng() % 16 == 0) len = rng() % 65536;
+    out[n++] = tag;
+    out[n++] = len & 255;
+    out[n++] = len >> 8;
+    for (size_t j = 0; j < len && j < 700; j++) {
+      out[n++] = (unsigned char)rng();
+    }
+  }
+  if (n > 0 && rng() % 8 == 0) n -= rng() % n;
+  return n;
+}
+
+/* NUL separated strings full of separators and escapes */
+static size_t generate_strings(unsigned char* out, size_t capacity)
+{
+  static const char alphabet[] = "ab|\\\\ \x01";
+  size_t n = 0;
+  for (int i = 0; i < 5 && n + 700 < capacity; i++) {
+    size_t len = rng() % (rng() % 8 ? 16 : 700);
+    for (size_t j = 0; j < len; j++) {
+      out[n++] = alphabet[rng() % (sizeof(alphabet) - 1)];
+    }
+    out[n++] = '\0';
+  }
+  return n;
+}
+
+static int run_generated(long iterations)
+{
+  static unsigned char input[65536];
+  for (long i = 0; i < iterations; i++) {
+    input[0] = rng() % 4;
+    size_t size = 1;
+    if (input[0] == 1) {
+      uint32_t mask = rng() % 3 ? WNP_ALL_PLAYER_FIELDS : (uint32_t)rng();
+      memcpy(input + 1, &mask, 4);
+      size += 4;
+    }
+    if (input[0] == 2) {
+      size += generate_binary(input + size, sizeof(input) - size);
+    } else if (input[0] == 3) {
+      size += generate_strings(input + size, sizeof(input) - size);
+    } else {
+      size += generate_text(input + size, sizeof(input) - size);
+    }
+    LLVMFuzzerTestOneInput(input, size);
+  }
+  printf("%ld generated messages passed\n", iterations);
+  return 0;
+}
+
+static int run_file(const char* path)
+{
+  FILE* file = fopen(path, "rb");
+  if (file == NULL) {
+    fprintf(stderr, "can not open %s\n", path);
+    return 1;
+  }
+  static unsigned char input[1 << 20];
+  size_t size = fread(input, 1, sizeof(input), file);
+  fclose(file);
+  LLVMFuzzerTestOneInput(input, size);
+  printf("%s passed\n", path);
+  return 0;
+}
+
+static double now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static size_t tlv_str(unsigned char* out, int tag, const char* str)
+{
+  size_t len = strlen(str);
+  out[0] = tag;
+  out[1] = len & 255;
+  out[2] = len >> 8;
+  memcpy(out + 3, str, len);
+  return len + 3;
+}
+
+static size_t tlv_int(unsigned char* out, int tag, uint64_t value, int width)
+{
+  out[0] = tag;
+  out[1] = width;
+  out[2] = 0;
+  for (int i = 0; i < width; i++) {
+    out[3 + i] = (value >> (8 * i)) & 255;
+  }
+  return width + 3;
+}
+
+/* A full player message and a position update, as text, as a delta and as TLV */
+static int run_bench()
+{
+  const char* full = "7|YouTube|Some Song Title \\| Live|The Artist|The Album|https://i.ytimg.com/vi/abcdefghijk/hqdefault.jpg|0|123|245|80|"
+                     "0|1|0|1|7|1|1|1|1|1|0|1|1|1700000000000|1700000012345|1700000012345";
+  const char* tick = "||||||124||||||||||||||||||1700000013345|1700000013345";
+  const char* delta = "124|1700000013345|1700000013345";
+  uint32_t delta_fields = (1u << 7) | (1u << 24) | (1u << 25);
+
+  unsigned char full_bin[1024];
+  size_t full_bin_size = 0;
+  const char* strs[] = {"YouTube", "Some Song Title | Live", "The Artist", "The Album", "https://i.ytimg.com/vi/abcdefghijk/hqdefault.jpg"};
+  full_bin_size += tlv_int(full_bin, 0, 7, 1);
+  for (int i = 0; i < 5; i++) {
+    full_bin_size += tlv_str(full_bin + full_bin_size, i + 1, strs[i]);
+  }
+  int ints[] = {0, 123, 245, 80, 0, 1, 0, 1, 7, 1, 1, 1, 1, 1, 0, 1, 1};
+  for (int i = 0; i < 17; i++) {
+    full_bin_size += tlv_int(full_bin + full_bin_size, i + 6, ints[i], ints[i] > 255 ? 2 : 1);
+  }
+  for (int i = 0; i < 3; i++) {
+    full_bin_size += tlv_int(full_bin + full_bin_size, i + 23, 1700000000000ULL + i, 6);
+  }
+  unsigned char tick_bin[64];
+  size_t tick_bin_size = tlv_int(tick_bin, 7, 124, 1);
+  tick_bin_size += tlv_int(tick_bin + tick_bin_size, 24, 1700000013345ULL, 6);
+  tick_bin_size += tlv_int(tick_bin + tick_bin_size, 25, 1700000013345ULL, 6);
+
+  fuzz_player_t p;
+  fuzz_player_init(&p);
+  const int rounds = 2000000;
+  volatile uint32_t sink = 0;
+  uint32_t changed;
+
+  double start = now_ns();
+  for (int i = 0; i < rounds; i++) {
+    sink += _web_parse_player_text(&p.player, (_web_span_t){full, strlen(full)}, WNP_ALL_PLAYER_FIELDS);
+  }
+  double full_text = (now_ns() - start) / rounds;
+
+  start = now_ns();
+  for (int i = 0; i < rounds; i++) {
+    sink += _web_parse_player_text(&p.player, (_web_span_t){tick, strlen(tick)}, WNP_ALL_PLAYER_FIELDS);
+  }
+  double tick_text = (now_ns() - start) / rounds;
+
+  start = now_ns();
+  for (int i = 0; i < rounds; i++) {
+    sink += _web_parse_player_text(&p.player, (_web_span_t){delta, strlen(delta)}, delta_fields);
+  }
+  double delta_text = (now_ns() - start) / rounds;
+
+  start = now_ns();
+  for (int i = 0; i < rounds; i++) {
+    _web_parse_player_binary(&p.player, full_bin, full_bin_size, &changed);
+    sink += changed;
+  }
+  double full_binary = (now_ns() - start) / rounds;
+
+  start = now_ns();
+  for (int i = 0; i < rounds; i++) {
+    _web_parse_player_binary(&p.player, tick_bin, tick_bin_size, &changed);
+    sink += changed;
+  }
+  double tick_binary = (now_ns() - start) / rounds;
+
+  printf("full player: text %zu bytes %.0f ns, binary %zu bytes %.0f ns\n", strlen(full), full_text, full_bin_size, full_binary);
+  printf("position tick: text %zu bytes %.0f ns, delta %zu bytes %.0f ns, binary %zu bytes %.0f ns\n", strlen(tick), tick_text, strlen(delta),
+         delta_text, tick_bin_size, tick_binary);
+  return sink == 0xFFFFFFFF;
+}
+
+int main(int argc, char** argv)
+{
+  if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+    return run_bench();
+  }
+
+  if (argc > 1 && (argv[1][0] < '0' || argv[1][0] > '9')) {
+    for (int i = 1; i < argc; i++) {
+      if (run_file(argv[i]) != 0) return 1;
+    }
+    return 0;
+  }
+
+  return run_generated(argc > 1 ? atol(argv[1]) : 200000);
+}
+
+#endif /* WEB_FUZZ_LIBFUZZER */
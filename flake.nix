@@ -19,11 +19,11 @@
         src = ./.;
         nativeBuildInputs = [ pkgs.cmake ]
           ++ lib.optionals pkgs.stdenv.hostPlatform.isLinux [ pkgs.pkg-config ];
-        buildInputs = lib.optionals pkgs.stdenv.hostPlatform.isLinux [ pkgs.glib ];
+        buildInputs = [ pkgs.zlib ] ++ lib.optionals pkgs.stdenv.hostPlatform.isLinux [ pkgs.glib ];
       };
       devShells.default = pkgs.mkShell {
         shellHook = "exec $SHELL";
-        buildInputs = with pkgs; [ clang cmake glib pkg-config ];
+        buildInputs = with pkgs; [ clang cmake glib pkg-config zlib ];
       };
     };
   };
@@ -69,6 +69,8 @@ typedef struct {
    * The path to the cover of the playing media.
    * Can be an empty string if no cover exists.
    * If not empty, this is always a png, starting with file://
+   * Covers are stored in a directory owned by this process,
+   * which is removed again by `wnp_uninit`.
    */
   char cover[WNP_STR_LEN];
   /**
@@ -158,9 +160,17 @@ typedef struct {
  */
 extern wnp_player_t WNP_DEFAULT_PLAYER;
 
-/* args for `wnp_init` */
+/* Why a WEB client was turned away */
+typedef enum {
+  /* `web_max_clients` are connected */
+  WNP_WEB_REJECT_FULL = 0,
+  /* There was no memory for another client */
+  WNP_WEB_REJECT_NO_MEMORY = 1,
+} wnp_web_reject_reason_t;
+
+/* args for `wnp_init`. New fields go after `callback_data`, so the earlier ones keep their offsets */
 typedef struct {
-  /* Port number for the WEB platform. Set to 0 to disable WEB. */
+  /* Port number for the WEB platform, on 127.0.0.1 and ::1 (if available). Set to 0 to disable WEB. */
   int web_port;
   /* Adapter version (semver) */
   char adapter_version[WNP_STR_LEN];
@@ -174,6 +184,33 @@ typedef struct {
   void (*on_active_player_changed)(wnp_player_t* player, void* data);
   // Additional data to be passed to callback functions
   void* callback_data;
+  /**
+   * Number of threads used to decode covers.
+   * Set to 0 to pick one based on the number of CPUs.
+   * Currently only used by the LINUX platform.
+   */
+  int cover_threads;
+  /**
+   * Keepalive for WEB clients, in milliseconds.
+   * Clients are pinged every `web_ping_interval_ms` and dropped together with their players
+   * if they miss a pong for `web_pong_timeout_ms` or send nothing for `web_idle_timeout_ms`.
+   * Set to 0 for the defaults (5000, 5000, 60000) or to a negative value to disable.
+   */
+  int web_ping_interval_ms;
+  int web_pong_timeout_ms;
+  int web_idle_timeout_ms;
+  /* Do not compress WEB traffic (permessage-deflate), saves CPU when the browser runs on the same machine. */
+  bool web_disable_deflate;
+  /**
+   * Also accept WEB clients on this Unix domain socket, for native clients on the same machine.
+   * A filesystem path, or a name starting with '@' for the abstract namespace (Linux only). Leave empty to disable.
+   * Ignored on Windows.
+   */
+  char web_unix_socket[WNP_STR_LEN];
+  /* Maximum number of connected WEB clients (browser tabs with the extension). Set to 0 for the default (256). */
+  int web_max_clients;
+  // Callback invoked when a WEB client is turned away, see `wnp_web_reject_reason_t`; called from a WEB thread
+  void (*on_web_client_rejected)(wnp_web_reject_reason_t reason, int connected_clients, void* data);
 } wnp_args_t;
 
 /* Return values for `wnp_init` */
@@ -183,6 +220,8 @@ typedef enum {
   WNP_INIT_WEB_PORT_IN_USE = 2,
   WNP_INIT_LINUX_DBUS_ERROR = 3,
   WNP_INIT_DARWIN_FAILED = 4,
+  WNP_INIT_WEB_UNIX_SOCKET_FAILED = 5,
+  WNP_INIT_WEB_FAILED = 6,
 } wnp_init_ret_t;
 
 /* Initializes and starts WebNowPlaying. */
@@ -216,6 +255,41 @@ bool wnp_get_active_player(wnp_player_t* player_out);
  */
 int wnp_get_all_players(wnp_player_t players_out[WNP_MAX_PLAYERS]);
 
+/* Counters of the WEB platform, see `wnp_get_web_stats` */
+typedef struct {
+  /* Covers that arrived before their player and were held until it is added */
+  uint64_t pending_covers_stored;
+  /* Held covers that were handed to their player */
+  uint64_t pending_covers_claimed;
+  /* Held covers that were replaced by a newer one for the same player */
+  uint64_t pending_covers_replaced;
+  /* Held covers whose player was not added in time */
+  uint64_t pending_covers_expired;
+  /* Held covers that were dropped to stay within the memory limits */
+  uint64_t pending_covers_evicted;
+  /* Covers that were too large or did not arrive completely */
+  uint64_t pending_covers_rejected;
+  /* Memory currently held by pending covers */
+  uint64_t pending_cover_bytes;
+  /* Connected WEB clients, the most that were connected at once and the limit */
+  int clients;
+  int peak_clients;
+  int max_clients;
+  /* Connections accepted and turned away since `wnp_init` */
+  uint64_t clients_accepted;
+  uint64_t clients_rejected;
+  /* Memory held by the WebSocket server for its clients, including their outbound queues */
+  uint64_t client_bytes;
+  /* Bytes waiting in the outbound queues of all clients */
+  uint64_t queued_bytes;
+} wnp_web_stats_t;
+
+/**
+ * Copies the counters of the WEB platform into `stats_out`.
+ * Returns `false` if WebNowPlaying is not initialized or WEB is disabled.
+ */
+bool wnp_get_web_stats(wnp_web_stats_t* stats_out);
+
 /* Gets the current position in percent from 0.0f to 100.0f */
 float wnp_get_position_percent(wnp_player_t* player);
 
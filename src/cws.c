@@ -1,3 +1,7 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE // accept4
+#endif
+
 #define THREAD_IMPLEMENTATION
 #include "thread.h"
 
@@ -14,11 +18,61 @@
 #include <winsock2.h>
 #include <ws2tcpip.h>
 #else
+#include <errno.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <unistd.h>
 #endif
 
-#define MAX_CLIENTS 64
+#ifdef CWS_HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define CWS_HAVE_SSE2
+#endif
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#define CWS_HAVE_EPOLL
+
+// io_uring is driven through raw syscalls, the kernel headers need multishot receives (6.0)
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+#endif
+#ifdef IORING_RECV_MULTISHOT
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#define CWS_HAVE_IO_URING
+#endif
+#endif
+
+// Default for `max_clients`
+#define MAX_CLIENTS 256
+// Clients live in blocks that are allocated on demand and never move, so the table can be walked while it grows
+#define CLIENT_BLOCK_SIZE 64
+#define MAX_CLIENT_BLOCKS 64
+#define MAX_MESSAGE_SIZE (16 * 1024 * 1024)
+// Streamed messages are handed to `on_stream` in pieces of at most this size
+#define STREAM_CHUNK_SIZE (64 * 1024)
+#define SEND_TIMEOUT_MS 5000
+#define SEND_QUEUE_MAX_BYTES (4 * 1024 * 1024)
+#define TICK_MS 500
+#define PING_INTERVAL_MS 5000
+#define PONG_TIMEOUT_MS 5000
+#define IDLE_TIMEOUT_MS 60000
+#define DEFLATE_MIN_SIZE 64
+#define STOP_TIMEOUT_MS 2000
 
 #define STATE_CONNECTING 0
 #define STATE_OPEN 1
@@ -32,66 +86,231 @@
 #define OP_PING 0x9
 #define OP_PONG 0xA
 
-typedef struct {
-  cws_client_t* client;
-  unsigned char buf[2048];
-  unsigned char* msg;
-  unsigned char msg_ctrl[125];
-  uint64_t frame_size;
-  size_t amt_read;
-  int op;
-  size_t cur_pos;
-  int error;
-} cws_frame_t;
+#define IS_CONTROL(op) ((op) == OP_CLOSE || (op) == OP_PING || (op) == OP_PONG)
+
+#define PARSE_HEADER 0
+#define PARSE_PAYLOAD 1
+
+#define HANDSHAKE_MAX_SIZE 8192
+#define HANDSHAKE_TIMEOUT_MS 5000
+#define READ_BUFFER_SIZE (64 * 1024)
+#define DIRECT_READ_MIN (16 * 1024)
+#define MAX_EVENTS 64
+#define MAX_REACTORS 8
+// Submission queue size of each io_uring reactor, and the receive buffers it provides to the kernel
+#define RING_ENTRIES 256
+#define RING_BUFFERS 256
+#define RING_BUFFER_SIZE (16 * 1024)
+#define LISTEN_BACKLOG 64
+
+// Per-client receive buffers are kept between messages up to this size, larger messages borrow from the shared pool
+#define CLIENT_BUFFER_MAX (64 * 1024)
+#define BUFFER_POOL_SIZE 4
+#define BUFFER_POOL_MAX_BUFFER (4 * 1024 * 1024)
 
 typedef struct {
-  unsigned char* msg_data;
-  unsigned char* msg_ctrl;
-  uint8_t masks_data[4];
-  uint8_t masks_ctrl[4];
-  uint64_t msg_data_index;
-  uint64_t msg_ctrl_index;
-  uint64_t frame_length;
-  uint64_t frame_size;
-  int32_t pong_id;
+  unsigned char* data;
+  size_t capacity;
+} cws_buffer_t;
+
+/**
+ * Incremental frame parser state.
+ * Bytes are fed in as they arrive, so it works the same for blocking and non-blocking sockets.
+ */
+typedef struct {
+  int stage;
+  unsigned char header[14];
+  size_t header_len;
+  size_t header_need;
   uint8_t opcode;
   uint8_t is_fin;
-  uint8_t mask;
-  int cur_byte;
+  uint8_t masks[4];
+  uint64_t frame_length;
+  uint64_t frame_read;
+  int op;
+  // Points into either `own` or `large`
+  unsigned char* msg;
+  uint64_t msg_size;
+  cws_buffer_t own;
+  cws_buffer_t large;
+  unsigned char msg_ctrl[125];
   uint32_t utf8_state;
-} cws_frame_state_data_t;
+  // The current message was sent with RSV1 (permessage-deflate)
+  int compressed;
+  cws_buffer_t inflated;
+  // The current message is handed to `on_stream` as it arrives instead of being assembled in `msg`
+  int streaming;
+  uint64_t stream_offset;
+} cws_parser_t;
+
+/* A thread `cws_stop` waits for, `running` is cleared by the thread itself right before it returns. */
+typedef struct {
+  thread_ptr_t thread;
+  thread_atomic_int_t running;
+} cws_thread_t;
+
+/* A broadcast frame, encoded once and referenced by the queue of every client that could not take it right away. */
+typedef struct {
+  thread_atomic_int_t refs;
+  size_t size;
+  unsigned char data[];
+} cws_shared_t;
+
+/* Outgoing bytes that could not be written yet, drained by the reactor. */
+typedef struct cws_chunk {
+  struct cws_chunk* next;
+  size_t size;
+  size_t sent;
+  // Points either at `data` or into `shared`
+  const unsigned char* bytes;
+  cws_shared_t* shared;
+  unsigned char data[];
+} cws_chunk_t;
 
 struct cws_client {
   thread_mutex_t lock;
   int fd;
   int state;
   cws_server_t* server;
+  // Set for clients of the epoll backend, their sends are queued instead of blocking
+  int nonblocking;
+  // Outbound queue, guarded by `lock`
+  cws_chunk_t* queue_head;
+  cws_chunk_t* queue_tail;
+  size_t queued_bytes;
+  uint64_t queue_progress_at;
+  int want_write;
+#ifdef CWS_HAVE_ZLIB
+  // permessage-deflate, negotiated during the handshake. The deflater and its buffer are guarded by `lock`
+  int deflate;
+  int deflate_no_takeover;
+  z_stream deflater;
+  z_stream inflater;
+  cws_buffer_t deflated;
+#endif
   int32_t last_pong_id;
   int32_t current_ping_id;
+  uint64_t ping_sent_at;
+  uint64_t last_recv_at;
+  uint64_t connected_at;
+  cws_parser_t parser;
+  char handshake[HANDSHAKE_MAX_SIZE];
+  size_t handshake_len;
+  // Guarded by `lock`
+  cws_client_stats_t stats;
+  // Owned by the callbacks of the client, see `cws_set_data`
+  void* data;
+  // Used by the threads backend
+  cws_thread_t thread;
+#ifdef CWS_HAVE_EPOLL
+  // The reactor that owns the client, guarded by `lock`
+  struct cws_reactor* reactor;
+#endif
+#ifdef CWS_HAVE_IO_URING
+  // Requests the ring still owes a last completion for, the client is only dropped once they are done. Guarded by `lock`
+  int ring_ops;
+  int ring_closing;
+#endif
 };
 
+// Fits `sun_path` on every platform
+#define UNIX_PATH_SIZE 104
+
+// Each reactor may have its own listener per endpoint
+#define MAX_LISTENERS (CWS_MAX_ENDPOINTS * MAX_REACTORS)
+
+#ifdef CWS_HAVE_IO_URING
 typedef struct {
-  cws_server_t server;
   int fd;
+  // Any thread may have to wait for a socket to become writable, so submissions are guarded by `lock`
+  thread_mutex_t lock;
+  unsigned* sq_head;
+  unsigned* sq_tail;
+  unsigned* sq_array;
+  unsigned sq_mask;
+  unsigned sq_entries;
+  struct io_uring_sqe* sqes;
+  unsigned* cq_head;
+  unsigned* cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe* cqes;
+  void* ring_mem;
+  size_t ring_size;
+  size_t sqes_size;
+  // Receive buffers handed to the kernel, which picks one for every completed receive
+  struct io_uring_buf_ring* buf_ring;
+  size_t buf_ring_size;
+  unsigned char* buffers;
+  unsigned short buf_tail;
+  // Requests that have not posted their last completion yet
+  thread_atomic_int_t pending;
+  // Listeners whose multishot accept ended and that are armed again on the next tick
+  int accept_armed[MAX_LISTENERS];
+  int recv_multishot;
+  int draining;
+} cws_ring_t;
+#endif
+
+#ifdef CWS_HAVE_EPOLL
+typedef struct cws_reactor {
+  struct cws_server_data* server_data;
+  int epoll_fd;
+  int wake_fd;
+  cws_thread_t thread;
+#ifdef CWS_HAVE_IO_URING
+  // Set if the reactor runs on io_uring instead of epoll
+  cws_ring_t* ring;
+#endif
+} cws_reactor_t;
+#endif
+
+typedef struct cws_server_data {
+  cws_server_t server;
+  int fds[MAX_LISTENERS];
+  // Index of the reactor each listener belongs to
+  int fd_reactors[MAX_LISTENERS];
+  int fd_count;
+  // Filesystem sockets are removed again in `cws_stop`
+  char unix_paths[MAX_LISTENERS][UNIX_PATH_SIZE];
+  cws_thread_t server_thread;
+#ifndef _WIN32
+  // Wakes the server thread of the threads backend, Windows can not poll pipes and relies on the poll timeout
+  int wake_pipe[2];
+#endif
+#ifdef CWS_HAVE_EPOLL
+  cws_reactor_t reactors[MAX_REACTORS];
+  int reactor_count;
+#endif
 } cws_server_data_t;
 
+// `g_exit_flag` values
+#define EXIT_NONE 0
+#define EXIT_STOPPING 1
+// `cws_stop` gave up on some threads, they must not call back into the application anymore
+#define EXIT_ABANDONED 2
+
 static thread_mutex_t g_clients_mutex;
-static cws_client_t g_clients[MAX_CLIENTS];
+static cws_client_t* g_client_blocks[MAX_CLIENT_BLOCKS];
+// Slots in the allocated blocks, only grows while the server runs
+static thread_atomic_int_t g_client_slots;
+// Guarded by `g_clients_mutex`
+static int g_client_count;
+static int g_client_peak;
+static uint64_t g_clients_accepted;
+static uint64_t g_clients_rejected;
 static thread_atomic_int_t g_exit_flag;
+static thread_signal_t g_threads_signal;
 static cws_server_data_t g_server_data;
+static thread_mutex_t g_buffer_pool_mutex;
+static cws_buffer_t g_buffer_pool[BUFFER_POOL_SIZE];
 
-static unsigned char* base64_encode(const unsigned char* input, size_t length)
+/* Encodes `length` bytes into `output`, which needs room for 4 * ((length + 2) / 3) + 1 characters. */
+static void base64_encode(const unsigned char* input, size_t length, char* output)
 {
   static const char base64_chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
 
-  int output_length = 4 * ((length + 2) / 3);
-  unsigned char* encoded_data = (unsigned char*)malloc(output_length + 1);
-
-  if (encoded_data == NULL) {
-    return NULL;
-  }
-
-  int i = 0, j = 0;
+  size_t output_length = 4 * ((length + 2) / 3);
+  size_t i = 0, j = 0;
   while (i < length) {
     uint32_t octet_a = (i < length) ? input[i++] : 0;
     uint32_t octet_b = (i < length) ? input[i++] : 0;
@@ -99,721 +318,3075 @@ static unsigned char* base64_encode(const unsigned char* input, size_t length)
 
     uint32_t triple = (octet_a << 0x10) + (octet_b << 0x08) + octet_c;
 
-    encoded_data[j++] = base64_chars[(triple >> 3 * 6) & 0x3F];
-    encoded_data[j++] = base64_chars[(triple >> 2 * 6) & 0x3F];
-    encoded_data[j++] = base64_chars[(triple >> 1 * 6) & 0x3F];
-    encoded_data[j++] = base64_chars[(triple >> 0 * 6) & 0x3F];
+    output[j++] = base64_chars[(triple >> 3 * 6) & 0x3F];
+    output[j++] = base64_chars[(triple >> 2 * 6) & 0x3F];
+    output[j++] = base64_chars[(triple >> 1 * 6) & 0x3F];
+    output[j++] = base64_chars[(triple >> 0 * 6) & 0x3F];
   }
 
-  for (size_t i = 0; i < (3 - length % 3) % 3; i++) {
-    encoded_data[output_length - 1 - i] = '=';
+  for (size_t k = 0; k < (3 - length % 3) % 3; k++) {
+    output[output_length - 1 - k] = '=';
   }
 
-  encoded_data[j] = '\0';
-  return encoded_data;
+  output[j] = '\0';
 }
 
-static void close_fd(int fd)
-{
-#ifdef _WIN32
-  shutdown(fd, SD_BOTH);
-  closesocket(fd);
-#else
-  shutdown(fd, SHUT_RDWR);
-  close(fd);
-#endif
-}
+/**
+ * | Buffers |
+ */
 
-static ssize_t sendn_client(cws_client_t* client, const void* buf, size_t n, int flags)
+/* Grows `buffer` to at least `size` bytes, doubling so repeated growth stays cheap. */
+static int grow_buffer(cws_buffer_t* buffer, size_t size)
 {
-  if (client == NULL || client->fd == -1) {
-    return -1;
+  if (buffer->capacity >= size) {
+    return 0;
   }
 
-  ssize_t bytes = 0, ret = 0;
+  size_t capacity = buffer->capacity < 4096 ? 4096 : buffer->capacity;
+  while (capacity < size) {
+    capacity *= 2;
+  }
 
-  thread_mutex_lock(&client->lock);
-  while (bytes < n) {
-    ret = send(client->fd, (char*)buf + bytes, n - bytes, flags);
-    if (ret == -1) {
-      thread_mutex_unlock(&client->lock);
-      return -1;
-    }
-    bytes += ret;
+  unsigned char* data = realloc(buffer->data, capacity);
+  if (data == NULL) {
+    return -1;
   }
 
-  thread_mutex_unlock(&client->lock);
-  return bytes;
+  buffer->data = data;
+  buffer->capacity = capacity;
+  return 0;
 }
 
-int cws_send(cws_client_t* client, const char* msg, uint64_t size, int type)
+static void free_buffer(cws_buffer_t* buffer)
 {
-  unsigned char frame[10];
-  uint8_t data_start;
+  free(buffer->data);
+  buffer->data = NULL;
+  buffer->capacity = 0;
+}
 
-  frame[0] = (128 | type);
+/* Takes the smallest pooled buffer that holds `size` bytes, or grows another one if none does. */
+static int pool_acquire(cws_buffer_t* out, size_t size)
+{
+  int best = -1;
+
+  thread_mutex_lock(&g_buffer_pool_mutex);
+  for (int i = 0; i < BUFFER_POOL_SIZE; i++) {
+    if (g_buffer_pool[i].data == NULL) continue;
+    if (best == -1 || (g_buffer_pool[best].capacity < size && g_buffer_pool[i].capacity > g_buffer_pool[best].capacity) ||
+        (g_buffer_pool[i].capacity >= size && g_buffer_pool[i].capacity < g_buffer_pool[best].capacity)) {
+      best = i;
+    }
+  }
 
-  if (size <= 125) {
-    frame[1] = size & 0x7F;
-    data_start = 2;
-  } else if (size >= 126 && size <= 65535) {
-    frame[1] = 126;
-    frame[2] = (size >> 8) & 255;
-    frame[3] = size & 255;
-    data_start = 4;
+  if (best != -1) {
+    *out = g_buffer_pool[best];
+    g_buffer_pool[best].data = NULL;
+    g_buffer_pool[best].capacity = 0;
   } else {
-    frame[1] = 127;
-    frame[2] = (unsigned char)((size >> 56) & 255);
-    frame[3] = (unsigned char)((size >> 48) & 255);
-    frame[4] = (unsigned char)((size >> 40) & 255);
-    frame[5] = (unsigned char)((size >> 32) & 255);
-    frame[6] = (unsigned char)((size >> 24) & 255);
-    frame[7] = (unsigned char)((size >> 16) & 255);
-    frame[8] = (unsigned char)((size >> 8) & 255);
-    frame[9] = (unsigned char)((size >> 0) & 255);
-    data_start = 10;
+    out->data = NULL;
+    out->capacity = 0;
   }
+  thread_mutex_unlock(&g_buffer_pool_mutex);
 
-  int idx_response = 0;
-  unsigned char* response = malloc(sizeof(unsigned char) * (data_start + size + 1));
-  if (response == NULL) {
+  if (grow_buffer(out, size) < 0) {
+    free_buffer(out);
     return -1;
   }
 
-  for (int i = 0; i < data_start; i++) {
-    response[i] = frame[i];
-    idx_response++;
+  return 0;
+}
+
+/* Returns a buffer to the pool, replacing a smaller one if the pool is full. */
+static void pool_release(cws_buffer_t* buffer)
+{
+  if (buffer->data == NULL) {
+    return;
   }
 
-  for (int i = 0; i < size; i++) {
-    response[idx_response] = msg[i];
-    idx_response++;
+  if (buffer->capacity > BUFFER_POOL_MAX_BUFFER) {
+    free_buffer(buffer);
+    return;
   }
 
-  response[idx_response] = '\0';
+  int slot = -1;
+
+  thread_mutex_lock(&g_buffer_pool_mutex);
+  for (int i = 0; i < BUFFER_POOL_SIZE; i++) {
+    if (g_buffer_pool[i].data == NULL) {
+      slot = i;
+      break;
+    }
+    if (g_buffer_pool[i].capacity < buffer->capacity && (slot == -1 || g_buffer_pool[i].capacity < g_buffer_pool[slot].capacity)) {
+      slot = i;
+    }
+  }
 
-  ssize_t output = 0;
-  sendn_client(client, response, idx_response, MSG_NOSIGNAL);
+  if (slot != -1) {
+    cws_buffer_t evicted = g_buffer_pool[slot];
+    g_buffer_pool[slot] = *buffer;
+    buffer->data = NULL;
+    buffer->capacity = 0;
+    thread_mutex_unlock(&g_buffer_pool_mutex);
+    free_buffer(&evicted);
+    return;
+  }
+  thread_mutex_unlock(&g_buffer_pool_mutex);
 
-  free(response);
-  return output;
+  free_buffer(buffer);
 }
 
-static int send_close_frame(cws_frame_t* frame, int code)
+static void pool_clear()
 {
-  int cc;
-  if (code != -1) {
-    cc = code;
-    goto custom_close;
+  thread_mutex_lock(&g_buffer_pool_mutex);
+  for (int i = 0; i < BUFFER_POOL_SIZE; i++) {
+    free_buffer(&g_buffer_pool[i]);
   }
+  thread_mutex_unlock(&g_buffer_pool_mutex);
+}
 
-  if (frame->frame_size == 0 || frame->frame_size > 2) goto send;
-
-  if (frame->frame_size == 1)
-    cc = frame->msg_ctrl[0];
-  else
-    cc = ((int)frame->msg_ctrl[0]) << 8 | frame->msg_ctrl[1];
-
-  if ((cc < 1000 || cc > 1003) && (cc < 1007 || cc > 1011) && (cc < 3000 || cc > 4999)) {
-    cc = 1002;
-
-  custom_close:
-    frame->msg_ctrl[0] = (cc >> 8);
-    frame->msg_ctrl[1] = (cc & 0xFF);
-
-    if (cws_send(frame->client, (const char*)frame->msg_ctrl, sizeof(char) * 2, OP_CLOSE) < 0) {
+/* Makes room for a message of `size` bytes, keeping what was already received. */
+static int reserve_message(cws_parser_t* p, size_t size)
+{
+  // Stay in the clients own buffer until the message outgrows it
+  if ((p->msg == NULL || p->msg == p->own.data) && size <= CLIENT_BUFFER_MAX) {
+    if (grow_buffer(&p->own, size) < 0) {
       return -1;
     }
+    p->msg = p->own.data;
+    return 0;
+  }
 
+  if (p->large.capacity >= size) {
+    p->msg = p->large.data;
     return 0;
   }
 
-send:
-  if (cws_send(frame->client, (const char*)frame->msg_ctrl, frame->frame_size, OP_CLOSE) < 0) {
+  cws_buffer_t large;
+  if (pool_acquire(&large, size) < 0) {
     return -1;
   }
 
+  if (p->msg_size > 0) {
+    memcpy(large.data, p->msg, p->msg_size);
+  }
+
+  pool_release(&p->large);
+  p->large = large;
+  p->msg = large.data;
   return 0;
 }
 
-static void close_client(cws_client_t* client)
+/* Resets the parser for the next message, keeping the clients own buffer around. */
+static void reset_message(cws_parser_t* p)
 {
-  if (client == NULL || client->fd == -1) {
-    return;
+  pool_release(&p->large);
+  if (p->inflated.capacity > CLIENT_BUFFER_MAX) {
+    pool_release(&p->inflated);
   }
+  p->msg = NULL;
+  p->msg_size = 0;
+  p->op = -1;
+  p->utf8_state = 0;
+  p->streaming = 0;
+  p->stream_offset = 0;
+}
 
-  thread_mutex_lock(&g_clients_mutex);
-  client->state = STATE_CLOSED;
-  close_fd(client->fd);
-  client->fd = -1;
-  thread_mutex_term(&client->lock);
-  thread_mutex_unlock(&g_clients_mutex);
+static void reset_parser(cws_parser_t* p)
+{
+  reset_message(p);
+
+  cws_buffer_t own = p->own;
+  cws_buffer_t inflated = p->inflated;
+  memset(p, 0, sizeof(cws_parser_t));
+  p->own = own;
+  p->inflated = inflated;
+  p->op = -1;
+  p->header_need = 2;
+}
+
+static void close_fd(int fd)
+{
+#ifdef _WIN32
+  shutdown(fd, SD_BOTH);
+  closesocket(fd);
+#else
+  shutdown(fd, SHUT_RDWR);
+  close(fd);
+#endif
 }
 
-static int recv_next_byte(cws_frame_t* frame)
+static uint64_t now_ms()
 {
-  ssize_t n;
+#ifdef _WIN32
+  return GetTickCount64();
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+}
 
-  if (frame->cur_pos == 0 || frame->cur_pos == frame->amt_read) {
-    if ((n = recv(frame->client->fd, frame->buf, sizeof(frame->buf), 0)) <= 0) {
-      frame->error = 1;
-      return -1;
-    }
-    frame->amt_read = (size_t)n;
-    frame->cur_pos = 0;
+/**
+ * | Threads |
+ */
+
+static int start_thread(cws_thread_t* t, int (*proc)(void*), void* data)
+{
+  thread_atomic_int_store(&t->running, 1);
+  t->thread = thread_create(proc, data, THREAD_STACK_SIZE_DEFAULT);
+  if (t->thread == NULL) {
+    thread_atomic_int_store(&t->running, 0);
+    return -1;
   }
 
-  return (frame->buf[frame->cur_pos++]);
+  return 0;
 }
 
-static int recv_frame(cws_frame_t* frame, cws_frame_state_data_t* fsd)
+/* Called by a thread started with `start_thread` as the last thing before it returns. */
+static void finish_thread(cws_thread_t* t)
 {
-  uint64_t* frame_size;
-  unsigned char* tmp;
-  unsigned char* msg;
-  uint64_t* msg_index;
-  uint8_t* masks;
-  int cur_byte;
-  uint64_t i;
-
-  if (fsd->opcode == OP_CLOSE || fsd->opcode == OP_PING || fsd->opcode == OP_PONG) {
-    frame_size = &fsd->frame_size;
-    msg_index = &fsd->msg_ctrl_index;
-    masks = fsd->masks_ctrl;
-    msg = fsd->msg_ctrl;
-  } else {
-    frame_size = &frame->frame_size;
-    msg_index = &fsd->msg_data_index;
-    masks = fsd->masks_data;
-    msg = fsd->msg_data;
-  }
+  thread_atomic_int_store(&t->running, 0);
+  thread_signal_raise(&g_threads_signal);
+}
 
-  if (fsd->frame_length == 126) {
-    fsd->frame_length = (((uint64_t)recv_next_byte(frame)) << 8) | recv_next_byte(frame);
-  } else if (fsd->frame_length == 127) {
-    fsd->frame_length = (((uint64_t)recv_next_byte(frame)) << 56) | (((uint64_t)recv_next_byte(frame)) << 48) |
-                        (((uint64_t)recv_next_byte(frame)) << 40) | (((uint64_t)recv_next_byte(frame)) << 32) |
-                        (((uint64_t)recv_next_byte(frame)) << 24) | (((uint64_t)recv_next_byte(frame)) << 16) |
-                        (((uint64_t)recv_next_byte(frame)) << 8) | (((uint64_t)recv_next_byte(frame)));
+/**
+ * Joins `t` if it finishes before `deadline`, a deadline of 0 waits as long as it takes.
+ * A thread that is still running at the deadline is detached and -1 is returned.
+ */
+static int join_thread(cws_thread_t* t, uint64_t deadline)
+{
+  if (t->thread == NULL) {
+    return 0;
   }
 
-  *frame_size += fsd->frame_length;
+  uint64_t now = now_ms();
+  while (deadline != 0 && thread_atomic_int_load(&t->running) && now < deadline) {
+    thread_signal_wait(&g_threads_signal, (int)(deadline - now));
+    now = now_ms();
+  }
 
-  if (*frame_size > (16 * 1024 * 1024)) {
-    frame->error = 1;
+  if (deadline != 0 && thread_atomic_int_load(&t->running)) {
+    thread_detach(t->thread);
+    t->thread = NULL;
     return -1;
   }
 
-  masks[0] = recv_next_byte(frame);
-  masks[1] = recv_next_byte(frame);
-  masks[2] = recv_next_byte(frame);
-  masks[3] = recv_next_byte(frame);
+  // Waits for the thread and releases it
+  thread_destroy(t->thread);
+  t->thread = NULL;
+  return 0;
+}
 
-  if (frame->error) {
-    return -1;
+/**
+ * Shuts the connection down without closing it, so whoever owns the client notices and drops it.
+ * Lingering is turned off first, so the close resets the connection instead of flushing data nobody reads.
+ */
+static void kick_client_locked(cws_client_t* client)
+{
+  if (client->fd != -1) {
+    struct linger linger = {.l_onoff = 1, .l_linger = 0};
+    setsockopt(client->fd, SOL_SOCKET, SO_LINGER, (const char*)&linger, sizeof(linger));
+#ifdef _WIN32
+    shutdown(client->fd, SD_BOTH);
+#else
+    shutdown(client->fd, SHUT_RDWR);
+#endif
   }
+}
 
-  if (fsd->frame_length > 0) {
-    if (fsd->opcode != OP_CLOSE && fsd->opcode != OP_PING && fsd->opcode != OP_PONG) {
-      tmp = realloc(msg, *msg_index + fsd->frame_length + fsd->is_fin);
-      if (tmp == NULL) {
-        frame->error = 1;
-        return -1;
-      }
-      msg = tmp;
-      fsd->msg_data = msg;
+/**
+ * Sends as much of `head` followed by `body` as one call takes, starting at `offset`.
+ * Returns the number of bytes sent, 0 if a non-blocking socket is full or -1 on error.
+ */
+static ssize_t sendv_once(cws_client_t* client, const void* head, size_t head_size, const void* body, size_t body_size, size_t offset)
+{
+  const char* parts[2];
+  size_t sizes[2];
+  int count = 0;
+  if (offset < head_size) {
+    parts[count] = (const char*)head + offset;
+    sizes[count++] = head_size - offset;
+    if (body_size > 0) {
+      parts[count] = (const char*)body;
+      sizes[count++] = body_size;
     }
+  } else {
+    parts[count] = (const char*)body + (offset - head_size);
+    sizes[count++] = head_size + body_size - offset;
+  }
 
-    for (i = 0; i < fsd->frame_length; i++, (*msg_index)++) {
-      cur_byte = recv_next_byte(frame);
-      if (cur_byte == -1) {
-        return -1;
-      }
+#ifdef _WIN32
+  WSABUF bufs[2];
+  for (int i = 0; i < count; i++) {
+    bufs[i].buf = (char*)parts[i];
+    bufs[i].len = (ULONG)sizes[i];
+  }
 
-      msg[*msg_index] = cur_byte ^ masks[i % 4];
-    }
+  DWORD ret = 0;
+  if (WSASend(client->fd, bufs, count, &ret, 0, NULL, NULL) != 0) {
+    return -1;
+  }
+  return ret;
+#else
+  struct iovec iov[2];
+  for (int i = 0; i < count; i++) {
+    iov[i].iov_base = (void*)parts[i];
+    iov[i].iov_len = sizes[i];
   }
 
-  if (fsd->is_fin && *frame_size > 0) {
-    if (!fsd->frame_length && (fsd->opcode != OP_CLOSE && fsd->opcode != OP_PING && fsd->opcode != OP_PONG)) {
-      tmp = realloc(msg, *msg_index + 1);
-      if (tmp == NULL) {
-        frame->error = 1;
-        return -1;
-      }
-      msg = tmp;
-      fsd->msg_data = msg;
-    }
-    msg[*msg_index] = '\0';
+  struct msghdr message = {.msg_iov = iov, .msg_iovlen = count};
+  for (;;) {
+    ssize_t ret = sendmsg(client->fd, &message, MSG_NOSIGNAL);
+    if (ret >= 0) return ret;
+    if (errno == EINTR) continue;
+    if (client->nonblocking && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+    return -1;
   }
+#endif
+}
 
-  return 0;
+static void release_shared(cws_shared_t* shared)
+{
+  if (shared != NULL && thread_atomic_int_dec(&shared->refs) == 1) {
+    free(shared);
+  }
 }
 
-int valid_utf8(uint8_t* s, size_t len, uint32_t state)
+static void free_chunk(cws_chunk_t* chunk)
 {
-  // clang-format off
-  static const uint8_t utf8d[] = {
-    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, // 00..1f
-    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, // 20..3f
-    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, // 40..5f
-    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, // 60..7f
-    1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9, // 80..9f
-    7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7, // a0..bf
-    8,8,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2, // c0..df
-    0xa,0x3,0x3,0x3,0x3,0x3,0x3,0x3,0x3,0x3,0x3,0x3,0x3,0x4,0x3,0x3, // e0..ef
-    0xb,0x6,0x6,0x6,0x5,0x8,0x8,0x8,0x8,0x8,0x8,0x8,0x8,0x8,0x8,0x8, // f0..ff
-    0x0,0x1,0x2,0x3,0x5,0x8,0x7,0x1,0x1,0x1,0x4,0x6,0x1,0x1,0x1,0x1, // s0..s0
-    1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,0,1,1,1,1,1,0,1,0,1,1,1,1,1,1, // s1..s2
-    1,2,1,1,1,1,1,2,1,2,1,1,1,1,1,1,1,1,1,1,1,1,1,2,1,1,1,1,1,1,1,1, // s3..s4
-    1,2,1,1,1,1,1,1,1,2,1,1,1,1,1,1,1,1,1,1,1,1,1,3,1,3,1,1,1,1,1,1, // s5..s6
-    1,3,1,1,1,1,1,3,1,3,1,1,1,1,1,1,1,3,1,1,1,1,1,1,1,1,1,1,1,1,1,1, // s7..s8
-  };
-  // clang-format on
+  release_shared(chunk->shared);
+  free(chunk);
+}
 
-  uint32_t codepoint = 0;
+static void clear_queue_locked(cws_client_t* client)
+{
+  while (client->queue_head != NULL) {
+    cws_chunk_t* next = client->queue_head->next;
+    free_chunk(client->queue_head);
+    client->queue_head = next;
+  }
 
-  for (ssize_t i = 0; i < len; i++) {
-    uint32_t type = utf8d[s[i]];
+  client->queue_tail = NULL;
+  client->queued_bytes = 0;
+  client->want_write = 0;
+}
 
-    codepoint = (state != 0) ? (s[i] & 0x3fu) | (codepoint << 6) : (0xff >> type) & (s[i]);
+#ifdef CWS_HAVE_EPOLL
+#ifdef CWS_HAVE_IO_URING
+static void ring_watch_writable_locked(cws_client_t* client, int enable);
+#endif
 
-    state = utf8d[256 + state * 16 + type];
+static void watch_writable_locked(cws_client_t* client, int enable)
+{
+#ifdef CWS_HAVE_IO_URING
+  if (client->reactor->ring != NULL) {
+    ring_watch_writable_locked(client, enable);
+    return;
+  }
+#endif
+  if (client->want_write == enable) {
+    return;
   }
 
-  return state;
+  struct epoll_event event = {.events = EPOLLIN | EPOLLRDHUP | (enable ? EPOLLOUT : 0), .data.ptr = client};
+  epoll_ctl(client->reactor->epoll_fd, EPOLL_CTL_MOD, client->fd, &event);
+  client->want_write = enable;
 }
+#endif
 
-static int recv_next_frame(cws_frame_t* frame)
+/**
+ * Queues the part of a frame the socket did not take and lets the reactor drain it.
+ * Once more than `send_queue_max_bytes` are waiting the client is either disconnected or the frame is dropped
+ * with `CWS_SEND_DROPPED`, depending on `send_queue_policy`. A frame that was partially written can only be completed, so that always disconnects.
+ * If `shared` is set the frame is copied into it once, on first use, and only referenced from then on.
+ */
+static int queue_locked(cws_client_t* client, const void* head, size_t head_size, const void* body, size_t body_size, size_t offset,
+                        cws_shared_t** shared)
 {
-  cws_frame_state_data_t fsd = {0};
-  fsd.msg_data = NULL;
-  fsd.msg_ctrl = frame->msg_ctrl;
-  fsd.utf8_state = 0;
+  size_t total = head_size + body_size;
+  size_t remaining = total - offset;
 
-  frame->frame_size = 0;
-  frame->op = -1;
-  frame->msg = NULL;
-
-  do {
-    fsd.cur_byte = recv_next_byte(frame);
-    if (fsd.cur_byte == -1) {
+  if (client->queued_bytes + remaining > client->server->send_queue_max_bytes) {
+    if (offset > 0 || client->server->send_queue_policy == CWS_SEND_QUEUE_DISCONNECT) {
+      kick_client_locked(client);
       return -1;
     }
+    return CWS_SEND_DROPPED;
+  }
 
-    fsd.is_fin = (fsd.cur_byte & 0xFF) >> 7;
-    fsd.opcode = (fsd.cur_byte & 0xF);
-
-    if (fsd.cur_byte & 0x70) {
-      frame->error = 1;
-      break;
+  if (shared != NULL && *shared == NULL) {
+    *shared = malloc(sizeof(cws_shared_t) + total);
+    if (*shared == NULL) {
+      kick_client_locked(client);
+      return -1;
     }
 
-    if ((frame->op == -1 && fsd.opcode == OP_CONTINUATION) ||
-        (frame->op != -1 && (fsd.opcode != OP_CLOSE && fsd.opcode != OP_PING && fsd.opcode != OP_PONG) && fsd.opcode != OP_CONTINUATION)) {
-      frame->error = 1;
-      break;
+    // The broadcaster holds the first reference until it is done with all clients
+    thread_atomic_int_store(&(*shared)->refs, 1);
+    (*shared)->size = total;
+    memcpy((*shared)->data, head, head_size);
+    if (body_size > 0) {
+      memcpy((*shared)->data + head_size, body, body_size);
     }
+  }
 
-    // Fail if opcode isnt valid
-    if (fsd.opcode != OP_CONTINUATION && fsd.opcode != OP_TEXT && fsd.opcode != OP_BINARY && fsd.opcode != OP_CLOSE && fsd.opcode != OP_PING &&
-        fsd.opcode != OP_PONG) {
-      frame->op = fsd.opcode;
-      frame->error = 1;
-    }
-    thread_mutex_lock(&frame->client->lock);
-    int state = frame->client->state;
-    thread_mutex_unlock(&frame->client->lock);
-    if (state == STATE_CLOSING && fsd.opcode != OP_CLOSE) {
-      frame->error = 1;
-      break;
-    }
+  cws_chunk_t* chunk = malloc(sizeof(cws_chunk_t) + (shared != NULL ? 0 : remaining));
+  if (chunk == NULL) {
+    kick_client_locked(client);
+    return -1;
+  }
 
-    if (fsd.opcode != OP_CONTINUATION && (fsd.opcode != OP_CLOSE && fsd.opcode != OP_PING && fsd.opcode != OP_PONG)) {
-      frame->op = fsd.opcode;
+  chunk->next = NULL;
+  chunk->size = remaining;
+  chunk->sent = 0;
+  chunk->shared = NULL;
+
+  if (shared != NULL) {
+    thread_atomic_int_inc(&(*shared)->refs);
+    chunk->shared = *shared;
+    chunk->bytes = (*shared)->data + offset;
+  } else {
+    size_t pos = 0;
+    if (offset < head_size) {
+      memcpy(chunk->data, (const char*)head + offset, head_size - offset);
+      pos = head_size - offset;
     }
+    if (body_size > 0) {
+      size_t body_offset = offset > head_size ? offset - head_size : 0;
+      memcpy(chunk->data + pos, (const char*)body + body_offset, body_size - body_offset);
+    }
+    chunk->bytes = chunk->data;
+  }
 
-    fsd.mask = recv_next_byte(frame);
-    fsd.frame_length = fsd.mask & 0x7F;
-    fsd.frame_size = 0;
-    fsd.msg_ctrl_index = 0;
+  if (client->queue_tail != NULL) {
+    client->queue_tail->next = chunk;
+  } else {
+    client->queue_head = chunk;
+    client->queue_progress_at = now_ms();
+  }
+  client->queue_tail = chunk;
+  client->queued_bytes += remaining;
 
-    if ((fsd.opcode == OP_CLOSE || fsd.opcode == OP_PING || fsd.opcode == OP_PONG) && (!fsd.is_fin || fsd.frame_length > 125)) {
-      frame->error = 1;
-      break;
-    }
+#ifdef CWS_HAVE_EPOLL
+  watch_writable_locked(client, 1);
+#endif
+  return 0;
+}
 
-    if (recv_frame(frame, &fsd) < 0) {
-      break;
-    }
+/**
+ * Sends `head` followed by `body` without copying them into one buffer. The client lock has to be held.
+ * Blocking sockets write everything, timing out after `send_timeout_ms`.
+ * Non-blocking sockets write what fits right away and queue the rest, keeping frames in order.
+ * `shared` is passed on to `queue_locked` for broadcasts and NULL otherwise.
+ */
+static int sendv_locked(cws_client_t* client, const void* head, size_t head_size, const void* body, size_t body_size, cws_shared_t** shared)
+{
+  size_t total = head_size + body_size;
+  size_t sent = 0;
 
-    if (fsd.opcode == OP_CONTINUATION || fsd.opcode == OP_TEXT) {
-      if (frame->op != OP_TEXT) {
-        goto next_it;
-      };
+  if (client->fd == -1) {
+    return -1;
+  }
 
-      if (fsd.is_fin) {
-        if (valid_utf8(fsd.msg_data + (fsd.msg_data_index - fsd.frame_length), fsd.frame_length, 0) != 0) {
-          frame->error = 1;
-          send_close_frame(frame, 1007);
-        }
-        goto next_it;
+  if (client->nonblocking) {
+    if (client->queue_head == NULL) {
+      ssize_t ret = sendv_once(client, head, head_size, body, body_size, 0);
+      if (ret < 0) {
+        kick_client_locked(client);
+        return -1;
       }
+      sent = ret;
+    }
 
-      fsd.utf8_state = valid_utf8(fsd.msg_data + (fsd.msg_data_index - fsd.frame_length), fsd.frame_length, fsd.utf8_state);
-      if (fsd.utf8_state == 1) {
-        frame->error = 1;
-        send_close_frame(frame, 1007);
+    if (sent < total) {
+      int ret = queue_locked(client, head, head_size, body, body_size, sent, shared);
+      if (ret < 0) {
+        return ret;
       }
-    } else if (fsd.opcode == OP_CLOSE) {
-      if (fsd.frame_size > 2 && valid_utf8(fsd.msg_ctrl + 2, fsd.frame_size - 2, 0) == 1) {
-        frame->error = 1;
-        break;
+    }
+  } else {
+    while (sent < total) {
+      ssize_t ret = sendv_once(client, head, head_size, body, body_size, sent);
+      if (ret <= 0) {
+        // Either an error or the send timeout expired, a client that stopped reading is not waited for again
+        kick_client_locked(client);
+        return -1;
       }
+      sent += ret;
+    }
+  }
 
-      frame->op = OP_CLOSE;
-      frame->frame_size = fsd.frame_size;
-      free(fsd.msg_data);
-      return 0;
-    } else if (fsd.opcode == OP_PING) {
-      if (cws_send(frame->client, (const char*)frame->msg_ctrl, fsd.frame_size, OP_PONG) < 0) {
-        frame->error = 1;
-        break;
-      }
-      fsd.is_fin = 0;
-    } else if (fsd.opcode == OP_PONG) {
-      fsd.is_fin = 0;
-      if (fsd.frame_size != sizeof(frame->client->last_pong_id)) {
-        goto next_it;
-      }
+  client->stats.frames_sent++;
+  client->stats.bytes_sent += total;
+  return 0;
+}
 
-      thread_mutex_lock(&frame->client->lock);
-      fsd.pong_id = (fsd.msg_ctrl[3] << 0) | (fsd.msg_ctrl[2] << 8) | (fsd.msg_ctrl[1] << 16) | (fsd.msg_ctrl[0] << 24);
-      if (fsd.pong_id < 0 || fsd.pong_id > frame->client->current_ping_id) {
-        thread_mutex_unlock(&frame->client->lock);
-        goto next_it;
-      }
-      frame->client->last_pong_id = fsd.pong_id;
-      thread_mutex_unlock(&frame->client->lock);
+/* Writes queued chunks until the socket is full. Returns -1 if the connection failed. */
+static int flush_queue_locked(cws_client_t* client)
+{
+  while (client->queue_head != NULL) {
+    cws_chunk_t* chunk = client->queue_head;
+    ssize_t ret = sendv_once(client, chunk->bytes + chunk->sent, chunk->size - chunk->sent, NULL, 0, 0);
+    if (ret < 0) {
+      return -1;
+    } else if (ret == 0) {
+      return 0;
     }
 
-  next_it:;
-  } while (!fsd.is_fin && !frame->error);
+    chunk->sent += ret;
+    client->queued_bytes -= ret;
+    client->queue_progress_at = now_ms();
 
-  if (frame->error) {
-    free(fsd.msg_data);
-    frame->msg = NULL;
-    return -1;
+    if (chunk->sent == chunk->size) {
+      client->queue_head = chunk->next;
+      if (client->queue_head == NULL) {
+        client->queue_tail = NULL;
+      }
+      free_chunk(chunk);
+    }
   }
 
-  frame->msg = fsd.msg_data;
+#ifdef CWS_HAVE_EPOLL
+  watch_writable_locked(client, 0);
+#endif
   return 0;
 }
 
-static void sha1(const uint8_t* data, size_t size, uint8_t* output)
+#ifdef CWS_HAVE_ZLIB
+/**
+ * | permessage-deflate (RFC 7692) |
+ */
+
+/* Returns the parameter value without surrounding whitespace or quotes. */
+static char* trim_param(char* str)
 {
-#define SHA1ROTATELEFT(value, bits) (((value) << (bits)) | ((value) >> (32 - (bits))))
-  uint32_t W[80];
-  uint32_t H[] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
-  uint32_t a, b, c, d, e, f, k;
-  uint32_t idx, lidx, widx, didx = 0;
-  int32_t wcount;
-  uint32_t temp;
+  while (*str == ' ' || *str == '\t' || *str == '"') str++;
+  char* end = str + strlen(str);
+  while (end > str && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '"')) end--;
+  *end = '\0';
+  return str;
+}
+
+/**
+ * Accepts the first permessage-deflate offer in a Sec-WebSocket-Extensions value that can be honoured.
+ * The extension parameters for the response are written to `response`. Returns 1 if an offer was accepted.
+ */
+static int negotiate_deflate(cws_client_t* client, char* value, char* response, size_t response_size)
+{
+  char* offer_ptr = NULL;
+  for (char* offer = strtok_r(value, ",", &offer_ptr); offer != NULL; offer = strtok_r(NULL, ",", &offer_ptr)) {
+    char* param_ptr = NULL;
+    char* name = strtok_r(offer, ";", &param_ptr);
+    if (name == NULL || strcmp(trim_param(name), "permessage-deflate") != 0) {
+      continue;
+    }
+
+    int ok = 1, no_takeover = 0, window_bits = 0, client_bits = 0, client_no_takeover = 0;
+    for (char* param = strtok_r(NULL, ";", &param_ptr); param != NULL && ok; param = strtok_r(NULL, ";", &param_ptr)) {
+      char* param_value = strchr(param, '=');
+      if (param_value != NULL) {
+        *param_value++ = '\0';
+        param_value = trim_param(param_value);
+      }
+      param = trim_param(param);
+
+      if (strcmp(param, "server_no_context_takeover") == 0 && param_value == NULL && !no_takeover) {
+        no_takeover = 1;
+      } else if (strcmp(param, "client_no_context_takeover") == 0 && param_value == NULL && !client_no_takeover) {
+        // Only affects the client, the inflater handles both
+        client_no_takeover = 1;
+      } else if (strcmp(param, "server_max_window_bits") == 0 && param_value != NULL && !window_bits) {
+        // zlib cannot produce streams for a 256 byte window, so 8 has to be declined
+        window_bits = atoi(param_value);
+        ok = window_bits >= 9 && window_bits <= 15;
+      } else if (strcmp(param, "client_max_window_bits") == 0 && !client_bits) {
+        client_bits = param_value == NULL ? 15 : atoi(param_value);
+        ok = client_bits >= 8 && client_bits <= 15;
+      } else {
+        ok = 0;
+      }
+    }
+
+    if (!ok) {
+      continue;
+    }
+
+    memset(&client->deflater, 0, sizeof(z_stream));
+    memset(&client->inflater, 0, sizeof(z_stream));
+    if (deflateInit2(&client->deflater, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -(window_bits ? window_bits : 15), 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+      return 0;
+    }
+    if (inflateInit2(&client->inflater, -15) != Z_OK) {
+      deflateEnd(&client->deflater);
+      return 0;
+    }
+
+    thread_mutex_lock(&client->lock);
+    client->deflate = 1;
+    client->deflate_no_takeover = no_takeover;
+    thread_mutex_unlock(&client->lock);
+
+    int len = snprintf(response, response_size, "permessage-deflate%s", no_takeover ? "; server_no_context_takeover" : "");
+    if (window_bits && len > 0 && (size_t)len < response_size) {
+      snprintf(response + len, response_size - len, "; server_max_window_bits=%d", window_bits);
+    }
+    return 1;
+  }
+
+  return 0;
+}
+
+static void end_deflate_locked(cws_client_t* client)
+{
+  if (client->deflate) {
+    deflateEnd(&client->deflater);
+    inflateEnd(&client->inflater);
+    client->deflate = 0;
+  }
+}
+
+/**
+ * Compresses a message with the clients deflate context. The client lock has to be held.
+ * The trailing 0x00 0x00 0xff 0xff of the sync flush is left out, as the RFC requires.
+ */
+static int deflate_locked(cws_client_t* client, const char* msg, size_t size, size_t* out_size)
+{
+  z_stream* z = &client->deflater;
+  if (grow_buffer(&client->deflated, deflateBound(z, size) + 16) < 0) {
+    return -1;
+  }
+
+  z->next_in = (Bytef*)msg;
+  z->avail_in = (uInt)size;
+  size_t total = 0;
+
+  for (;;) {
+    z->next_out = client->deflated.data + total;
+    z->avail_out = (uInt)(client->deflated.capacity - total);
+    if (deflate(z, Z_SYNC_FLUSH) == Z_STREAM_ERROR) {
+      return -1;
+    }
+    total = client->deflated.capacity - z->avail_out;
+
+    if (z->avail_out > 0) {
+      break;
+    }
+    if (grow_buffer(&client->deflated, client->deflated.capacity * 2) < 0) {
+      return -1;
+    }
+  }
+
+  if (client->deflate_no_takeover) {
+    deflateReset(z);
+  }
+
+  *out_size = total >= 4 ? total - 4 : total;
+  return 0;
+}
+
+/**
+ * Inflates the compressed message in the parser into `inflated` and points the message at it.
+ * Returns 0 on success or the close code to fail the connection with.
+ */
+static int inflate_message(cws_client_t* client)
+{
+  static const unsigned char tail[4] = {0x00, 0x00, 0xff, 0xff};
+  cws_parser_t* p = &client->parser;
+  z_stream* z = &client->inflater;
+
+  size_t capacity = p->msg_size * 4 + 1;
+  if (grow_buffer(&p->inflated, capacity < 4096 ? 4096 : capacity) < 0) {
+    return 1011;
+  }
+
+  z->next_in = p->msg;
+  z->avail_in = (uInt)p->msg_size;
+  int tail_fed = 0;
+  size_t total = 0;
+
+  for (;;) {
+    // One byte is kept free for the terminator, and at most one byte past the size limit is inflated
+    size_t room = p->inflated.capacity - total - 1;
+    if (room > client->server->max_message_size + 1 - total) room = client->server->max_message_size + 1 - total;
+    if (room > UINT32_MAX) room = UINT32_MAX;
+    z->next_out = p->inflated.data + total;
+    z->avail_out = (uInt)room;
+    int ret = inflate(z, Z_SYNC_FLUSH);
+    total += room - z->avail_out;
+
+    if (ret == Z_STREAM_END) {
+      // The client finished the stream with a final block, the next message starts a new one
+      inflateReset(z);
+      break;
+    } else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+      return 1007;
+    }
+
+    if (z->avail_in == 0 && z->avail_out > 0) {
+      if (tail_fed) break;
+      z->next_in = (Bytef*)tail;
+      z->avail_in = sizeof(tail);
+      tail_fed = 1;
+      continue;
+    }
+
+    if (z->avail_out == 0) {
+      if (total > client->server->max_message_size) {
+        return 1009;
+      }
+      if (grow_buffer(&p->inflated, p->inflated.capacity * 2) < 0) {
+        return 1011;
+      }
+    }
+  }
+
+  pool_release(&p->large);
+  p->msg = p->inflated.data;
+  p->msg_size = total;
+  return 0;
+}
+
+/**
+ * Inflates the next `len` bytes of a streamed message and hands the output to `on_stream` in chunks.
+ * With `fin` set the stream is flushed and finished. Returns 0 on success or the close code to fail the connection with.
+ */
+static int inflate_stream(cws_client_t* client, const unsigned char* data, size_t len, int fin)
+{
+  static const unsigned char tail[4] = {0x00, 0x00, 0xff, 0xff};
+  cws_parser_t* p = &client->parser;
+  z_stream* z = &client->inflater;
+
+  if (grow_buffer(&p->inflated, STREAM_CHUNK_SIZE) < 0) {
+    return 1011;
+  }
+
+  z->next_in = (Bytef*)data;
+  z->avail_in = (uInt)len;
+  int tail_fed = !fin;
+  int ended = 0;
+
+  for (;;) {
+    z->next_out = p->inflated.data;
+    z->avail_out = STREAM_CHUNK_SIZE;
+    int ret = inflate(z, Z_SYNC_FLUSH);
+    size_t n = STREAM_CHUNK_SIZE - z->avail_out;
+
+    ended = ret == Z_STREAM_END;
+    if (ended) {
+      inflateReset(z);
+    } else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+      return 1007;
+    }
+
+    if (n > 0) {
+      if (p->stream_offset + n > client->server->max_message_size) {
+        return 1009;
+      }
+      client->server->on_stream(client, p->inflated.data, n, p->stream_offset, false);
+      p->stream_offset += n;
+    }
+
+    if (z->avail_in == 0 && (z->avail_out > 0 || ended)) {
+      // Like in `inflate_message`, the tail is only needed if the client did not end the stream itself
+      if (tail_fed || ended) break;
+      z->next_in = (Bytef*)tail;
+      z->avail_in = sizeof(tail);
+      tail_fed = 1;
+    }
+  }
+
+  return 0;
+}
+#endif
+
+static int sendn_client(cws_client_t* client, const void* buf, size_t n)
+{
+  if (client == NULL) {
+    return -1;
+  }
+
+  thread_mutex_lock(&client->lock);
+  int ret = sendv_locked(client, buf, n, NULL, 0, NULL);
+  thread_mutex_unlock(&client->lock);
+  return ret;
+}
+
+void cws_frame_init(cws_frame_t* frame, const char* msg, uint64_t size, int type)
+{
+  frame->header[0] = (128 | type);
+
+  if (size <= 125) {
+    frame->header[1] = size & 0x7F;
+    frame->header_size = 2;
+  } else if (size >= 126 && size <= 65535) {
+    frame->header[1] = 126;
+    frame->header[2] = (size >> 8) & 255;
+    frame->header[3] = size & 255;
+    frame->header_size = 4;
+  } else {
+    frame->header[1] = 127;
+    for (int i = 0; i < 8; i++) {
+      frame->header[2 + i] = (unsigned char)((size >> (56 - i * 8)) & 255);
+    }
+    frame->header_size = 10;
+  }
+
+  frame->payload = msg;
+  frame->payload_size = size;
+}
+
+int cws_send_frame(cws_client_t* client, const cws_frame_t* frame)
+{
+  if (client == NULL) {
+    return -1;
+  }
+
+  thread_mutex_lock(&client->lock);
+  int ret = sendv_locked(client, frame->header, frame->header_size, frame->payload, frame->payload_size, NULL);
+  thread_mutex_unlock(&client->lock);
+  return ret;
+}
+
+int cws_send(cws_client_t* client, const char* msg, uint64_t size, int type)
+{
+  cws_frame_t frame;
+
+#ifdef CWS_HAVE_ZLIB
+  if (client != NULL && (type == OP_TEXT || type == OP_BINARY) && size >= client->server->deflate_min_size) {
+    thread_mutex_lock(&client->lock);
+    if (client->deflate) {
+      size_t compressed_size = 0;
+      int ret;
+      // The client inflates every frame with the same context, so a frame that would be dropped is dropped before it is deflated
+      if (client->nonblocking && client->queue_head != NULL && client->server->send_queue_policy == CWS_SEND_QUEUE_DROP &&
+          client->queued_bytes + sizeof(frame.header) + deflateBound(&client->deflater, size) > client->server->send_queue_max_bytes) {
+        ret = CWS_SEND_DROPPED;
+      } else if ((ret = deflate_locked(client, msg, size, &compressed_size)) == 0) {
+        cws_frame_init(&frame, (const char*)client->deflated.data, compressed_size, type);
+        frame.header[0] |= 0x40;
+        ret = sendv_locked(client, frame.header, frame.header_size, frame.payload, frame.payload_size, NULL);
+        if (ret == CWS_SEND_DROPPED) {
+          // Nothing was sent yet, but the deflate context already moved on without the client
+          kick_client_locked(client);
+          ret = -1;
+        }
+      } else {
+        // The deflate context is out of sync with the client now
+        kick_client_locked(client);
+      }
+
+      if (client->deflated.capacity > CLIENT_BUFFER_MAX) {
+        free_buffer(&client->deflated);
+      }
+      thread_mutex_unlock(&client->lock);
+      return ret;
+    }
+    thread_mutex_unlock(&client->lock);
+  }
+#endif
+
+  cws_frame_init(&frame, msg, size, type);
+  return cws_send_frame(client, &frame);
+}
+
+static int send_close_frame(cws_client_t* client, int code)
+{
+  unsigned char payload[2] = {(unsigned char)(code >> 8), (unsigned char)(code & 0xFF)};
+  return cws_send(client, (const char*)payload, sizeof(payload), OP_CLOSE);
+}
+
+/* Answers a close frame from the client, echoing its status code if it is a valid one. */
+static int reply_close_frame(cws_client_t* client, const unsigned char* payload, uint64_t size)
+{
+  int cc;
+  if (size == 0) {
+    return cws_send(client, NULL, 0, OP_CLOSE);
+  } else if (size == 1) {
+    cc = payload[0];
+  } else {
+    cc = ((int)payload[0]) << 8 | payload[1];
+  }
+
+  if ((cc < 1000 || cc > 1003) && (cc < 1007 || cc > 1011) && (cc < 3000 || cc > 4999)) {
+    return send_close_frame(client, 1002);
+  }
+
+  return cws_send(client, (const char*)payload, size, OP_CLOSE);
+}
+
+static void close_client(cws_client_t* client)
+{
+  if (client == NULL) {
+    return;
+  }
+
+  thread_mutex_lock(&g_clients_mutex);
+  thread_mutex_lock(&client->lock);
+  if (client->fd != -1) {
+    close_fd(client->fd);
+    g_client_count--;
+  }
+  client->state = STATE_CLOSED;
+  client->fd = -1;
+  clear_queue_locked(client);
+#ifdef CWS_HAVE_ZLIB
+  end_deflate_locked(client);
+#endif
+  thread_mutex_unlock(&client->lock);
+
+  reset_parser(&client->parser);
+  client->handshake_len = 0;
+  thread_mutex_unlock(&g_clients_mutex);
+}
+
+static int client_slots()
+{
+  return thread_atomic_int_load(&g_client_slots);
+}
+
+static cws_client_t* client_at(int i)
+{
+  return &g_client_blocks[i / CLIENT_BLOCK_SIZE][i % CLIENT_BLOCK_SIZE];
+}
+
+/* Adds a block of free slots to the table, `g_clients_mutex` has to be held. */
+static int grow_clients_locked()
+{
+  int slots = client_slots();
+  int index = slots / CLIENT_BLOCK_SIZE;
+  if (index >= MAX_CLIENT_BLOCKS) {
+    return -1;
+  }
+
+  cws_client_t* block = calloc(CLIENT_BLOCK_SIZE, sizeof(cws_client_t));
+  if (block == NULL) {
+    return -1;
+  }
+
+  for (int i = 0; i < CLIENT_BLOCK_SIZE; i++) {
+    block[i].fd = -1;
+    thread_mutex_init(&block[i].lock);
+  }
+
+  // The add is a full barrier, whoever sees the new slot count also sees the block
+  g_client_blocks[index] = block;
+  thread_atomic_int_add(&g_client_slots, CLIENT_BLOCK_SIZE);
+  return 0;
+}
+
+/**
+ * Takes a free slot for `fd`, growing the table as needed.
+ * Returns NULL after reporting the rejection to `on_reject` if `max_clients` are connected or memory ran out.
+ */
+static cws_client_t* alloc_client(int fd, cws_server_t* server, int nonblocking)
+{
+  cws_client_t* client = NULL;
+  int reason = CWS_REJECT_FULL;
+
+  thread_mutex_lock(&g_clients_mutex);
+  if (g_client_count < server->max_clients) {
+    for (int i = 0; client == NULL; i++) {
+      if (i == client_slots() && grow_clients_locked() < 0) {
+        reason = CWS_REJECT_NO_MEMORY;
+        break;
+      }
+      if (client_at(i)->fd == -1) {
+        client = client_at(i);
+      }
+    }
+  }
+
+  if (client != NULL) {
+    thread_mutex_lock(&client->lock);
+    client->fd = fd;
+    client->state = STATE_CONNECTING;
+    client->server = server;
+    client->nonblocking = nonblocking;
+#ifdef CWS_HAVE_EPOLL
+    client->reactor = NULL;
+#endif
+#ifdef CWS_HAVE_IO_URING
+    client->ring_ops = 0;
+    client->ring_closing = 0;
+#endif
+    client->data = NULL;
+    client->last_pong_id = -1;
+    client->current_ping_id = -1;
+    client->connected_at = now_ms();
+    client->ping_sent_at = client->connected_at;
+    client->last_recv_at = client->connected_at;
+    memset(&client->stats, 0, sizeof(cws_client_stats_t));
+    thread_mutex_unlock(&client->lock);
+
+    reset_parser(&client->parser);
+    client->handshake_len = 0;
+
+    g_clients_accepted++;
+    if (++g_client_count > g_client_peak) {
+      g_client_peak = g_client_count;
+    }
+  } else {
+    g_clients_rejected++;
+  }
+  int count = g_client_count;
+  thread_mutex_unlock(&g_clients_mutex);
+
+  if (client == NULL && server->on_reject != NULL) {
+    server->on_reject(reason, count);
+  }
+
+  return client;
+}
+
+static int get_client_state(cws_client_t* client)
+{
+  thread_mutex_lock(&client->lock);
+  int state = client->state;
+  thread_mutex_unlock(&client->lock);
+  return state;
+}
+
+static void set_client_state(cws_client_t* client, int state)
+{
+  thread_mutex_lock(&client->lock);
+  client->state = state;
+  thread_mutex_unlock(&client->lock);
+}
+
+int cws_broadcast(const char* msg, uint64_t size, int type, cws_filter_t filter, cws_failed_t on_failed, void* data)
+{
+  cws_frame_t frame;
+  cws_frame_init(&frame, msg, size, type);
+  cws_shared_t* shared = NULL;
+  int sent = 0;
+
+  for (int i = 0; i < client_slots(); i++) {
+    cws_client_t* client = client_at(i);
+    // The filter runs without the client lock, so it can use the client freely
+    if (get_client_state(client) != STATE_OPEN || (filter != NULL && !filter(client, data))) {
+      continue;
+    }
+
+    thread_mutex_lock(&client->lock);
+    if (client->state != STATE_OPEN) {
+      thread_mutex_unlock(&client->lock);
+      continue;
+    }
+    int ret = sendv_locked(client, frame.header, frame.header_size, frame.payload, frame.payload_size, &shared);
+    thread_mutex_unlock(&client->lock);
+
+    if (ret == 0) {
+      sent++;
+    } else if (on_failed != NULL) {
+      on_failed(client, ret != CWS_SEND_DROPPED, data);
+    }
+  }
+
+  release_shared(shared);
+  return sent;
+}
+
+void cws_set_data(cws_client_t* client, void* data)
+{
+  client->data = data;
+}
+
+void* cws_get_data(cws_client_t* client)
+{
+  return client->data;
+}
+
+int cws_client_stats(cws_client_t* client, cws_client_stats_t* out)
+{
+  thread_mutex_lock(&client->lock);
+  if (client->fd == -1) {
+    thread_mutex_unlock(&client->lock);
+    return -1;
+  }
+
+  *out = client->stats;
+  out->queued_bytes = client->queued_bytes;
+#ifdef CWS_HAVE_ZLIB
+  out->buffer_bytes += client->deflated.capacity;
+#endif
+  thread_mutex_unlock(&client->lock);
+  return 0;
+}
+
+int cws_get_stats(cws_stats_t* out)
+{
+  memset(out, 0, sizeof(cws_stats_t));
+  // There are listeners exactly while the server runs, the client table and its locks do not exist otherwise
+  if (g_server_data.fd_count <= 0) {
+    return -1;
+  }
+
+  thread_mutex_lock(&g_clients_mutex);
+  out->clients = g_client_count;
+  out->peak_clients = g_client_peak;
+  out->max_clients = g_server_data.server.max_clients;
+  out->accepted = g_clients_accepted;
+  out->rejected = g_clients_rejected;
+  out->table_bytes = (size_t)client_slots() * sizeof(cws_client_t);
+  thread_mutex_unlock(&g_clients_mutex);
+
+  out->backend = CWS_BACKEND_THREADS;
+#ifdef CWS_HAVE_EPOLL
+  if (g_server_data.reactor_count > 0) {
+    out->backend = CWS_BACKEND_EPOLL;
+#ifdef CWS_HAVE_IO_URING
+    if (g_server_data.reactors[0].ring != NULL) {
+      out->backend = CWS_BACKEND_IO_URING;
+    }
+#endif
+  }
+#endif
+
+  cws_client_stats_t stats;
+  for (int i = 0; i < client_slots(); i++) {
+    if (cws_client_stats(client_at(i), &stats) == 0) {
+      out->buffer_bytes += stats.buffer_bytes;
+      out->queued_bytes += stats.queued_bytes;
+    }
+  }
+
+  thread_mutex_lock(&g_buffer_pool_mutex);
+  for (int i = 0; i < BUFFER_POOL_SIZE; i++) {
+    out->buffer_bytes += g_buffer_pool[i].capacity;
+  }
+  thread_mutex_unlock(&g_buffer_pool_mutex);
+  return 0;
+}
+
+/**
+ * Runs the UTF-8 DFA over `len` bytes, starting in `state` so fragmented messages can be validated piece by piece.
+ * Returns 0 if the text is complete and valid, 1 if it is invalid, anything else if a sequence is still open.
+ * Runs of ASCII between sequences are skipped a block at a time and only the remaining bytes go through the DFA.
+ */
+static int valid_utf8(uint8_t* s, size_t len, uint32_t state)
+{
+  // clang-format off
+  static const uint8_t utf8d[] = {
+    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, // 00..1f
+    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, // 20..3f
+    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, // 40..5f
+    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, // 60..7f
+    1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9, // 80..9f
+    7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7, // a0..bf
+    8,8,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2, // c0..df
+    0xa,0x3,0x3,0x3,0x3,0x3,0x3,0x3,0x3,0x3,0x3,0x3,0x3,0x4,0x3,0x3, // e0..ef
+    0xb,0x6,0x6,0x6,0x5,0x8,0x8,0x8,0x8,0x8,0x8,0x8,0x8,0x8,0x8,0x8, // f0..ff
+    0x0,0x1,0x2,0x3,0x5,0x8,0x7,0x1,0x1,0x1,0x4,0x6,0x1,0x1,0x1,0x1, // s0..s0
+    1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,0,1,1,1,1,1,0,1,0,1,1,1,1,1,1, // s1..s2
+    1,2,1,1,1,1,1,2,1,2,1,1,1,1,1,1,1,1,1,1,1,1,1,2,1,1,1,1,1,1,1,1, // s3..s4
+    1,2,1,1,1,1,1,1,1,2,1,1,1,1,1,1,1,1,1,1,1,1,1,3,1,3,1,1,1,1,1,1, // s5..s6
+    1,3,1,1,1,1,1,3,1,3,1,1,1,1,1,1,1,3,1,1,1,1,1,1,1,1,1,1,1,1,1,1, // s7..s8
+  };
+  // clang-format on
+
+  size_t i = 0;
+  while (i < len) {
+    if (state == 0) {
+#ifdef CWS_HAVE_SSE2
+      for (; i + 32 <= len; i += 32) {
+        __m128i a = _mm_loadu_si128((const __m128i*)(s + i));
+        __m128i b = _mm_loadu_si128((const __m128i*)(s + i + 16));
+        if (_mm_movemask_epi8(_mm_or_si128(a, b)) != 0) break;
+      }
+#endif
+      for (; i + 8 <= len; i += 8) {
+        uint64_t word;
+        memcpy(&word, s + i, sizeof(word));
+        if (word & 0x8080808080808080ull) break;
+      }
+
+      if (i == len) break;
+    }
+
+    state = utf8d[256 + state * 16 + utf8d[s[i++]]];
+    if (state == 1) break; // Rejecting is final
+  }
+
+  return state;
+}
+
+/* Sends a close frame with `code` if the connection is still open and returns -1, so the caller drops the client. */
+static int fail_client(cws_client_t* client, int code)
+{
+  if (get_client_state(client) == STATE_OPEN) {
+    set_client_state(client, STATE_CLOSING);
+    send_close_frame(client, code);
+  }
+
+  return -1;
+}
+
+static int parse_header(cws_client_t* client)
+{
+  cws_parser_t* p = &client->parser;
+  uint8_t b0 = p->header[0];
+  uint8_t b1 = p->header[1];
+
+  p->is_fin = b0 >> 7;
+  p->opcode = b0 & 0xF;
+
+  // RSV1 marks the first frame of a compressed message if permessage-deflate was negotiated, other bits are never used
+  uint8_t rsv = b0 & 0x70;
+  if (rsv != 0) {
+#ifdef CWS_HAVE_ZLIB
+    if (rsv != 0x40 || !client->deflate || p->opcode == OP_CONTINUATION || IS_CONTROL(p->opcode)) {
+      return fail_client(client, 1002);
+    }
+#else
+    return fail_client(client, 1002);
+#endif
+  }
+
+  // Fail if opcode isnt valid
+  if (p->opcode != OP_CONTINUATION && p->opcode != OP_TEXT && p->opcode != OP_BINARY && !IS_CONTROL(p->opcode)) {
+    return fail_client(client, 1002);
+  }
+
+  if ((p->op == -1 && p->opcode == OP_CONTINUATION) || (p->op != -1 && !IS_CONTROL(p->opcode) && p->opcode != OP_CONTINUATION)) {
+    return fail_client(client, 1002);
+  }
+
+  if (get_client_state(client) == STATE_CLOSING && p->opcode != OP_CLOSE) {
+    return -1;
+  }
+
+  // Frames from the client must always be masked
+  if (!(b1 & 0x80)) {
+    return fail_client(client, 1002);
+  }
+
+  p->frame_length = b1 & 0x7F;
+  if (IS_CONTROL(p->opcode) && (!p->is_fin || p->frame_length > 125)) {
+    return fail_client(client, 1002);
+  }
+
+  if (p->frame_length == 126) {
+    p->frame_length = ((uint64_t)p->header[2] << 8) | p->header[3];
+  } else if (p->frame_length == 127) {
+    p->frame_length = 0;
+    for (int i = 2; i < 10; i++) {
+      p->frame_length = (p->frame_length << 8) | p->header[i];
+    }
+  }
+
+  memcpy(p->masks, p->header + p->header_need - 4, 4);
+
+  if (!IS_CONTROL(p->opcode)) {
+    if (p->opcode != OP_CONTINUATION) {
+      p->op = p->opcode;
+      p->compressed = rsv != 0;
+      p->streaming = p->op == OP_BINARY && client->server->on_stream != NULL;
+    }
+
+    uint64_t max_size = client->server->max_message_size;
+    if (p->frame_length > max_size || p->msg_size + p->frame_length > max_size) {
+      return fail_client(client, 1009);
+    }
+
+    if (!p->streaming && reserve_message(p, p->msg_size + p->frame_length + 1) < 0) {
+      return fail_client(client, 1011);
+    }
+  }
+
+  p->stage = PARSE_PAYLOAD;
+  p->frame_read = 0;
+  return 0;
+}
+
+/* Hands the next `len` unmasked bytes of a streamed message to `on_stream`, or finishes the message if `fin` is set. */
+static int stream_payload(cws_client_t* client, const unsigned char* data, size_t len, int fin)
+{
+  cws_parser_t* p = &client->parser;
+
+#ifdef CWS_HAVE_ZLIB
+  if (p->compressed) {
+    int code = inflate_stream(client, data, len, fin);
+    if (code != 0) {
+      return fail_client(client, code);
+    }
+    len = 0;
+  }
+#endif
+
+  if (len > 0 || fin) {
+    client->server->on_stream(client, data, len, p->stream_offset, fin);
+    p->stream_offset += len;
+  }
+
+  return 0;
+}
+
+static int finish_frame(cws_client_t* client)
+{
+  cws_parser_t* p = &client->parser;
+
+  p->stage = PARSE_HEADER;
+  p->header_len = 0;
+  p->header_need = 2;
+
+  if (p->opcode == OP_CLOSE) {
+    if (p->frame_length > 2 && valid_utf8(p->msg_ctrl + 2, p->frame_length - 2, 0) != 0) {
+      return -1;
+    }
+
+    if (get_client_state(client) != STATE_CLOSING) {
+      set_client_state(client, STATE_CLOSING);
+      reply_close_frame(client, p->msg_ctrl, p->frame_length);
+    }
+
+    return -1;
+  } else if (p->opcode == OP_PING) {
+    if (cws_send(client, (const char*)p->msg_ctrl, p->frame_length, OP_PONG) < 0) {
+      return -1;
+    }
+
+    return 0;
+  } else if (p->opcode == OP_PONG) {
+    if (p->frame_length != sizeof(client->last_pong_id)) {
+      return 0;
+    }
+
+    thread_mutex_lock(&client->lock);
+    int32_t pong_id = (p->msg_ctrl[3] << 0) | (p->msg_ctrl[2] << 8) | (p->msg_ctrl[1] << 16) | (p->msg_ctrl[0] << 24);
+    if (pong_id >= 0 && pong_id <= client->current_ping_id) {
+      client->last_pong_id = pong_id;
+    }
+    thread_mutex_unlock(&client->lock);
+
+    return 0;
+  }
+
+  if (p->streaming) {
+    p->msg_size += p->frame_length;
+    if (!p->is_fin) {
+      return 0;
+    }
+
+    if (stream_payload(client, NULL, 0, 1) < 0) {
+      return -1;
+    }
+
+    thread_mutex_lock(&client->lock);
+    client->stats.messages_received++;
+    thread_mutex_unlock(&client->lock);
+
+    reset_message(p);
+    return 0;
+  }
+
+  unsigned char* frame_data = p->msg + p->msg_size;
+  p->msg_size += p->frame_length;
+
+  // Compressed text can only be validated once it is inflated
+  if (p->op == OP_TEXT && !p->compressed) {
+    p->utf8_state = valid_utf8(frame_data, p->frame_length, p->utf8_state);
+    if (p->utf8_state == 1 || (p->is_fin && p->utf8_state != 0)) {
+      return fail_client(client, 1007);
+    }
+  }
+
+  if (!p->is_fin) {
+    return 0;
+  }
+
+#ifdef CWS_HAVE_ZLIB
+  if (p->compressed) {
+    int code = inflate_message(client);
+    if (code != 0) {
+      return fail_client(client, code);
+    }
+
+    if (p->op == OP_TEXT && valid_utf8(p->msg, p->msg_size, 0) != 0) {
+      return fail_client(client, 1007);
+    }
+  }
+#endif
+
+  thread_mutex_lock(&client->lock);
+  client->stats.messages_received++;
+  thread_mutex_unlock(&client->lock);
+
+  p->msg[p->msg_size] = '\0';
+  client->server->on_message(client, p->msg, p->msg_size, p->op);
+
+  reset_message(p);
+  return 0;
+}
+
+/**
+ * Unmasks `len` bytes from `src` into `dest`, which may be the same buffer.
+ * `offset` is the position of `src` within the frame payload.
+ * The key is rotated to that offset and widened to 64 bits, so most of the payload is done a word at a time.
+ */
+static void unmask_payload(unsigned char* dest, const unsigned char* src, size_t len, const uint8_t masks[4], uint64_t offset)
+{
+  uint8_t key[8];
+  for (int i = 0; i < 8; i++) {
+    key[i] = masks[(offset + i) & 3];
+  }
+
+  uint64_t key64;
+  memcpy(&key64, key, sizeof(key64));
+
+  size_t i = 0;
+  for (; i + 32 <= len; i += 32) {
+    uint64_t words[4];
+    memcpy(words, src + i, sizeof(words));
+    words[0] ^= key64;
+    words[1] ^= key64;
+    words[2] ^= key64;
+    words[3] ^= key64;
+    memcpy(dest + i, words, sizeof(words));
+  }
+
+  for (; i + 8 <= len; i += 8) {
+    uint64_t word;
+    memcpy(&word, src + i, sizeof(word));
+    word ^= key64;
+    memcpy(dest + i, &word, sizeof(word));
+  }
+
+  for (; i < len; i++) {
+    dest[i] = src[i] ^ key[i & 7];
+  }
+}
+
+/* Unmasks the next `len` payload bytes into the current frame and finishes it once complete. */
+static int feed_payload(cws_client_t* client, const unsigned char* data, size_t len)
+{
+  cws_parser_t* p = &client->parser;
+
+  if (p->streaming && !IS_CONTROL(p->opcode)) {
+    // Streamed payload never outlives this call, so it is unmasked into the clients own buffer one piece at a time
+    while (len > 0) {
+      size_t n = len < STREAM_CHUNK_SIZE ? len : STREAM_CHUNK_SIZE;
+      if (grow_buffer(&p->own, n) < 0) {
+        return fail_client(client, 1011);
+      }
+
+      unmask_payload(p->own.data, data, n, p->masks, p->frame_read);
+      p->frame_read += n;
+      data += n;
+      len -= n;
+
+      if (stream_payload(client, p->own.data, n, 0) < 0) {
+        return -1;
+      }
+    }
+
+    return p->frame_read == p->frame_length ? finish_frame(client) : 0;
+  }
+
+  unsigned char* dest = IS_CONTROL(p->opcode) ? p->msg_ctrl + p->frame_read : p->msg + p->msg_size + p->frame_read;
+
+  unmask_payload(dest, data, len, p->masks, p->frame_read);
+  p->frame_read += len;
+
+  if (p->frame_read == p->frame_length) {
+    return finish_frame(client);
+  }
+
+  return 0;
+}
+
+/* Feeds received bytes into the frame parser. Returns -1 if the connection should be dropped. */
+static int parse_frames(cws_client_t* client, const unsigned char* data, size_t len)
+{
+  cws_parser_t* p = &client->parser;
+
+  while (len > 0) {
+    if (p->stage == PARSE_HEADER) {
+      size_t n = p->header_need - p->header_len;
+      if (n > len) n = len;
+      memcpy(p->header + p->header_len, data, n);
+      p->header_len += n;
+      data += n;
+      len -= n;
+
+      // The first two bytes tell how long the rest of the header is
+      if (p->header_len == 2 && p->header_need == 2) {
+        uint8_t length = p->header[1] & 0x7F;
+        p->header_need += (length == 126 ? 2 : length == 127 ? 8 : 0) + ((p->header[1] & 0x80) ? 4 : 0);
+      }
+
+      if (p->header_len < p->header_need) {
+        continue;
+      }
+
+      if (parse_header(client) < 0) {
+        return -1;
+      }
+
+      if (p->frame_length == 0 && finish_frame(client) < 0) {
+        return -1;
+      }
+
+      continue;
+    }
+
+    uint64_t remaining = p->frame_length - p->frame_read;
+    size_t n = len < remaining ? len : (size_t)remaining;
+    if (feed_payload(client, data, n) < 0) {
+      return -1;
+    }
+
+    data += n;
+    len -= n;
+  }
+
+  return 0;
+}
+
+static void sha1(const uint8_t* data, size_t size, uint8_t* output)
+{
+#define SHA1ROTATELEFT(value, bits) (((value) << (bits)) | ((value) >> (32 - (bits))))
+  uint32_t W[80];
+  uint32_t H[] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+  uint32_t a, b, c, d, e, f, k;
+  uint32_t idx, lidx, widx, didx = 0;
+  int32_t wcount;
+  uint32_t temp;
   uint64_t sizebits = ((uint64_t)size) * 8;
   uint32_t loopcount = (size + 8) / 64 + 1;
   uint32_t tailbytes = 64 * loopcount - size;
   uint8_t datatail[128] = {0};
 
-  datatail[0] = 0x80;
-  datatail[tailbytes - 8] = (uint8_t)(sizebits >> 56 & 0xFF);
-  datatail[tailbytes - 7] = (uint8_t)(sizebits >> 48 & 0xFF);
-  datatail[tailbytes - 6] = (uint8_t)(sizebits >> 40 & 0xFF);
-  datatail[tailbytes - 5] = (uint8_t)(sizebits >> 32 & 0xFF);
-  datatail[tailbytes - 4] = (uint8_t)(sizebits >> 24 & 0xFF);
-  datatail[tailbytes - 3] = (uint8_t)(sizebits >> 16 & 0xFF);
-  datatail[tailbytes - 2] = (uint8_t)(sizebits >> 8 & 0xFF);
-  datatail[tailbytes - 1] = (uint8_t)(sizebits >> 0 & 0xFF);
+  datatail[0] = 0x80;
+  datatail[tailbytes - 8] = (uint8_t)(sizebits >> 56 & 0xFF);
+  datatail[tailbytes - 7] = (uint8_t)(sizebits >> 48 & 0xFF);
+  datatail[tailbytes - 6] = (uint8_t)(sizebits >> 40 & 0xFF);
+  datatail[tailbytes - 5] = (uint8_t)(sizebits >> 32 & 0xFF);
+  datatail[tailbytes - 4] = (uint8_t)(sizebits >> 24 & 0xFF);
+  datatail[tailbytes - 3] = (uint8_t)(sizebits >> 16 & 0xFF);
+  datatail[tailbytes - 2] = (uint8_t)(sizebits >> 8 & 0xFF);
+  datatail[tailbytes - 1] = (uint8_t)(sizebits >> 0 & 0xFF);
+
+  for (lidx = 0; lidx < loopcount; lidx++) {
+    memset(W, 0, 80 * sizeof(uint32_t));
+
+    for (widx = 0; widx <= 15; widx++) {
+      wcount = 24;
+
+      while (didx < size && wcount >= 0) {
+        W[widx] += (((uint32_t)data[didx]) << wcount);
+        didx++;
+        wcount -= 8;
+      }
+      while (wcount >= 0) {
+        W[widx] += (((uint32_t)datatail[didx - size]) << wcount);
+        didx++;
+        wcount -= 8;
+      }
+    }
+
+    for (widx = 16; widx <= 79; widx++) {
+      W[widx] = SHA1ROTATELEFT((W[widx - 3] ^ W[widx - 8] ^ W[widx - 14] ^ W[widx - 16]), 1);
+    }
+
+    a = H[0];
+    b = H[1];
+    c = H[2];
+    d = H[3];
+    e = H[4];
+
+    for (idx = 0; idx <= 79; idx++) {
+      if (idx <= 19) {
+        f = (b & c) | ((~b) & d);
+        k = 0x5A827999;
+      } else if (idx >= 20 && idx <= 39) {
+        f = b ^ c ^ d;
+        k = 0x6ED9EBA1;
+      } else if (idx >= 40 && idx <= 59) {
+        f = (b & c) | (b & d) | (c & d);
+        k = 0x8F1BBCDC;
+      } else if (idx >= 60 && idx <= 79) {
+        f = b ^ c ^ d;
+        k = 0xCA62C1D6;
+      }
+      temp = SHA1ROTATELEFT(a, 5) + f + e + k + W[idx];
+      e = d;
+      d = c;
+      c = SHA1ROTATELEFT(b, 30);
+      b = a;
+      a = temp;
+    }
+
+    H[0] += a;
+    H[1] += b;
+    H[2] += c;
+    H[3] += d;
+    H[4] += e;
+  }
+
+  for (idx = 0; idx < 5; idx++) {
+    output[idx * 4 + 0] = (uint8_t)(H[idx] >> 24);
+    output[idx * 4 + 1] = (uint8_t)(H[idx] >> 16);
+    output[idx * 4 + 2] = (uint8_t)(H[idx] >> 8);
+    output[idx * 4 + 3] = (uint8_t)(H[idx]);
+  }
+}
+
+/* The parts of an upgrade request the handshake needs, pointing into the clients handshake buffer. */
+typedef struct {
+  const char* key;
+  char* extensions;
+  int upgrade;
+  int connection;
+  int version;
+} cws_request_t;
+
+static int equals_nocase(const char* str, size_t len, const char* expected)
+{
+  for (size_t i = 0; i < len; i++) {
+    char c = str[i];
+    if (c >= 'A' && c <= 'Z') c += 'a' - 'A';
+    if (c != expected[i] || expected[i] == '\0') return 0;
+  }
+
+  return expected[len] == '\0';
+}
+
+/* Whether a comma separated header value contains `token`, ignoring case. */
+static int has_token(const char* value, const char* token)
+{
+  while (*value != '\0') {
+    while (*value == ' ' || *value == '\t' || *value == ',') value++;
+    const char* end = value;
+    while (*end != '\0' && *end != ',') end++;
+    const char* token_end = end;
+    while (token_end > value && (token_end[-1] == ' ' || token_end[-1] == '\t')) token_end--;
+
+    if (token_end > value && equals_nocase(value, (size_t)(token_end - value), token)) {
+      return 1;
+    }
+    value = end;
+  }
+
+  return 0;
+}
+
+/**
+ * Parses the request in the handshake buffer in place, without allocating.
+ * Lines are terminated where they end, so values can be used as strings afterwards.
+ */
+static int parse_request(char* request, cws_request_t* out)
+{
+  memset(out, 0, sizeof(cws_request_t));
+
+  char* line = request;
+  int first = 1;
+  for (;;) {
+    char* end = strstr(line, "\r\n");
+    if (end == NULL) {
+      return -1;
+    }
+
+    *end = '\0';
+    if (end == line) {
+      break;
+    }
+
+    if (first) {
+      if (strncmp(line, "GET ", 4) != 0 || strstr(line, " HTTP/1.1") == NULL) {
+        return -1;
+      }
+      first = 0;
+    } else {
+      char* colon = strchr(line, ':');
+      if (colon == NULL) {
+        return -1;
+      }
+
+      size_t name_len = (size_t)(colon - line);
+      char* value = colon + 1;
+      while (*value == ' ' || *value == '\t') value++;
+      char* value_end = end;
+      while (value_end > value && (value_end[-1] == ' ' || value_end[-1] == '\t')) value_end--;
+      *value_end = '\0';
+
+      if (equals_nocase(line, name_len, "upgrade")) {
+        out->upgrade = has_token(value, "websocket");
+      } else if (equals_nocase(line, name_len, "connection")) {
+        out->connection = has_token(value, "upgrade");
+      } else if (equals_nocase(line, name_len, "sec-websocket-key")) {
+        out->key = value;
+      } else if (equals_nocase(line, name_len, "sec-websocket-version")) {
+        out->version = atoi(value);
+      } else if (equals_nocase(line, name_len, "sec-websocket-extensions") && out->extensions == NULL) {
+        out->extensions = value;
+      }
+    }
+
+    line = end + 2;
+  }
+
+  return first ? -1 : 0;
+}
+
+static int handle_handshake(cws_client_t* client)
+{
+  cws_request_t request;
+  if (parse_request(client->handshake, &request) < 0 || !request.upgrade || !request.connection || request.key == NULL ||
+      strlen(request.key) != 24) {
+    const char* bad_request = "HTTP/1.1 400 Bad Request\r\nConnection: close\r\n\r\n";
+    sendn_client(client, bad_request, strlen(bad_request));
+    return -1;
+  }
+
+  if (request.version != 13) {
+    const char* upgrade_required = "HTTP/1.1 426 Upgrade Required\r\nSec-WebSocket-Version: 13\r\nConnection: close\r\n\r\n";
+    sendn_client(client, upgrade_required, strlen(upgrade_required));
+    return -1;
+  }
+
+  char input[61];
+  memcpy(input, request.key, 24);
+  memcpy(input + 24, "258EAFA5-E914-47DA-95CA-C5AB0DC85B11", 37);
+
+  unsigned char hash[20];
+  char accept[29];
+  sha1((const uint8_t*)input, 60, hash);
+  base64_encode(hash, sizeof(hash), accept);
+
+  char response[256];
+  int len = snprintf(response, sizeof(response),
+                     "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Accept: %s\r\n", accept);
+
+#ifdef CWS_HAVE_ZLIB
+  char extension[96];
+  if (request.extensions != NULL && !client->server->disable_deflate &&
+      negotiate_deflate(client, request.extensions, extension, sizeof(extension))) {
+    len += snprintf(response + len, sizeof(response) - len, "Sec-WebSocket-Extensions: %s\r\n", extension);
+  }
+#endif
+  len += snprintf(response + len, sizeof(response) - len, "\r\n");
+
+  if (sendn_client(client, response, (size_t)len) < 0) {
+    return -1;
+  }
+
+  set_client_state(client, STATE_OPEN);
+  client->server->on_open(client);
+  return 0;
+}
+
+/**
+ * Collects the handshake request until the blank line that ends it.
+ * Returns -1 on error, 0 if more data is needed and 1 once the handshake is done.
+ * `consumed` is set to the number of bytes that belonged to the request.
+ */
+static int feed_handshake(cws_client_t* client, const unsigned char* data, size_t len, size_t* consumed)
+{
+  size_t old_len = client->handshake_len;
+  size_t n = HANDSHAKE_MAX_SIZE - 1 - old_len;
+  if (n > len) n = len;
+
+  memcpy(client->handshake + old_len, data, n);
+  client->handshake_len += n;
+  client->handshake[client->handshake_len] = '\0';
+
+  // The terminator might have been split between two reads
+  char* end = strstr(client->handshake + (old_len > 3 ? old_len - 3 : 0), "\r\n\r\n");
+  if (end == NULL) {
+    *consumed = n;
+    if (client->handshake_len >= HANDSHAKE_MAX_SIZE - 1) {
+      const char* too_large = "HTTP/1.1 431 Request Header Fields Too Large\r\nConnection: close\r\n\r\n";
+      sendn_client(client, too_large, strlen(too_large));
+      return -1;
+    }
+    return 0;
+  }
+
+  *consumed = (size_t)(end + 4 - client->handshake) - old_len;
+  if (handle_handshake(client) < 0) {
+    return -1;
+  }
+
+  return 1;
+}
+
+/* Feeds bytes received from a client into the handshake or frame parser. Returns -1 if the client should be dropped. */
+static int feed_client(cws_client_t* client, const unsigned char* data, size_t len)
+{
+  if (get_client_state(client) == STATE_CONNECTING) {
+    size_t consumed = 0;
+    int ret = feed_handshake(client, data, len, &consumed);
+    if (ret <= 0) {
+      return ret;
+    }
+
+    data += consumed;
+    len -= consumed;
+  }
+
+  return parse_frames(client, data, len);
+}
+
+/**
+ * Picks the buffer the next recv for `client` should read into.
+ * While a large data frame is in flight this is the message buffer itself, so the payload lands in place
+ * instead of being copied out of `buf`.
+ */
+static unsigned char* recv_target(cws_client_t* client, unsigned char* buf, size_t* size)
+{
+  cws_parser_t* p = &client->parser;
+  if (p->stage != PARSE_PAYLOAD || IS_CONTROL(p->opcode) || p->streaming || p->frame_length - p->frame_read < DIRECT_READ_MIN) {
+    return buf;
+  }
+
+  *size = (size_t)(p->frame_length - p->frame_read);
+  return p->msg + p->msg_size + p->frame_read;
+}
+
+/* Handles `len` bytes that were received into `target`, as returned by `recv_target`. */
+static int feed_received(cws_client_t* client, const unsigned char* buf, unsigned char* target, size_t len)
+{
+  client->last_recv_at = now_ms();
+
+  int ret = target != buf ? feed_payload(client, target, len) : feed_client(client, buf, len);
+
+  // The parser belongs to the owner of the client, so its memory is published for `cws_client_stats`
+  cws_parser_t* p = &client->parser;
+  size_t parser_bytes = p->own.capacity + p->large.capacity + p->inflated.capacity;
+  thread_mutex_lock(&client->lock);
+  client->stats.bytes_received += len;
+  client->stats.buffer_bytes = parser_bytes;
+  thread_mutex_unlock(&client->lock);
+
+  return ret;
+}
+
+/**
+ * Pings open clients every `ping_interval_ms` and shuts down those that missed the pong deadline
+ * or did not send anything for `idle_timeout_ms`, as well as clients that did not finish the handshake in time.
+ * Called periodically by whoever owns the client.
+ */
+static void check_keepalive(cws_client_t* client, uint64_t now)
+{
+  cws_server_t* server = client->server;
+  int32_t ping_id = -1;
+
+  thread_mutex_lock(&client->lock);
+  if (client->fd != -1 && client->state == STATE_CONNECTING && now - client->connected_at > (uint64_t)server->handshake_timeout_ms) {
+    kick_client_locked(client);
+  }
+
+  if (client->fd == -1 || client->state != STATE_OPEN) {
+    thread_mutex_unlock(&client->lock);
+    return;
+  }
+
+  if (server->idle_timeout_ms > 0 && now - client->last_recv_at > (uint64_t)server->idle_timeout_ms) {
+    kick_client_locked(client);
+  } else if (server->ping_interval_ms > 0) {
+    if (client->last_pong_id != client->current_ping_id) {
+      if (server->pong_timeout_ms > 0 && now - client->ping_sent_at > (uint64_t)server->pong_timeout_ms) {
+        kick_client_locked(client);
+      }
+    } else if (now - client->ping_sent_at >= (uint64_t)server->ping_interval_ms) {
+      ping_id = ++client->current_ping_id;
+      client->ping_sent_at = now;
+    }
+  }
+  thread_mutex_unlock(&client->lock);
+
+  if (ping_id >= 0) {
+    unsigned char payload[4] = {(unsigned char)(ping_id >> 24), (unsigned char)(ping_id >> 16), (unsigned char)(ping_id >> 8), (unsigned char)ping_id};
+    cws_send(client, (const char*)payload, sizeof(payload), OP_PING);
+  }
+}
+
+static void drop_client(cws_client_t* client)
+{
+  if (get_client_state(client) != STATE_CONNECTING && thread_atomic_int_load(&g_exit_flag) != EXIT_ABANDONED) {
+    client->server->on_close(client);
+  }
+
+  close_client(client);
+}
+
+/* Applies the per-client socket options, failures are ignored as they only cost latency. */
+static void tune_client_socket(const cws_server_t* server, int fd)
+{
+  int value = 1;
+  if (!server->disable_nodelay) {
+    // Fails on Unix sockets, which do not batch small writes anyway
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (const char*)&value, sizeof(value));
+  }
+#ifdef SO_BUSY_POLL
+  if (server->busy_poll_us > 0) {
+    value = server->busy_poll_us;
+    setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, (const char*)&value, sizeof(value));
+  }
+#endif
+}
+
+/**
+ * | Threads backend |
+ * One blocking thread per client, used where epoll is not available.
+ */
+
+static int client_thread(void* data)
+{
+  cws_client_t* client = (cws_client_t*)data;
+  unsigned char buf[READ_BUFFER_SIZE];
+  ssize_t bytes_read;
+  uint64_t last_tick = now_ms();
+
+  for (;;) {
+    // Wake up regularly even if the client is silent, so pings and timeouts are handled
+#ifdef _WIN32
+    WSAPOLLFD pfd = {.fd = client->fd, .events = POLLRDNORM};
+    int ready = WSAPoll(&pfd, 1, TICK_MS);
+#else
+    struct pollfd pfd = {.fd = client->fd, .events = POLLIN};
+    int ready = poll(&pfd, 1, TICK_MS);
+    if (ready < 0 && errno == EINTR) continue;
+#endif
+    if (ready < 0) {
+      break;
+    }
+
+    uint64_t now = now_ms();
+    if (now - last_tick >= TICK_MS) {
+      check_keepalive(client, now);
+      last_tick = now;
+    }
+
+    if (ready == 0) {
+      continue;
+    }
+
+    size_t size = sizeof(buf);
+    unsigned char* target = recv_target(client, buf, &size);
+    if ((bytes_read = recv(client->fd, (char*)target, size, 0)) <= 0) {
+      break;
+    }
+
+    if (feed_received(client, buf, target, (size_t)bytes_read) < 0) {
+      break;
+    }
+  }
+
+  drop_client(client);
+  finish_thread(&client->thread);
+  return 0;
+}
+
+static int server_thread(void* data)
+{
+  cws_server_data_t* server_data = (cws_server_data_t*)data;
+
+#ifdef _WIN32
+  WSAPOLLFD pfds[CWS_MAX_ENDPOINTS];
+  int count = server_data->fd_count;
+#else
+  struct pollfd pfds[CWS_MAX_ENDPOINTS + 1];
+  int count = server_data->fd_count + 1;
+  pfds[server_data->fd_count].fd = server_data->wake_pipe[0];
+  pfds[server_data->fd_count].events = POLLIN;
+#endif
+  for (int i = 0; i < server_data->fd_count; i++) {
+    pfds[i].fd = server_data->fds[i];
+    pfds[i].events = POLLIN;
+  }
+
+  while (thread_atomic_int_load(&g_exit_flag) == EXIT_NONE) {
+#ifdef _WIN32
+    int ready = WSAPoll(pfds, count, TICK_MS);
+#else
+    int ready = poll(pfds, count, TICK_MS);
+#endif
+    for (int i = 0; i < server_data->fd_count && ready > 0; i++) {
+      if (pfds[i].revents == 0) continue;
+      ready--;
+
+      int client_fd = accept(pfds[i].fd, NULL, NULL);
+      if (client_fd < 0) continue;
+      tune_client_socket(&server_data->server, client_fd);
+
+      cws_client_t* client = alloc_client(client_fd, &server_data->server, 0);
+      if (client != NULL) {
+        // The previous thread of this slot has dropped its client already and is about to return
+        join_thread(&client->thread, 0);
+
+        // Without a queue a blocking send is the only option, but a client that stops reading is not waited on forever
+#ifdef _WIN32
+        DWORD timeout = server_data->server.send_timeout_ms;
+#else
+        struct timeval timeout = {.tv_sec = server_data->server.send_timeout_ms / 1000, .tv_usec = (server_data->server.send_timeout_ms % 1000) * 1000};
+#endif
+        setsockopt(client_fd, SOL_SOCKET, SO_SNDTIMEO, (const char*)&timeout, sizeof(timeout));
+
+        if (start_thread(&client->thread, client_thread, client) < 0) {
+          close_client(client);
+        }
+      } else {
+        close_fd(client_fd);
+      }
+    }
+  }
+
+  finish_thread(&server_data->server_thread);
+  return 0;
+}
+
+#ifdef CWS_HAVE_EPOLL
+/**
+ * | Epoll backend |
+ * Reactor threads multiplex the listening sockets and their clients, by default there is a single one.
+ * With `reactors` > 1 every reactor has its own TCP listeners bound with SO_REUSEPORT and the kernel spreads
+ * connections across them. A client stays with the reactor that accepted it.
+ * Sockets are non-blocking and level triggered, bytes are pushed into the same parser the threads backend uses.
+ */
+
+static void reactor_drop_client(cws_reactor_t* reactor, cws_client_t* client)
+{
+  epoll_ctl(reactor->epoll_fd, EPOLL_CTL_DEL, client->fd, NULL);
+  drop_client(client);
+}
+
+static void reactor_accept(cws_reactor_t* reactor, int fd)
+{
+  for (;;) {
+    int client_fd = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (client_fd < 0) {
+      if (errno == EINTR) continue;
+      return;
+    }
+
+    cws_client_t* client = alloc_client(client_fd, &reactor->server_data->server, 1);
+    if (client == NULL) {
+      close_fd(client_fd);
+      continue;
+    }
+
+    tune_client_socket(&reactor->server_data->server, client_fd);
+    thread_mutex_lock(&client->lock);
+    client->reactor = reactor;
+    thread_mutex_unlock(&client->lock);
+
+    struct epoll_event event = {.events = EPOLLIN | EPOLLRDHUP, .data.ptr = client};
+    if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, client_fd, &event) < 0) {
+      close_client(client);
+    }
+  }
+}
+
+static int owns_client(cws_reactor_t* reactor, cws_client_t* client)
+{
+  thread_mutex_lock(&client->lock);
+  int owned = client->fd != -1 && client->reactor == reactor;
+  thread_mutex_unlock(&client->lock);
+  return owned;
+}
+
+static void reactor_read(cws_reactor_t* reactor, cws_client_t* client, unsigned char* buf, size_t size)
+{
+  for (;;) {
+    size_t target_size = size;
+    unsigned char* target = recv_target(client, buf, &target_size);
+    ssize_t bytes_read = recv(client->fd, target, target_size, 0);
+    if (bytes_read > 0) {
+      if (feed_received(client, buf, target, (size_t)bytes_read) < 0) break;
+      // A short read means the socket is drained, epoll reports it again if more arrives
+      if ((size_t)bytes_read < target_size) return;
+      continue;
+    }
+
+    if (bytes_read < 0 && errno == EINTR) continue;
+    if (bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+    break;
+  }
+
+  reactor_drop_client(reactor, client);
+}
+
+static void reactor_write(cws_reactor_t* reactor, cws_client_t* client)
+{
+  thread_mutex_lock(&client->lock);
+  int ret = flush_queue_locked(client);
+  thread_mutex_unlock(&client->lock);
+
+  if (ret < 0) {
+    reactor_drop_client(reactor, client);
+  }
+}
+
+/* Runs every `TICK_MS`, handles keepalive and disconnects clients that did not accept any queued data for too long. */
+static void reactor_tick(cws_reactor_t* reactor)
+{
+  uint64_t now = now_ms();
+
+  for (int i = 0; i < client_slots(); i++) {
+    cws_client_t* client = client_at(i);
+    thread_mutex_lock(&client->lock);
+    if (client->reactor != reactor) {
+      thread_mutex_unlock(&client->lock);
+      continue;
+    }
+    if (client->fd != -1 && client->queue_head != NULL && now - client->queue_progress_at > reactor->server_data->server.send_timeout_ms) {
+      kick_client_locked(client);
+    }
+    thread_mutex_unlock(&client->lock);
+
+    check_keepalive(client, now);
+  }
+}
+
+static int reactor_thread(void* data)
+{
+  cws_reactor_t* reactor = (cws_reactor_t*)data;
+  cws_server_data_t* server_data = reactor->server_data;
+  struct epoll_event events[MAX_EVENTS];
+  unsigned char* buf = malloc(READ_BUFFER_SIZE);
+  if (buf == NULL) {
+    finish_thread(&reactor->thread);
+    return 1;
+  }
+
+  uint64_t last_tick = now_ms();
+
+  while (thread_atomic_int_load(&g_exit_flag) == EXIT_NONE) {
+    int count = epoll_wait(reactor->epoll_fd, events, MAX_EVENTS, TICK_MS);
+    for (int i = 0; i < count; i++) {
+      int* listen_fd = (int*)events[i].data.ptr;
+      if (listen_fd >= server_data->fds && listen_fd < server_data->fds + server_data->fd_count) {
+        reactor_accept(reactor, *listen_fd);
+      } else if (events[i].data.ptr == &reactor->wake_fd) {
+        uint64_t value;
+        (void)!read(reactor->wake_fd, &value, sizeof(value));
+      } else {
+        cws_client_t* client = (cws_client_t*)events[i].data.ptr;
+        if (events[i].events & EPOLLOUT) {
+          reactor_write(reactor, client);
+        }
+        if ((events[i].events & ~EPOLLOUT) && client->fd != -1) {
+          reactor_read(reactor, client, buf, READ_BUFFER_SIZE);
+        }
+      }
+    }
+
+    if (now_ms() - last_tick >= TICK_MS) {
+      reactor_tick(reactor);
+      last_tick = now_ms();
+    }
+  }
+
+  for (int i = 0; i < client_slots(); i++) {
+    if (owns_client(reactor, client_at(i))) {
+      reactor_drop_client(reactor, client_at(i));
+    }
+  }
+
+  free(buf);
+  finish_thread(&reactor->thread);
+  return 0;
+}
+
+#ifdef CWS_HAVE_IO_URING
+/**
+ * | io_uring backend |
+ * A reactor that keeps a multishot accept armed on its listeners and a multishot receive on every client.
+ * Receives land in buffers the reactor provides to the kernel, so a whole batch of them costs a single
+ * `io_uring_enter`, which also submits whatever was re-armed since the last one.
+ * Sends stay direct, non-blocking writes from whichever thread sends, only waiting for a full socket
+ * to drain goes through the ring. Tags in the low bits of `user_data` tell completions apart.
+ */
+
+#define RING_TAG_RECV 0
+#define RING_TAG_WRITABLE 1
+#define RING_TAG_ACCEPT 2
+#define RING_TAG_WAKE 3
+#define RING_TAG_MASK 3
+
+static int ring_enter(cws_ring_t* ring, unsigned to_submit, unsigned min_complete, unsigned flags, void* arg, size_t arg_size)
+{
+  return (int)syscall(__NR_io_uring_enter, ring->fd, to_submit, min_complete, flags, arg, arg_size);
+}
+
+static unsigned ring_unsubmitted(cws_ring_t* ring)
+{
+  return *ring->sq_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+}
+
+/* Returns a cleared submission queue entry, submitting the queue first if it is full. `ring->lock` has to be held. */
+static struct io_uring_sqe* ring_sqe_locked(cws_ring_t* ring)
+{
+  while (ring_unsubmitted(ring) >= ring->sq_entries) {
+    if (ring_enter(ring, ring_unsubmitted(ring), 0, 0, NULL, 0) < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+      return NULL;
+    }
+  }
+
+  unsigned tail = *ring->sq_tail;
+  struct io_uring_sqe* sqe = &ring->sqes[tail & ring->sq_mask];
+  memset(sqe, 0, sizeof(*sqe));
+  return sqe;
+}
+
+/* Publishes the entry returned by `ring_sqe_locked`, it is submitted by the next `io_uring_enter`. */
+static void ring_commit_locked(cws_ring_t* ring)
+{
+  unsigned tail = *ring->sq_tail;
+  ring->sq_array[tail & ring->sq_mask] = tail & ring->sq_mask;
+  __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  thread_atomic_int_inc(&ring->pending);
+}
+
+static void ring_recycle_buffer(cws_ring_t* ring, unsigned short id)
+{
+  struct io_uring_buf* buf = &ring->buf_ring->bufs[ring->buf_tail & (RING_BUFFERS - 1)];
+  buf->addr = (uint64_t)(uintptr_t)(ring->buffers + (size_t)id * RING_BUFFER_SIZE);
+  buf->len = RING_BUFFER_SIZE;
+  buf->bid = id;
+  ring->buf_tail++;
+  __atomic_store_n(&ring->buf_ring->tail, ring->buf_tail, __ATOMIC_RELEASE);
+}
+
+static void ring_close(cws_ring_t* ring)
+{
+  if (ring->fd != -1) close(ring->fd);
+  if (ring->ring_mem != NULL) munmap(ring->ring_mem, ring->ring_size);
+  if (ring->sqes != NULL) munmap(ring->sqes, ring->sqes_size);
+  if (ring->buf_ring != NULL) munmap(ring->buf_ring, ring->buf_ring_size);
+  // Receives that never completed may still write into the buffers, they are leaked then
+  if (thread_atomic_int_load(&ring->pending) == 0) {
+    free(ring->buffers);
+  }
+  thread_mutex_term(&ring->lock);
+  free(ring);
+}
+
+/**
+ * Sets up a ring with provided receive buffers. Returns NULL if io_uring is not available,
+ * e.g. on kernels before 5.19 or where a seccomp profile blocks it, and the caller falls back to epoll.
+ */
+static cws_ring_t* ring_open()
+{
+  cws_ring_t* ring = calloc(1, sizeof(cws_ring_t));
+  if (ring == NULL) {
+    return NULL;
+  }
+  thread_mutex_init(&ring->lock);
+  ring->recv_multishot = 1;
+
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  ring->fd = (int)syscall(__NR_io_uring_setup, RING_ENTRIES, &params);
+  unsigned features = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG;
+  if (ring->fd < 0 || (params.features & features) != features) {
+    ring_close(ring);
+    return NULL;
+  }
+
+  size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  ring->ring_size = sq_size > cq_size ? sq_size : cq_size;
+  ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  ring->ring_mem = mmap(NULL, ring->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->ring_mem == MAP_FAILED || ring->sqes == MAP_FAILED) {
+    if (ring->ring_mem == MAP_FAILED) ring->ring_mem = NULL;
+    if (ring->sqes == MAP_FAILED) ring->sqes = NULL;
+    ring_close(ring);
+    return NULL;
+  }
+
+  unsigned char* mem = (unsigned char*)ring->ring_mem;
+  ring->sq_head = (unsigned*)(mem + params.sq_off.head);
+  ring->sq_tail = (unsigned*)(mem + params.sq_off.tail);
+  ring->sq_array = (unsigned*)(mem + params.sq_off.array);
+  ring->sq_mask = *(unsigned*)(mem + params.sq_off.ring_mask);
+  ring->sq_entries = params.sq_entries;
+  ring->cq_head = (unsigned*)(mem + params.cq_off.head);
+  ring->cq_tail = (unsigned*)(mem + params.cq_off.tail);
+  ring->cq_mask = *(unsigned*)(mem + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe*)(mem + params.cq_off.cqes);
+
+  // The buffer ring has to be page aligned, which mmap guarantees
+  ring->buf_ring_size = RING_BUFFERS * sizeof(struct io_uring_buf);
+  ring->buf_ring = mmap(NULL, ring->buf_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  ring->buffers = malloc((size_t)RING_BUFFERS * RING_BUFFER_SIZE);
+  if (ring->buf_ring == MAP_FAILED || ring->buffers == NULL) {
+    if (ring->buf_ring == MAP_FAILED) ring->buf_ring = NULL;
+    ring_close(ring);
+    return NULL;
+  }
+
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (uint64_t)(uintptr_t)ring->buf_ring;
+  reg.ring_entries = RING_BUFFERS;
+  reg.bgid = 0;
+  if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+    ring_close(ring);
+    return NULL;
+  }
+
+  for (unsigned short i = 0; i < RING_BUFFERS; i++) {
+    ring_recycle_buffer(ring, i);
+  }
+
+  return ring;
+}
+
+static int ring_arm_recv_locked(cws_ring_t* ring, cws_client_t* client)
+{
+  thread_mutex_lock(&ring->lock);
+  struct io_uring_sqe* sqe = ring_sqe_locked(ring);
+  if (sqe != NULL) {
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = client->fd;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    sqe->ioprio = ring->recv_multishot ? IORING_RECV_MULTISHOT : 0;
+    sqe->user_data = (uint64_t)(uintptr_t)client | RING_TAG_RECV;
+    ring_commit_locked(ring);
+    client->ring_ops++;
+  }
+  thread_mutex_unlock(&ring->lock);
+
+  return sqe != NULL ? 0 : -1;
+}
+
+static void ring_arm_accept(cws_reactor_t* reactor, int index)
+{
+  cws_ring_t* ring = reactor->ring;
+  cws_server_data_t* server_data = reactor->server_data;
+
+  thread_mutex_lock(&ring->lock);
+  struct io_uring_sqe* sqe = ring_sqe_locked(ring);
+  if (sqe != NULL) {
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = server_data->fds[index];
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = (uint64_t)(uintptr_t)&server_data->fds[index] | RING_TAG_ACCEPT;
+    ring_commit_locked(ring);
+    ring->accept_armed[index] = 1;
+  }
+  thread_mutex_unlock(&ring->lock);
+}
+
+static int ring_arm_poll(cws_ring_t* ring, int fd, uint32_t events, int multishot, uint64_t user_data)
+{
+  thread_mutex_lock(&ring->lock);
+  struct io_uring_sqe* sqe = ring_sqe_locked(ring);
+  if (sqe != NULL) {
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    events = (events << 16) | (events >> 16);
+#endif
+    sqe->poll32_events = events;
+    sqe->len = multishot ? IORING_POLL_ADD_MULTI : 0;
+    sqe->user_data = user_data;
+    ring_commit_locked(ring);
+  }
+  thread_mutex_unlock(&ring->lock);
+
+  return sqe != NULL ? 0 : -1;
+}
+
+/* Marks the client for dropping and shuts it down, which ends its pending requests. */
+static void ring_close_client_locked(cws_client_t* client)
+{
+  if (!client->ring_closing) {
+    client->ring_closing = 1;
+    kick_client_locked(client);
+  }
+}
+
+/* Polls for POLLOUT once, sent right away as the caller may be any thread. */
+static void ring_watch_writable_locked(cws_client_t* client, int enable)
+{
+  // A pending poll can not be taken back, its completion finds the queue empty and does nothing
+  if (!enable || client->want_write || client->ring_closing) {
+    return;
+  }
+
+  cws_ring_t* ring = client->reactor->ring;
+  if (ring_arm_poll(ring, client->fd, POLLOUT, 0, (uint64_t)(uintptr_t)client | RING_TAG_WRITABLE) < 0) {
+    ring_close_client_locked(client);
+    return;
+  }
+  client->ring_ops++;
+  client->want_write = 1;
+
+  thread_mutex_lock(&ring->lock);
+  ring_enter(ring, ring_unsubmitted(ring), 0, 0, NULL, 0);
+  thread_mutex_unlock(&ring->lock);
+}
+
+/* Called with the lock held once a request of the client is done. Returns whether the client can be dropped now. */
+static int ring_release_locked(cws_client_t* client)
+{
+  client->ring_ops--;
+  return client->ring_closing && client->ring_ops == 0;
+}
+
+static void ring_add_client(cws_reactor_t* reactor, int client_fd)
+{
+  cws_client_t* client = alloc_client(client_fd, &reactor->server_data->server, 1);
+  if (client == NULL) {
+    close_fd(client_fd);
+    return;
+  }
+
+  tune_client_socket(&reactor->server_data->server, client_fd);
+  thread_mutex_lock(&client->lock);
+  client->reactor = reactor;
+  int ret = ring_arm_recv_locked(reactor->ring, client);
+  thread_mutex_unlock(&client->lock);
 
-  for (lidx = 0; lidx < loopcount; lidx++) {
-    memset(W, 0, 80 * sizeof(uint32_t));
+  if (ret < 0) {
+    close_client(client);
+  }
+}
 
-    for (widx = 0; widx <= 15; widx++) {
-      wcount = 24;
+static void ring_recv(cws_reactor_t* reactor, cws_client_t* client, struct io_uring_cqe* cqe)
+{
+  cws_ring_t* ring = reactor->ring;
+  int failed = 0;
+
+  if (cqe->res > 0 && (cqe->flags & IORING_CQE_F_BUFFER)) {
+    unsigned short id = (unsigned short)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+    unsigned char* buf = ring->buffers + (size_t)id * RING_BUFFER_SIZE;
+    failed = feed_received(client, buf, buf, (size_t)cqe->res) < 0;
+    ring_recycle_buffer(ring, id);
+  } else if (cqe->res == -EINVAL && ring->recv_multishot) {
+    // Kernels before 6.0 know provided buffers but not multishot receives, every receive is armed again instead
+    ring->recv_multishot = 0;
+  } else if (cqe->res != -ENOBUFS) {
+    failed = 1;
+  }
 
-      while (didx < size && wcount >= 0) {
-        W[widx] += (((uint32_t)data[didx]) << wcount);
-        didx++;
-        wcount -= 8;
-      }
-      while (wcount >= 0) {
-        W[widx] += (((uint32_t)datatail[didx - size]) << wcount);
-        didx++;
-        wcount -= 8;
-      }
+  thread_mutex_lock(&client->lock);
+  if (failed || ring->draining) {
+    ring_close_client_locked(client);
+  }
+  int drop = 0;
+  if (!(cqe->flags & IORING_CQE_F_MORE)) {
+    drop = ring_release_locked(client);
+    if (!client->ring_closing && ring_arm_recv_locked(ring, client) < 0) {
+      ring_close_client_locked(client);
     }
+  }
+  thread_mutex_unlock(&client->lock);
 
-    for (widx = 16; widx <= 79; widx++) {
-      W[widx] = SHA1ROTATELEFT((W[widx - 3] ^ W[widx - 8] ^ W[widx - 14] ^ W[widx - 16]), 1);
+  if (drop) {
+    drop_client(client);
+  }
+}
+
+static void ring_writable(cws_reactor_t* reactor, cws_client_t* client)
+{
+  thread_mutex_lock(&client->lock);
+  client->want_write = 0;
+  if (!client->ring_closing && !reactor->ring->draining) {
+    if (flush_queue_locked(client) < 0) {
+      ring_close_client_locked(client);
+    } else if (client->queue_head != NULL) {
+      ring_watch_writable_locked(client, 1);
     }
+  }
+  int drop = ring_release_locked(client);
+  thread_mutex_unlock(&client->lock);
 
-    a = H[0];
-    b = H[1];
-    c = H[2];
-    d = H[3];
-    e = H[4];
+  if (drop) {
+    drop_client(client);
+  }
+}
 
-    for (idx = 0; idx <= 79; idx++) {
-      if (idx <= 19) {
-        f = (b & c) | ((~b) & d);
-        k = 0x5A827999;
-      } else if (idx >= 20 && idx <= 39) {
-        f = b ^ c ^ d;
-        k = 0x6ED9EBA1;
-      } else if (idx >= 40 && idx <= 59) {
-        f = (b & c) | (b & d) | (c & d);
-        k = 0x8F1BBCDC;
-      } else if (idx >= 60 && idx <= 79) {
-        f = b ^ c ^ d;
-        k = 0xCA62C1D6;
-      }
-      temp = SHA1ROTATELEFT(a, 5) + f + e + k + W[idx];
-      e = d;
-      d = c;
-      c = SHA1ROTATELEFT(b, 30);
-      b = a;
-      a = temp;
+/* Handles all completions that are ready. */
+static void ring_reap(cws_reactor_t* reactor)
+{
+  cws_ring_t* ring = reactor->ring;
+  unsigned head = *ring->cq_head;
+
+  while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+    struct io_uring_cqe cqe = ring->cqes[head & ring->cq_mask];
+    // Frees the slot before handling the completion, which may well submit more requests
+    __atomic_store_n(ring->cq_head, ++head, __ATOMIC_RELEASE);
+
+    if (!(cqe.flags & IORING_CQE_F_MORE)) {
+      thread_atomic_int_dec(&ring->pending);
     }
 
-    H[0] += a;
-    H[1] += b;
-    H[2] += c;
-    H[3] += d;
-    H[4] += e;
+    void* ptr = (void*)(uintptr_t)(cqe.user_data & ~(uint64_t)RING_TAG_MASK);
+    if (ptr == NULL) {
+      continue;
+    }
+
+    switch (cqe.user_data & RING_TAG_MASK) {
+      case RING_TAG_RECV:
+        ring_recv(reactor, (cws_client_t*)ptr, &cqe);
+        break;
+      case RING_TAG_WRITABLE:
+        ring_writable(reactor, (cws_client_t*)ptr);
+        break;
+      case RING_TAG_ACCEPT:
+        if (cqe.res >= 0) {
+          ring_add_client(reactor, cqe.res);
+        }
+        if (!(cqe.flags & IORING_CQE_F_MORE)) {
+          int index = (int)((int*)ptr - reactor->server_data->fds);
+          ring->accept_armed[index] = 0;
+          // After an error like EMFILE it is armed again on the next tick, so it does not spin
+          if (cqe.res >= 0 && !ring->draining) {
+            ring_arm_accept(reactor, index);
+          }
+        }
+        break;
+      case RING_TAG_WAKE: {
+        uint64_t value;
+        (void)!read(reactor->wake_fd, &value, sizeof(value));
+        if (!(cqe.flags & IORING_CQE_F_MORE) && !ring->draining) {
+          ring_arm_poll(ring, reactor->wake_fd, POLLIN, 1, (uint64_t)(uintptr_t)reactor | RING_TAG_WAKE);
+        }
+        break;
+      }
+    }
   }
+}
 
-  for (idx = 0; idx < 5; idx++) {
-    output[idx * 4 + 0] = (uint8_t)(H[idx] >> 24);
-    output[idx * 4 + 1] = (uint8_t)(H[idx] >> 16);
-    output[idx * 4 + 2] = (uint8_t)(H[idx] >> 8);
-    output[idx * 4 + 3] = (uint8_t)(H[idx]);
+/* Submits what was armed since the last call and waits for a completion, up to `timeout_ms`. */
+static void ring_wait(cws_ring_t* ring, int timeout_ms)
+{
+  struct __kernel_timespec ts = {.tv_sec = timeout_ms / 1000, .tv_nsec = (timeout_ms % 1000) * 1000000LL};
+  struct io_uring_getevents_arg arg;
+  memset(&arg, 0, sizeof(arg));
+  arg.ts = (uint64_t)(uintptr_t)&ts;
+
+  thread_mutex_lock(&ring->lock);
+  unsigned to_submit = ring_unsubmitted(ring);
+  thread_mutex_unlock(&ring->lock);
+
+  ring_enter(ring, to_submit, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+}
+
+static void ring_arm_listeners(cws_reactor_t* reactor)
+{
+  cws_server_data_t* server_data = reactor->server_data;
+  for (int i = 0; i < server_data->fd_count; i++) {
+    if (server_data->fd_reactors[i] == reactor - server_data->reactors && !reactor->ring->accept_armed[i]) {
+      ring_arm_accept(reactor, i);
+    }
   }
 }
 
-static int handle_handshake(cws_frame_t* frame)
+static int ring_thread(void* data)
 {
-  ssize_t bytes_read;
-  if ((bytes_read = recv(frame->client->fd, frame->buf, sizeof(frame->buf) - 1, 0)) < 0) {
-    return -1;
+  cws_reactor_t* reactor = (cws_reactor_t*)data;
+  cws_ring_t* ring = reactor->ring;
+
+  ring_arm_poll(ring, reactor->wake_fd, POLLIN, 1, (uint64_t)(uintptr_t)reactor | RING_TAG_WAKE);
+  ring_arm_listeners(reactor);
+
+  uint64_t last_tick = now_ms();
+
+  while (thread_atomic_int_load(&g_exit_flag) == EXIT_NONE) {
+    ring_wait(ring, TICK_MS);
+    ring_reap(reactor);
+
+    if (now_ms() - last_tick >= TICK_MS) {
+      reactor_tick(reactor);
+      ring_arm_listeners(reactor);
+      last_tick = now_ms();
+    }
   }
 
-  char* key_start = strstr((const char*)frame->buf, "\r\n\r\n");
-  if (key_start == NULL) {
-    return -1;
+  // Cancels everything and collects the completions, clients are dropped as their receives end
+  ring->draining = 1;
+  thread_mutex_lock(&ring->lock);
+  struct io_uring_sqe* sqe = ring_sqe_locked(ring);
+  if (sqe != NULL) {
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY | IORING_ASYNC_CANCEL_ALL;
+    ring_commit_locked(ring);
   }
+  thread_mutex_unlock(&ring->lock);
 
-  frame->amt_read = bytes_read;
-  frame->cur_pos = (size_t)((ptrdiff_t)(key_start - (char*)frame->buf)) + 4;
+  uint64_t deadline = now_ms() + TICK_MS;
+  while (thread_atomic_int_load(&ring->pending) > 0 && now_ms() < deadline) {
+    ring_wait(ring, TICK_MS / 10);
+    ring_reap(reactor);
+  }
 
-  char* save_ptr = NULL;
-  for (key_start = strtok_r((char*)frame->buf, "\r\n", &save_ptr); key_start != NULL; key_start = strtok_r(NULL, "\r\n", &save_ptr)) {
-    if (strstr(key_start, "Sec-WebSocket-Key") != NULL) {
-      break;
+  for (int i = 0; i < client_slots(); i++) {
+    if (owns_client(reactor, client_at(i))) {
+      drop_client(client_at(i));
     }
   }
 
-  if (key_start == NULL) {
-    return -1;
+  finish_thread(&reactor->thread);
+  return 0;
+}
+#endif
+
+static void close_reactor(cws_reactor_t* reactor)
+{
+#ifdef CWS_HAVE_IO_URING
+  if (reactor->ring != NULL) {
+    ring_close(reactor->ring);
+    reactor->ring = NULL;
   }
+#endif
+  if (reactor->wake_fd != -1) close(reactor->wake_fd);
+  if (reactor->epoll_fd != -1) close(reactor->epoll_fd);
+  reactor->wake_fd = -1;
+  reactor->epoll_fd = -1;
+}
 
-  save_ptr = NULL;
-  key_start = strtok_r(key_start, " ", &save_ptr);
-  key_start = strtok_r(NULL, " ", &save_ptr);
+static int start_reactor(cws_server_data_t* server_data, int index)
+{
+  cws_reactor_t* reactor = &server_data->reactors[index];
+  reactor->server_data = server_data;
+  reactor->thread.thread = NULL;
+  reactor->wake_fd = -1;
+  reactor->epoll_fd = -1;
 
-  char* input = calloc(1, sizeof(char) * (61));
-  if (input == NULL) {
+  if ((reactor->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
     return -1;
   }
 
-  strncpy(input, key_start, 24);
-  strcat(input, "258EAFA5-E914-47DA-95CA-C5AB0DC85B11");
-
-  unsigned char hash[20];
-  sha1((const uint8_t*)input, 60, hash);
-  unsigned char* base64_result = base64_encode(hash, 20);
-  free(input);
+#ifdef CWS_HAVE_IO_URING
+  reactor->ring = NULL;
+  if (server_data->server.backend == CWS_BACKEND_IO_URING && (reactor->ring = ring_open()) != NULL) {
+    if (start_thread(&reactor->thread, ring_thread, reactor) < 0) {
+      close_reactor(reactor);
+      return -1;
+    }
+    return 0;
+  }
+#endif
 
-  char* response = malloc(sizeof(char) * 130);
-  if (response == NULL) {
+  if ((reactor->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+    close_reactor(reactor);
     return -1;
   }
 
-  strcpy(response, "HTTP/1.1 101 Switching Protocols\r\nUpgrade: "
-                   "websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Accept: ");
-  strcat(response, (const char*)base64_result);
-  strcat(response, "\r\n\r\n");
-  free(base64_result);
+  int ret = 0;
+  for (int i = 0; i < server_data->fd_count && ret == 0; i++) {
+    if (server_data->fd_reactors[i] != index) continue;
 
-  if (sendn_client(frame->client, response, strlen(response), MSG_NOSIGNAL) < 0) {
-    free(response);
-    return -1;
+    int flags = fcntl(server_data->fds[i], F_GETFL, 0);
+    struct epoll_event listen_event = {.events = EPOLLIN, .data.ptr = &server_data->fds[i]};
+    if (flags < 0 || fcntl(server_data->fds[i], F_SETFL, flags | O_NONBLOCK) < 0 ||
+        epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, server_data->fds[i], &listen_event) < 0) {
+      ret = -1;
+    }
   }
 
-  thread_mutex_lock(&frame->client->lock);
-  frame->client->state = STATE_OPEN;
-  thread_mutex_unlock(&frame->client->lock);
+  struct epoll_event wake_event = {.events = EPOLLIN, .data.ptr = &reactor->wake_fd};
+  if (ret < 0 || epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, reactor->wake_fd, &wake_event) < 0 ||
+      start_thread(&reactor->thread, reactor_thread, reactor) < 0) {
+    close_reactor(reactor);
+    return -1;
+  }
 
-  frame->client->server->on_open(frame->client);
-  free(response);
   return 0;
 }
 
-static int client_thread(void* data)
+/* Wakes all reactors and waits for them until `deadline`. Returns -1 if any had to be left running. */
+static int stop_reactors(cws_server_data_t* server_data, uint64_t deadline)
 {
-  cws_client_t* client = (cws_client_t*)data;
-  cws_frame_t frame;
+  uint64_t value = 1;
+  for (int i = 0; i < server_data->reactor_count; i++) {
+    (void)!write(server_data->reactors[i].wake_fd, &value, sizeof(value));
+  }
 
-  memset(&frame, 0, sizeof(frame));
-  frame.client = client;
+  int ret = 0;
+  for (int i = 0; i < server_data->reactor_count; i++) {
+    if (join_thread(&server_data->reactors[i].thread, deadline) < 0) {
+      ret = -1;
+    }
+  }
+  if (ret < 0) {
+    return -1;
+  }
 
-  if (handle_handshake(&frame) < 0) {
-    goto closed;
+  for (int i = 0; i < server_data->reactor_count; i++) {
+    close_reactor(&server_data->reactors[i]);
   }
+  server_data->reactor_count = 0;
+  return 0;
+}
+#endif
 
-  while (recv_next_frame(&frame) >= 0) {
-    if ((frame.op == OP_TEXT || frame.op == OP_BINARY) && !frame.error) {
-      client->server->on_message(client, frame.msg, frame.frame_size, frame.op);
-    } else if (frame.op == OP_CLOSE && !frame.error) {
-      thread_mutex_lock(&client->lock);
-      int state = client->state;
-      thread_mutex_unlock(&client->lock);
-      if (state != STATE_CLOSING) {
-        thread_mutex_lock(&client->lock);
-        client->state = STATE_CLOSING;
-        thread_mutex_unlock(&client->lock);
-        send_close_frame(&frame, -1);
-      }
+/**
+ * | Listening |
+ */
 
-      free(frame.msg);
-      break;
+/**
+ * Binds and listens on `endpoint`, TCP endpoints without a port use the server's port.
+ * `reuse_port` lets several listeners share a TCP endpoint, one per reactor.
+ * The path of a filesystem socket is copied to `unix_path`. Returns the socket or -1.
+ */
+static int listen_endpoint(const cws_endpoint_t* endpoint, const cws_server_t* server, int reuse_port, char unix_path[UNIX_PATH_SIZE])
+{
+  struct sockaddr_storage address;
+  socklen_t address_size = 0;
+  uint16_t port = endpoint->port != 0 ? endpoint->port : server->port;
+  memset(&address, 0, sizeof(address));
+
+  if (endpoint->type == CWS_ENDPOINT_IPV4) {
+    struct sockaddr_in* in = (struct sockaddr_in*)&address;
+    in->sin_family = AF_INET;
+    in->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    in->sin_port = htons(port);
+    address_size = sizeof(struct sockaddr_in);
+  } else if (endpoint->type == CWS_ENDPOINT_IPV6) {
+    struct sockaddr_in6* in6 = (struct sockaddr_in6*)&address;
+    in6->sin6_family = AF_INET6;
+    in6->sin6_addr = in6addr_loopback;
+    in6->sin6_port = htons(port);
+    address_size = sizeof(struct sockaddr_in6);
+#ifndef _WIN32
+  } else if (endpoint->type == CWS_ENDPOINT_UNIX) {
+    struct sockaddr_un* un = (struct sockaddr_un*)&address;
+    size_t len = endpoint->path != NULL ? strlen(endpoint->path) : 0;
+    if (len == 0 || len >= UNIX_PATH_SIZE || len >= sizeof(un->sun_path)) {
+      return -1;
     }
 
-    free(frame.msg);
+    un->sun_family = AF_UNIX;
+    memcpy(un->sun_path, endpoint->path, len);
+    address_size = offsetof(struct sockaddr_un, sun_path) + len;
+    if (endpoint->path[0] == '@') {
+#ifdef __linux__
+      // Abstract sockets have no file and vanish with the last descriptor
+      un->sun_path[0] = '\0';
+#else
+      return -1;
+#endif
+    } else {
+      address_size++;
+      // A socket left behind by a previous run would fail the bind. It is only removed when nobody accepts on it anymore,
+      // so a running server keeps its socket and the bind fails instead. Anything that is not a socket is left alone.
+      struct stat st;
+      if (stat(endpoint->path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (probe >= 0) {
+          // Non-blocking, a live server with a full backlog answers EAGAIN instead of stalling us
+          fcntl(probe, F_SETFL, O_NONBLOCK);
+          if (connect(probe, (struct sockaddr*)&address, address_size) < 0 && errno == ECONNREFUSED) {
+            unlink(endpoint->path);
+          }
+          close_fd(probe);
+        }
+      }
+    }
+#endif
+  } else {
+    return -1;
   }
 
-  client->server->on_close(client);
-
-closed:
-  thread_mutex_lock(&client->lock);
-  if (client->state != STATE_CLOSED) {
-    close_client(client);
+  int fd = socket(address.ss_family, SOCK_STREAM, 0);
+  if (fd < 0) {
+    return -1;
   }
-  thread_mutex_unlock(&client->lock);
-
-  return 0;
-}
 
-static int server_thread(void* data)
-{
-  cws_server_data_t* server_data = (cws_server_data_t*)data;
+  int reuse = 1;
+  if ((address.ss_family != AF_UNIX && setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (const char*)&reuse, sizeof(reuse)) < 0)) {
+    close_fd(fd);
+    return -1;
+  }
+#ifdef SO_REUSEPORT
+  if (reuse_port && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, (const char*)&reuse, sizeof(reuse)) < 0) {
+    close_fd(fd);
+    return -1;
+  }
+#else
+  (void)reuse_port;
+#endif
 
-  struct sockaddr_storage address;
-  socklen_t addrlen = sizeof(address);
-  int client_fd;
-  int i = 0;
+  // Accepted sockets inherit the buffer sizes, setting them before `listen` also lets TCP scale its window to them
+  if (server->send_buffer_size > 0) {
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, (const char*)&server->send_buffer_size, sizeof(server->send_buffer_size));
+  }
+  if (server->recv_buffer_size > 0) {
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, (const char*)&server->recv_buffer_size, sizeof(server->recv_buffer_size));
+  }
 
-  thread_mutex_init(&g_clients_mutex);
+  if (bind(fd, (struct sockaddr*)&address, address_size) < 0) {
+    close_fd(fd);
+    return -1;
+  }
 
-  while (thread_atomic_int_load(&g_exit_flag) == 0) {
-    if ((client_fd = accept(server_data->fd, (struct sockaddr*)&address, &addrlen)) < 0) {
-      continue;
-    }
+  int is_file = endpoint->type == CWS_ENDPOINT_UNIX && endpoint->path[0] != '@';
+  if (listen(fd, server->listen_backlog) < 0) {
+    close_fd(fd);
+#ifndef _WIN32
+    if (is_file) unlink(endpoint->path);
+#endif
+    return -1;
+  }
 
-    thread_mutex_lock(&g_clients_mutex);
-    for (i = 0; i < MAX_CLIENTS; i++) {
-      if (g_clients[i].fd == -1) {
-        g_clients[i].fd = client_fd;
-        g_clients[i].state = STATE_CONNECTING;
-        g_clients[i].server = &server_data->server;
-        thread_mutex_init(&g_clients[i].lock);
+  if (is_file) {
+    memcpy(unix_path, endpoint->path, strlen(endpoint->path) + 1);
+  }
 
-        break;
-      }
-    }
-    thread_mutex_unlock(&g_clients_mutex);
+  return fd;
+}
 
-    if (i != MAX_CLIENTS) {
-      thread_ptr_t thread = thread_create(client_thread, &g_clients[i], THREAD_STACK_SIZE_DEFAULT);
-      thread_detach(thread);
-    } else {
-      close_fd(client_fd);
+static void close_listeners(cws_server_data_t* server_data)
+{
+  for (int i = 0; i < server_data->fd_count; i++) {
+    close_fd(server_data->fds[i]);
+#ifndef _WIN32
+    if (server_data->unix_paths[i][0] != '\0') {
+      unlink(server_data->unix_paths[i]);
     }
+#endif
   }
-
-  return 0;
+  server_data->fd_count = 0;
 }
 
 int cws_start(cws_server_t server)
 {
   memset(&g_server_data, -1, sizeof(g_server_data));
   memcpy(&g_server_data.server, &server, sizeof(cws_server_t));
-  memset(g_clients, -1, sizeof(g_clients));
-
+  if (g_server_data.server.max_message_size == 0) {
+    g_server_data.server.max_message_size = MAX_MESSAGE_SIZE;
+  }
+  if (g_server_data.server.send_queue_max_bytes == 0) {
+    g_server_data.server.send_queue_max_bytes = SEND_QUEUE_MAX_BYTES;
+  }
+  if (g_server_data.server.send_timeout_ms == 0) {
+    g_server_data.server.send_timeout_ms = SEND_TIMEOUT_MS;
+  }
+  if (g_server_data.server.ping_interval_ms == 0) {
+    g_server_data.server.ping_interval_ms = PING_INTERVAL_MS;
+  }
+  if (g_server_data.server.pong_timeout_ms == 0) {
+    g_server_data.server.pong_timeout_ms = PONG_TIMEOUT_MS;
+  }
+  if (g_server_data.server.idle_timeout_ms == 0) {
+    g_server_data.server.idle_timeout_ms = IDLE_TIMEOUT_MS;
+  }
+  if (g_server_data.server.handshake_timeout_ms == 0) {
+    g_server_data.server.handshake_timeout_ms = HANDSHAKE_TIMEOUT_MS;
+  }
+  if (g_server_data.server.deflate_min_size == 0) {
+    g_server_data.server.deflate_min_size = DEFLATE_MIN_SIZE;
+  }
+  if (g_server_data.server.stop_timeout_ms == 0) {
+    g_server_data.server.stop_timeout_ms = STOP_TIMEOUT_MS;
+  }
+  if (g_server_data.server.listen_backlog <= 0) {
+    g_server_data.server.listen_backlog = LISTEN_BACKLOG;
+  }
+  if (g_server_data.server.max_clients <= 0) {
+    g_server_data.server.max_clients = MAX_CLIENTS;
+  } else if (g_server_data.server.max_clients > CLIENT_BLOCK_SIZE * MAX_CLIENT_BLOCKS) {
+    g_server_data.server.max_clients = CLIENT_BLOCK_SIZE * MAX_CLIENT_BLOCKS;
+  }
+  g_server_data.server_thread.thread = NULL;
+
+  // Only the epoll backend can use more than one reactor
+  int reactors = 1;
+#ifdef CWS_HAVE_EPOLL
+  g_server_data.reactor_count = 0;
+  if (server.backend != CWS_BACKEND_THREADS && server.reactors > 1) {
+    reactors = server.reactors < MAX_REACTORS ? server.reactors : MAX_REACTORS;
+  }
+#endif
 #ifdef _WIN32
   WSADATA wsaData;
   if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
-    return 1;
+    return CWS_START_SOCKETS_FAILED;
   }
   setvbuf(stdout, NULL, _IONBF, 0);
 #endif
 
-  if ((g_server_data.fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-    return 2;
+  memset(g_client_blocks, 0, sizeof(g_client_blocks));
+  thread_atomic_int_store(&g_client_slots, 0);
+  g_client_count = 0;
+  g_client_peak = 0;
+  g_clients_accepted = 0;
+  g_clients_rejected = 0;
+  thread_mutex_init(&g_clients_mutex);
+
+  thread_mutex_init(&g_buffer_pool_mutex);
+  memset(g_buffer_pool, 0, sizeof(g_buffer_pool));
+  thread_signal_init(&g_threads_signal);
+
+  // From here on every failure unwinds through `failed`
+  int ret = CWS_START_SUCCESS;
+
+  cws_endpoint_t default_endpoint = {.type = CWS_ENDPOINT_IPV4};
+  const cws_endpoint_t* endpoints = server.endpoints;
+  int endpoint_count = server.endpoint_count;
+  if (endpoints == NULL || endpoint_count <= 0) {
+    endpoints = &default_endpoint;
+    endpoint_count = 1;
+  }
+  if (endpoint_count > CWS_MAX_ENDPOINTS) {
+    ret = CWS_START_INVALID_ENDPOINTS;
+    goto failed;
   }
 
-  int reuse = 1;
-  if (setsockopt(g_server_data.fd, SOL_SOCKET, SO_REUSEADDR, (const char*)&reuse, sizeof(reuse)) < 0) {
-    close_fd(g_server_data.fd);
-    return 3;
+  g_server_data.fd_count = 0;
+  memset(g_server_data.unix_paths, 0, sizeof(g_server_data.unix_paths));
+  for (int i = 0; i < endpoint_count; i++) {
+    // Unix sockets can not be shared, the first reactor serves them alone
+    int is_unix = endpoints[i].type == CWS_ENDPOINT_UNIX;
+    for (int r = 0; r < (is_unix ? 1 : reactors); r++) {
+      int fd = listen_endpoint(&endpoints[i], &g_server_data.server, !is_unix && reactors > 1, g_server_data.unix_paths[g_server_data.fd_count]);
+      if (fd >= 0) {
+        g_server_data.fd_reactors[g_server_data.fd_count] = r;
+        g_server_data.fds[g_server_data.fd_count++] = fd;
+      } else if (!endpoints[i].optional) {
+        ret = is_unix ? CWS_START_UNIX_SOCKET_FAILED : CWS_START_PORT_FAILED;
+        goto failed;
+      }
+    }
+  }
+
+  if (g_server_data.fd_count == 0) {
+    ret = CWS_START_PORT_FAILED;
+    goto failed;
   }
 
-  struct sockaddr_in address;
-  address.sin_family = AF_INET;
-  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
-  address.sin_port = htons(g_server_data.server.port);
+  thread_atomic_int_store(&g_exit_flag, EXIT_NONE);
+
+#ifdef CWS_HAVE_EPOLL
+  if (g_server_data.server.backend != CWS_BACKEND_THREADS) {
+    for (int r = 0; r < reactors; r++) {
+      if (start_reactor(&g_server_data, r) < 0) {
+        ret = CWS_START_THREAD_FAILED;
+        goto failed;
+      }
+      g_server_data.reactor_count++;
+    }
+    return CWS_START_SUCCESS;
+  }
+#endif
 
-  if (bind(g_server_data.fd, (struct sockaddr*)&address, sizeof(address)) < 0) {
-    close_fd(g_server_data.fd);
-    return 4;
+#ifndef _WIN32
+  if (pipe(g_server_data.wake_pipe) < 0) {
+    ret = CWS_START_THREAD_FAILED;
+    goto failed;
   }
+#endif
 
-  if (listen(g_server_data.fd, MAX_CLIENTS) < 0) {
-    close_fd(g_server_data.fd);
-    return 5;
+  if (start_thread(&g_server_data.server_thread, server_thread, &g_server_data) < 0) {
+    ret = CWS_START_THREAD_FAILED;
+    goto failed;
   }
 
-  thread_atomic_int_store(&g_exit_flag, 0);
-  thread_ptr_t thread = thread_create(server_thread, &g_server_data, THREAD_STACK_SIZE_DEFAULT);
-  thread_detach(thread);
+  return CWS_START_SUCCESS;
 
-  return 0;
+failed:
+#ifdef CWS_HAVE_EPOLL
+  if (g_server_data.reactor_count > 0) {
+    thread_atomic_int_store(&g_exit_flag, EXIT_STOPPING);
+    stop_reactors(&g_server_data, 0);
+  }
+#endif
+#ifndef _WIN32
+  if (g_server_data.wake_pipe[0] != -1) {
+    close(g_server_data.wake_pipe[0]);
+    close(g_server_data.wake_pipe[1]);
+  }
+#endif
+  close_listeners(&g_server_data);
+  thread_mutex_term(&g_clients_mutex);
+  thread_mutex_term(&g_buffer_pool_mutex);
+  thread_signal_term(&g_threads_signal);
+#ifdef _WIN32
+  WSACleanup();
+#endif
+  return ret;
 }
 
 int cws_stop()
 {
-  for (int i = 0; i < MAX_CLIENTS; i++) {
-    if (g_clients[i].fd != -1) {
-      close_client(&g_clients[i]);
+  uint64_t start = now_ms();
+  uint64_t deadline = start + g_server_data.server.stop_timeout_ms;
+  int ret = 0;
+  thread_atomic_int_store(&g_exit_flag, EXIT_STOPPING);
+
+#ifdef CWS_HAVE_EPOLL
+  if (g_server_data.reactor_count > 0) {
+    ret = stop_reactors(&g_server_data, deadline);
+    // Nobody owns the remaining clients anymore, so they are dropped right here
+    for (int i = 0; i < client_slots() && ret == 0; i++) {
+      if (client_at(i)->fd != -1) {
+        drop_client(client_at(i));
+      }
     }
   }
+#endif
 
-  thread_atomic_int_store(&g_exit_flag, 1);
-  thread_mutex_term(&g_clients_mutex);
+  if (g_server_data.server_thread.thread != NULL) {
+#ifndef _WIN32
+    (void)!write(g_server_data.wake_pipe[1], "", 1);
+#endif
+    ret = join_thread(&g_server_data.server_thread, deadline);
+
+    // Client threads notice the shutdown and drop their clients, calling `on_close` on the way
+    thread_mutex_lock(&g_clients_mutex);
+    for (int i = 0; i < client_slots(); i++) {
+      thread_mutex_lock(&client_at(i)->lock);
+      kick_client_locked(client_at(i));
+      thread_mutex_unlock(&client_at(i)->lock);
+    }
+    thread_mutex_unlock(&g_clients_mutex);
 
-  close_fd(g_server_data.fd);
+    for (int i = 0; i < client_slots(); i++) {
+      if (join_thread(&client_at(i)->thread, deadline) < 0) {
+        ret = -1;
+      }
+    }
+  }
+
+  if (ret < 0) {
+    // Whatever is still running may touch the clients, locks and buffers, so they are leaked instead of freed
+    thread_atomic_int_store(&g_exit_flag, EXIT_ABANDONED);
+    close_listeners(&g_server_data);
+    return -1;
+  }
+
+  close_listeners(&g_server_data);
+#ifndef _WIN32
+  if (g_server_data.wake_pipe[0] != -1) {
+    close(g_server_data.wake_pipe[0]);
+    close(g_server_data.wake_pipe[1]);
+  }
+#endif
+
+  for (int i = 0; i < client_slots(); i++) {
+    cws_client_t* client = client_at(i);
+    free_buffer(&client->parser.own);
+    free_buffer(&client->parser.inflated);
+#ifdef CWS_HAVE_ZLIB
+    free_buffer(&client->deflated);
+#endif
+    thread_mutex_term(&client->lock);
+  }
+  for (int i = 0; i < MAX_CLIENT_BLOCKS; i++) {
+    free(g_client_blocks[i]);
+    g_client_blocks[i] = NULL;
+  }
+  thread_atomic_int_store(&g_client_slots, 0);
+  pool_clear();
+
+  thread_mutex_term(&g_clients_mutex);
+  thread_mutex_term(&g_buffer_pool_mutex);
+  thread_signal_term(&g_threads_signal);
 
 #ifdef _WIN32
   WSACleanup();
 #endif
 
-  return 0;
+  return (int)(now_ms() - start);
 }
@@ -1,6 +1,8 @@
 #ifndef CWS_H
 #define CWS_H
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #ifdef __cplusplus
@@ -10,18 +12,189 @@ extern "C" {
 #define CWS_TYPE_TEXT 1
 #define CWS_TYPE_BINARY 2
 
+/* Picks epoll on Linux and a thread per client everywhere else */
+#define CWS_BACKEND_DEFAULT 0
+#define CWS_BACKEND_THREADS 1
+#define CWS_BACKEND_EPOLL 2
+/* Linux only, uses epoll where the kernel (5.19+) or a seccomp profile does not allow io_uring */
+#define CWS_BACKEND_IO_URING 3
+
+/* What happens when a clients outbound queue is full */
+#define CWS_SEND_QUEUE_DISCONNECT 0
+#define CWS_SEND_QUEUE_DROP 1
+/* Returned by the send functions when `CWS_SEND_QUEUE_DROP` dropped the frame, the client stays connected */
+#define CWS_SEND_DROPPED -2
+
+/* Kinds of `cws_endpoint_t`, TCP endpoints are always bound to loopback */
+#define CWS_ENDPOINT_IPV4 0
+#define CWS_ENDPOINT_IPV6 1
+#define CWS_ENDPOINT_UNIX 2
+
+#define CWS_MAX_ENDPOINTS 8
+
+/* Return values of `cws_start` */
+#define CWS_START_SUCCESS 0
+/* Windows only, WSAStartup failed */
+#define CWS_START_SOCKETS_FAILED 1
+/* More than `CWS_MAX_ENDPOINTS` endpoints */
+#define CWS_START_INVALID_ENDPOINTS 2
+/* A Unix socket endpoint could not be set up, its path is invalid or another server is listening on it */
+#define CWS_START_UNIX_SOCKET_FAILED 3
+/* A TCP endpoint could not be set up, usually because the port is in use */
+#define CWS_START_PORT_FAILED 4
+/* The server thread or a reactor could not be started */
+#define CWS_START_THREAD_FAILED 5
+
+/* Why `on_reject` turned a connection away */
+#define CWS_REJECT_FULL 0
+#define CWS_REJECT_NO_MEMORY 1
+
 typedef struct cws_client cws_client_t;
 
+/* Picks the clients a broadcast goes to */
+typedef bool (*cws_filter_t)(cws_client_t* client, void* data);
+/**
+ * Told about every client a broadcast could not be sent or queued to. `disconnected` is false if only the message was
+ * dropped because of `CWS_SEND_QUEUE_DROP`, otherwise the client is being disconnected.
+ */
+typedef void (*cws_failed_t)(cws_client_t* client, bool disconnected, void* data);
+
+/**
+ * A frame whose header is encoded once, so the same message can be sent to many clients.
+ * `payload` is not copied and has to stay valid while the frame is sent.
+ * These frames are always sent uncompressed, as deflate contexts are per client.
+ */
+typedef struct {
+  unsigned char header[10];
+  uint8_t header_size;
+  const char* payload;
+  uint64_t payload_size;
+} cws_frame_t;
+
+typedef struct {
+  uint64_t messages_received;
+  uint64_t bytes_received;
+  /* Frames that were sent or queued, control frames included */
+  uint64_t frames_sent;
+  uint64_t bytes_sent;
+  /* Memory held by the receive and compression buffers of the client */
+  size_t buffer_bytes;
+  /* Bytes waiting in the outbound queue */
+  size_t queued_bytes;
+} cws_client_stats_t;
+
+typedef struct {
+  /* The backend that is actually running, `CWS_BACKEND_IO_URING` may have fallen back to epoll */
+  int backend;
+  int clients;
+  int peak_clients;
+  int max_clients;
+  uint64_t accepted;
+  uint64_t rejected;
+  /* Memory of the client table itself */
+  size_t table_bytes;
+  /* Buffers of all clients and the shared buffer pool */
+  size_t buffer_bytes;
+  size_t queued_bytes;
+} cws_stats_t;
+
+/* An address to accept clients on. */
+typedef struct {
+  int type;
+  /* For TCP endpoints. 0 = the `port` of the server */
+  uint16_t port;
+  /* For Unix endpoints, a filesystem path or a name starting with '@' for the abstract namespace (Linux only) */
+  const char* path;
+  /* If this endpoint can not be bound the server starts without it */
+  bool optional;
+} cws_endpoint_t;
+
 typedef struct {
   uint16_t port;
+  /* Up to `CWS_MAX_ENDPOINTS` endpoints to listen on. If there are none the server listens on 127.0.0.1:`port` */
+  const cws_endpoint_t* endpoints;
+  int endpoint_count;
+  int backend;
+  /* Larger messages are refused with 1009 (Message Too Big), this includes streamed and inflated messages. 0 = 16 MiB */
+  uint64_t max_message_size;
+  /* Bytes that may wait for a slow client before `send_queue_policy` applies. 0 = 4 MiB */
+  uint32_t send_queue_max_bytes;
+  /* `CWS_SEND_QUEUE_DISCONNECT` or `CWS_SEND_QUEUE_DROP` (drops the frame that does not fit) */
+  int send_queue_policy;
+  /* A client that does not accept any data for this long is disconnected. 0 = 5000ms */
+  uint32_t send_timeout_ms;
+  /* A client that does not complete the upgrade request within this time is disconnected. 0 = 5000ms */
+  uint32_t handshake_timeout_ms;
+  /* How often open clients are pinged. 0 = 5000ms, negative disables pings */
+  int ping_interval_ms;
+  /* A client that does not answer a ping within this time is disconnected. 0 = 5000ms, negative disables */
+  int pong_timeout_ms;
+  /* A client that sends nothing at all (pongs included) for this long is disconnected. 0 = 60000ms, negative disables */
+  int idle_timeout_ms;
+  /* Do not negotiate permessage-deflate, saves CPU where bandwidth does not matter (e.g. localhost) */
+  bool disable_deflate;
+  /* Outgoing messages smaller than this are sent uncompressed. 0 = 64 bytes */
+  uint32_t deflate_min_size;
+  /* Client sockets turn off Nagle's algorithm so small frames go out at once, set this to keep it on */
+  bool disable_nodelay;
+  /* SO_SNDBUF and SO_RCVBUF of client sockets in bytes. 0 = system default */
+  int send_buffer_size;
+  int recv_buffer_size;
+  /* SO_BUSY_POLL of client sockets in microseconds (Linux), trades CPU for lower receive latency. 0 = off */
+  int busy_poll_us;
+  /* Connections the listeners queue before they are accepted. 0 = 64 */
+  int listen_backlog;
+  /**
+   * Epoll backend only: number of reactor threads, at most 8. 0 = 1
+   * Each one gets its own TCP listeners bound with SO_REUSEPORT, so the kernel spreads connections across them.
+   * Unix socket endpoints are served by the first reactor only.
+   */
+  int reactors;
+  /* Connections beyond this many are closed right away and reported to `on_reject`. 0 = 256, at most 4096 */
+  int max_clients;
+  /* How long `cws_stop` waits for the server threads to finish. 0 = 2000ms */
+  uint32_t stop_timeout_ms;
   void (*on_open)(cws_client_t* client);
   void (*on_close)(cws_client_t* client);
   void (*on_message)(cws_client_t* client, const unsigned char* msg, uint64_t msg_size, int type);
+  /* Optional. Called by the accepting thread for every connection that is turned away, `clients` are connected */
+  void (*on_reject)(int reason, int clients);
+  /**
+   * Optional. If set, binary messages are not assembled in memory but handed over in chunks as they arrive,
+   * `on_message` is then only called for text messages.
+   * `offset` is the position of `chunk` within the message. Once the message is complete this is called
+   * one last time with `fin` set and an empty chunk. If the client goes away before that, only `on_close` follows.
+   */
+  void (*on_stream)(cws_client_t* client, const unsigned char* chunk, uint64_t size, uint64_t offset, bool fin);
 } cws_server_t;
 
 extern int cws_start(cws_server_t server);
+/**
+ * Stops accepting, closes every client (`on_close` is called for open ones) and waits for all threads.
+ * Returns the time that took in milliseconds, or -1 if some thread did not finish within `stop_timeout_ms`.
+ * Such threads are left behind without calling back anymore and the server's memory is not released.
+ */
 extern int cws_stop();
 extern int cws_send(cws_client_t* client, const char* msg, uint64_t size, int type);
+extern void cws_frame_init(cws_frame_t* frame, const char* msg, uint64_t size, int type);
+extern int cws_send_frame(cws_client_t* client, const cws_frame_t* frame);
+/**
+ * Sends a message to every open client `filter` accepts, or to all of them if it is NULL.
+ * The frame is encoded once, clients that can not take it right away share one copy of it in their queues.
+ * Like `cws_frame_t`, broadcasts are never compressed. `data` is passed to both callbacks.
+ * Returns the number of clients the message was sent or queued to.
+ */
+extern int cws_broadcast(const char* msg, uint64_t size, int type, cws_filter_t filter, cws_failed_t on_failed, void* data);
+/**
+ * Attaches a pointer to a client, it starts out as NULL.
+ * Meant to be used from the callbacks of that client only, which never run concurrently. Free it in `on_close`.
+ */
+extern void cws_set_data(cws_client_t* client, void* data);
+extern void* cws_get_data(cws_client_t* client);
+/* Copies the counters of `client` into `out`. Returns -1 if the client is not connected. */
+extern int cws_client_stats(cws_client_t* client, cws_client_stats_t* out);
+/* Copies the counters of the whole server into `out`. Returns -1 if the server is not running. */
+extern int cws_get_stats(cws_stats_t* out);
 
 #ifdef __cplusplus
 }
@@ -17,6 +17,9 @@ void __wnp_update_player(wnp_player_t* player);
 void __wnp_remove_player(int player_id);
 void __wnp_end_update_cycle();
 bool __wnp_write_cover(int player_id, void* data, uint64_t size);
+/* Opens a temporary file for a cover that is written in pieces, `__wnp_close_cover` moves it into place if `commit` is set. */
+FILE* __wnp_open_cover(int player_id, char tmp_path_out[WNP_STR_LEN]);
+bool __wnp_close_cover(int player_id, FILE* file, const char tmp_path[WNP_STR_LEN], bool commit);
 bool __wnp_get_cover_path(int player_id, char cover_path_out[WNP_STR_LEN]);
 void __wnp_set_event_result(int event_id, wnp_event_result_t result);
 
@@ -43,6 +46,7 @@ wnp_init_ret_t __wnp_platform_web_init();
 void __wnp_platform_web_uninit();
 void __wnp_platform_web_free(void* platform_data);
 void __wnp_platform_web_event(wnp_player_t* player, wnp_event_t event, int event_id, int data);
+bool __wnp_platform_web_stats(wnp_web_stats_t* stats_out);
 #endif /* WNP_BUILD_PLATFORM_WEB */
 
 #ifdef WNP_BUILD_PLATFORM_LINUX
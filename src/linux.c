@@ -7,6 +7,8 @@
 #include "wnp.h"
 
 #include <ctype.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <gio/gio.h>
 #include <glib-object.h>
 #include <glib.h>
@@ -17,18 +19,74 @@
  * ================================
  */
 
+#define WNP_LINUX_COVER_CACHE_SIZE 16
+#define WNP_LINUX_COVER_CACHE_MAX_BYTES (16 * 1024 * 1024)
+
+/**
+ * Identifies a cover by its full artUrl. Players reuse fixed file:// paths for changing covers,
+ * so the size and modification time of the file are part of it.
+ */
+typedef struct {
+  gchar* art_url;
+  size_t art_url_len;
+  int64_t file_stamp[3];
+  // Only used to skip most cache entries without comparing the URL
+  uint64_t hash;
+} _linux_cover_key_t;
+
+typedef struct {
+  _linux_cover_key_t key;
+  unsigned char* png;
+  size_t png_size;
+  uint64_t last_used;
+} _linux_cover_cache_entry_t;
+
+#define WNP_LINUX_MAX_COVER_THREADS 16
+
+typedef struct _linux_cover_job {
+  gchar* player_name;
+  _linux_cover_key_t key;
+  char cover_src[WNP_STR_LEN];
+  uint64_t generation;
+  struct _linux_cover_job* next;
+} _linux_cover_job_t;
+
 typedef struct {
   guint signal_subscription_id;
   GDBusConnection* connection;
   thread_ptr_t loop_thread;
   GMainLoop* loop;
+  _linux_cover_cache_entry_t cover_cache[WNP_LINUX_COVER_CACHE_SIZE];
+  size_t cover_cache_bytes;
+  uint64_t cover_cache_tick;
+  thread_mutex_t cover_cache_lock;
+  thread_ptr_t cover_threads[WNP_LINUX_MAX_COVER_THREADS];
+  int cover_thread_count;
+  _linux_cover_job_t* cover_jobs_head;
+  _linux_cover_job_t* cover_jobs_tail;
+  thread_mutex_t cover_jobs_lock;
+  thread_signal_t cover_jobs_signal;
+  thread_atomic_int_t cover_threads_exit;
+  uint64_t cover_generation;
 } _linux_state_t;
 
 typedef struct {
   gchar* player_name;
   guint signal_subscription_id;
+  // The cover that was written for the player
+  _linux_cover_key_t cover_key;
+  // The cover that is being decoded
+  _linux_cover_key_t pending_key;
+  uint64_t cover_generation;
 } _linux_platform_data_t;
 
+typedef struct {
+  unsigned char* data;
+  size_t size;
+  size_t capacity;
+  bool failed;
+} _linux_png_buffer_t;
+
 static _linux_state_t _linux_state = {0};
 
 /**
@@ -78,108 +136,496 @@ static bool _linux_is_web_browser(const gchar* _player_name)
     return false;
 }
 
-static const char base64_chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+static size_t decode_base64(const char* string, size_t len, uint8_t* out)
+{
+  // clang-format off
+  // 6-bit value of every base64 character, 0xff for everything else (including '=')
+  static const uint8_t base64_table[256] = {
+    0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff, // 00..0f
+    0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff, // 10..1f
+    0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0x3e,0xff,0xff,0xff,0x3f, // 20..2f
+    0x34,0x35,0x36,0x37,0x38,0x39,0x3a,0x3b,0x3c,0x3d,0xff,0xff,0xff,0xff,0xff,0xff, // 30..3f
+    0xff,0x00,0x01,0x02,0x03,0x04,0x05,0x06,0x07,0x08,0x09,0x0a,0x0b,0x0c,0x0d,0x0e, // 40..4f
+    0x0f,0x10,0x11,0x12,0x13,0x14,0x15,0x16,0x17,0x18,0x19,0xff,0xff,0xff,0xff,0xff, // 50..5f
+    0xff,0x1a,0x1b,0x1c,0x1d,0x1e,0x1f,0x20,0x21,0x22,0x23,0x24,0x25,0x26,0x27,0x28, // 60..6f
+    0x29,0x2a,0x2b,0x2c,0x2d,0x2e,0x2f,0x30,0x31,0x32,0x33,0xff,0xff,0xff,0xff,0xff, // 70..7f
+    0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff, // 80..8f
+    0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff, // 90..9f
+    0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff, // a0..af
+    0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff, // b0..bf
+    0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff, // c0..cf
+    0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff, // d0..df
+    0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff, // e0..ef
+    0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff, // f0..ff
+  };
+  // clang-format on
+
+  const uint8_t* in = (const uint8_t*)string;
+  uint8_t* ptr = out;
+  size_t idx = 0;
+
+  // Fast path: 8 characters at a time. Any non-alphabet character (padding, whitespace, end of
+  // the string) sets the high bit in `invalid` and hands the rest over to the scalar loop below.
+  while (idx + 8 <= len) {
+    uint64_t a = base64_table[in[idx + 0]], b = base64_table[in[idx + 1]];
+    uint64_t c = base64_table[in[idx + 2]], d = base64_table[in[idx + 3]];
+    uint64_t e = base64_table[in[idx + 4]], f = base64_table[in[idx + 5]];
+    uint64_t g = base64_table[in[idx + 6]], h = base64_table[in[idx + 7]];
+    if ((a | b | c | d | e | f | g | h) & 0x80) break;
+
+    uint64_t bits = (a << 42) | (b << 36) | (c << 30) | (d << 24) | (e << 18) | (f << 12) | (g << 6) | h;
+    ptr[0] = (uint8_t)(bits >> 40);
+    ptr[1] = (uint8_t)(bits >> 32);
+    ptr[2] = (uint8_t)(bits >> 24);
+    ptr[3] = (uint8_t)(bits >> 16);
+    ptr[4] = (uint8_t)(bits >> 8);
+    ptr[5] = (uint8_t)bits;
+    ptr += 6;
+    idx += 8;
+  }
 
-static inline bool is_base64(char c)
+  uint32_t bits = 0;
+  size_t i = 0;
+  for (; idx < len; idx++) {
+    uint8_t value = base64_table[in[idx]];
+    if (value == 0xff) break;
+
+    bits = (bits << 6) | value;
+    if (++i == 4) {
+      ptr[0] = (uint8_t)(bits >> 16);
+      ptr[1] = (uint8_t)(bits >> 8);
+      ptr[2] = (uint8_t)bits;
+      ptr += 3;
+      bits = 0;
+      i = 0;
+    }
+  }
+
+  // Trailing 2 or 3 characters carry 1 or 2 bytes
+  if (i > 1) {
+    bits <<= 6 * (4 - i);
+    ptr[0] = (uint8_t)(bits >> 16);
+    if (i == 3) ptr[1] = (uint8_t)(bits >> 8);
+    ptr += i - 1;
+  }
+
+  return (size_t)(ptr - out);
+}
+
+/* Fills everything but the hash and the URL copy, `art_url` is only borrowed */
+static void _linux_cover_key_init(_linux_cover_key_t* key, const char* art_url, bool is_file)
 {
-  return isalnum(c) || c == '+' || c == '/';
+  memset(key, 0, sizeof(_linux_cover_key_t));
+  key->art_url = (gchar*)art_url;
+  key->art_url_len = strlen(art_url);
+
+  struct stat st;
+  if (is_file && stat(art_url + 7, &st) == 0) {
+    key->file_stamp[0] = (int64_t)st.st_size;
+    key->file_stamp[1] = (int64_t)st.st_mtim.tv_sec;
+    key->file_stamp[2] = (int64_t)st.st_mtim.tv_nsec;
+  }
 }
 
-static int base64_chars_find(char find)
+static void _linux_cover_key_hash(_linux_cover_key_t* key)
 {
-  for (size_t i = 0; i < 64; ++i) {
-    if (base64_chars[i] == find) {
-      return i;
-    }
+  // FNV-1a over the URL and the file stamp
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (size_t i = 0; i < key->art_url_len; i++) {
+    hash ^= (unsigned char)key->art_url[i];
+    hash *= 0x100000001b3ULL;
+  }
+  for (size_t i = 0; i < sizeof(key->file_stamp); i++) {
+    hash ^= ((unsigned char*)key->file_stamp)[i];
+    hash *= 0x100000001b3ULL;
   }
+  key->hash = hash;
+}
 
-  return -1;
+/* Copies `src` into `dest` with its own URL. Returns false if out of memory, `dest` is then empty. */
+static bool _linux_cover_key_copy(_linux_cover_key_t* dest, const _linux_cover_key_t* src)
+{
+  g_free(dest->art_url);
+  *dest = *src;
+  dest->art_url = g_strndup(src->art_url, src->art_url_len);
+  if (dest->art_url == NULL) {
+    memset(dest, 0, sizeof(_linux_cover_key_t));
+    return false;
+  }
+  return true;
 }
 
-static size_t decode_base64(const char* string, void* data)
+static void _linux_cover_key_clear(_linux_cover_key_t* key)
 {
-  size_t size = 0;
-  uint8_t* ptr = (uint8_t*)data;
-  size_t len = strlen(string);
+  g_free(key->art_url);
+  memset(key, 0, sizeof(_linux_cover_key_t));
+}
 
-  uint8_t char_array_3[3];
-  uint8_t char_array_4[4];
+/* Compares the full URL, hashes are only compared if both keys have one */
+static bool _linux_cover_key_equal(const _linux_cover_key_t* a, const _linux_cover_key_t* b)
+{
+  if (a->art_url == NULL || b->art_url == NULL || a->art_url_len != b->art_url_len) return false;
+  if (a->hash != 0 && b->hash != 0 && a->hash != b->hash) return false;
+  if (memcmp(a->file_stamp, b->file_stamp, sizeof(a->file_stamp)) != 0) return false;
+  return a->art_url == b->art_url || memcmp(a->art_url, b->art_url, a->art_url_len) == 0;
+}
 
-  size_t idx = 0;
-  size_t i = 0;
-  size_t j = 0;
+static _linux_cover_cache_entry_t* _linux_cover_cache_find(const _linux_cover_key_t* key)
+{
+  for (size_t i = 0; i < WNP_LINUX_COVER_CACHE_SIZE; i++) {
+    _linux_cover_cache_entry_t* entry = &_linux_state.cover_cache[i];
+    if (entry->png != NULL && _linux_cover_key_equal(&entry->key, key)) {
+      entry->last_used = ++_linux_state.cover_cache_tick;
+      return entry;
+    }
+  }
 
-  while (idx < len && string[idx] != '=' && is_base64(string[idx])) {
-    char_array_4[i++] = string[idx];
-    ++idx;
+  return NULL;
+}
 
-    if (i == 4) {
-      for (i = 0; i < 4; ++i) {
-        char_array_4[i] = (uint8_t)base64_chars_find(char_array_4[i]);
-        if (char_array_4[i] == (uint8_t)-1) {
-          return size;
-        }
-      }
+static void _linux_cover_cache_evict(_linux_cover_cache_entry_t* entry)
+{
+  _linux_state.cover_cache_bytes -= entry->png_size + entry->key.art_url_len;
+  _linux_cover_key_clear(&entry->key);
+  free(entry->png);
+  memset(entry, 0, sizeof(_linux_cover_cache_entry_t));
+}
 
-      char_array_3[0] = (char_array_4[0] << 2) + ((char_array_4[1] & 0x30) >> 4);
-      char_array_3[1] = ((char_array_4[1] & 0x0F) << 4) + ((char_array_4[2] & 0x3C) >> 2);
-      char_array_3[2] = ((char_array_4[2] & 0x03) << 6) + char_array_4[3];
+static void _linux_cover_cache_insert(const _linux_cover_key_t* key, unsigned char* png, size_t png_size)
+{
+  // Takes ownership of `png`, the URL is copied and counts towards the size of the entry
+  size_t size = png_size + key->art_url_len;
+  if (size > WNP_LINUX_COVER_CACHE_MAX_BYTES / 4) {
+    free(png);
+    return;
+  }
 
-      for (i = 0; i < 3; ++i, ++ptr) {
-        *ptr = char_array_3[i];
-        ++size;
+  _linux_cover_cache_entry_t* slot = NULL;
+  while (slot == NULL || _linux_state.cover_cache_bytes + size > WNP_LINUX_COVER_CACHE_MAX_BYTES) {
+    _linux_cover_cache_entry_t* lru = NULL;
+    slot = NULL;
+    for (size_t i = 0; i < WNP_LINUX_COVER_CACHE_SIZE; i++) {
+      _linux_cover_cache_entry_t* entry = &_linux_state.cover_cache[i];
+      if (entry->png == NULL) {
+        slot = entry;
+      } else if (lru == NULL || entry->last_used < lru->last_used) {
+        lru = entry;
       }
+    }
 
-      i = 0;
+    if (slot != NULL && _linux_state.cover_cache_bytes + size <= WNP_LINUX_COVER_CACHE_MAX_BYTES) break;
+    _linux_cover_cache_evict(lru);
+  }
+
+  if (!_linux_cover_key_copy(&slot->key, key)) {
+    free(png);
+    return;
+  }
+  slot->png = png;
+  slot->png_size = png_size;
+  slot->last_used = ++_linux_state.cover_cache_tick;
+  _linux_state.cover_cache_bytes += size;
+}
+
+static void _linux_cover_cache_clear()
+{
+  for (size_t i = 0; i < WNP_LINUX_COVER_CACHE_SIZE; i++) {
+    if (_linux_state.cover_cache[i].png != NULL) {
+      _linux_cover_cache_evict(&_linux_state.cover_cache[i]);
     }
   }
+  _linux_state.cover_cache_bytes = 0;
+  _linux_state.cover_cache_tick = 0;
+}
 
-  if (i > 0) {
-    for (j = i; j < 4; ++j) {
-      char_array_4[j] = 0;
+static void _linux_png_write_func(void* context, void* data, int size)
+{
+  _linux_png_buffer_t* buffer = (_linux_png_buffer_t*)context;
+  if (buffer->failed) return;
+
+  if (buffer->size + size > buffer->capacity) {
+    size_t capacity = buffer->capacity == 0 ? 64 * 1024 : buffer->capacity;
+    while (capacity < buffer->size + size) {
+      capacity *= 2;
     }
 
-    for (j = 0; j < 4; ++j) {
-      char_array_4[j] = (uint8_t)base64_chars_find(char_array_4[j]);
-      if (char_array_4[j] == (uint8_t)-1) {
-        return size;
-      }
+    unsigned char* tmp = realloc(buffer->data, capacity);
+    if (tmp == NULL) {
+      buffer->failed = true;
+      return;
     }
+    buffer->data = tmp;
+    buffer->capacity = capacity;
+  }
+
+  memcpy(buffer->data + buffer->size, data, size);
+  buffer->size += size;
+}
+
+static unsigned char* _linux_load_cover_image(const char* art_url, int* width, int* height, int* channels)
+{
+  if (g_str_has_prefix(art_url, "file://")) {
+    return stbi_load(art_url + 7, width, height, channels, 0);
+  }
+
+  const char* uri = strchr(art_url, ',');
+  if (uri == NULL) return NULL;
+  uri++;
+
+  size_t len = strlen(uri);
+  uint8_t* data = malloc(len / 4 * 3 + 3);
+  if (data == NULL) return NULL;
+  size_t size = decode_base64(uri, len, data);
+
+  unsigned char* image_data = stbi_load_from_memory(data, size, width, height, channels, 0);
+  free(data);
+  return image_data;
+}
+
+static bool _linux_encode_cover(const char* art_url, _linux_png_buffer_t* png)
+{
+  int width, height, channels;
+  unsigned char* image_data = _linux_load_cover_image(art_url, &width, &height, &channels);
+  if (image_data == NULL) return false;
+
+  int ok = stbi_write_png_to_func(_linux_png_write_func, png, width, height, channels, image_data, width * channels);
+  stbi_image_free(image_data);
+  if (!ok || png->failed) {
+    free(png->data);
+    png->data = NULL;
+    return false;
+  }
+
+  return true;
+}
 
-    char_array_3[0] = (char_array_4[0] << 2) + ((char_array_4[1] & 0x30) >> 4);
-    char_array_3[1] = ((char_array_4[1] & 0x0F) << 4) + ((char_array_4[2] & 0x3C) >> 2);
-    char_array_3[2] = ((char_array_4[2] & 0x03) << 6) + char_array_4[3];
+static void _linux_cover_job_free(_linux_cover_job_t* job)
+{
+  g_free(job->player_name);
+  g_free(job->key.art_url);
+  free(job);
+}
+
+/* Writes a decoded cover into its player, `png` is NULL if decoding failed so the cover is requested again next time. */
+static void _linux_cover_apply(_linux_cover_job_t* job, const unsigned char* png, size_t png_size)
+{
+  wnp_player_t players[WNP_MAX_PLAYERS] = {0};
+  int count = __wnp_start_update_cycle(players);
+
+  for (size_t i = 0; i < count; i++) {
+    _linux_platform_data_t* platform_data = _linux_get_platform_data(&players[i]);
+    if (platform_data == NULL || g_strcmp0(platform_data->player_name, job->player_name) != 0) continue;
+
+    // A newer cover was requested while this one was decoding
+    if (platform_data->cover_generation != job->generation) break;
+
+    _linux_cover_key_clear(&platform_data->pending_key);
 
-    for (j = 0; j < i - 1; ++j, ++ptr) {
-      *ptr = char_array_3[j];
-      ++size;
+    char cover_path[WNP_STR_LEN] = {0};
+    if (png != NULL && __wnp_get_cover_path(players[i].id, cover_path) && __wnp_write_cover(players[i].id, (void*)png, png_size)) {
+      _linux_cover_key_copy(&platform_data->cover_key, &job->key);
+      _linux_assign_str(players[i].cover, cover_path);
+      _linux_assign_str(players[i].cover_src, job->cover_src);
+      __wnp_update_player(&players[i]);
     }
+    break;
   }
 
-  return size;
+  __wnp_end_update_cycle();
 }
 
-static size_t base64_decode_bytes(const char* string)
+static int _linux_cover_thread_func(void* user_data)
 {
-  size_t size = 0;
-  size_t len = strlen(string);
-  size_t idx = 0;
-  size_t i = 0;
+  while (thread_atomic_int_load(&_linux_state.cover_threads_exit) == 0) {
+    thread_mutex_lock(&_linux_state.cover_jobs_lock);
+    _linux_cover_job_t* job = _linux_state.cover_jobs_head;
+    if (job != NULL) {
+      _linux_state.cover_jobs_head = job->next;
+      if (_linux_state.cover_jobs_head == NULL) _linux_state.cover_jobs_tail = NULL;
+    }
+    bool more = _linux_state.cover_jobs_head != NULL;
+    thread_mutex_unlock(&_linux_state.cover_jobs_lock);
 
-  while (idx < len && string[idx] != '=' && is_base64(string[idx])) {
-    ++idx;
-    ++i;
-    if (i == 4) {
-      i = 0;
-      size += 3;
+    if (job == NULL) {
+      thread_signal_wait(&_linux_state.cover_jobs_signal, THREAD_SIGNAL_WAIT_INFINITE);
+      continue;
+    }
+
+    // The signal only wakes a single thread, pass it on
+    if (more) thread_signal_raise(&_linux_state.cover_jobs_signal);
+
+    _linux_png_buffer_t png = {0};
+    if (_linux_encode_cover(job->key.art_url, &png)) {
+      _linux_cover_apply(job, png.data, png.size);
+
+      thread_mutex_lock(&_linux_state.cover_cache_lock);
+      _linux_cover_cache_insert(&job->key, png.data, png.size);
+      thread_mutex_unlock(&_linux_state.cover_cache_lock);
+    } else {
+      _linux_cover_apply(job, NULL, 0);
+    }
+
+    _linux_cover_job_free(job);
+  }
+
+  // Wake the next thread so it sees the exit flag too
+  thread_signal_raise(&_linux_state.cover_jobs_signal);
+  return 0;
+}
+
+static void _linux_cover_enqueue(_linux_cover_job_t* job)
+{
+  thread_mutex_lock(&_linux_state.cover_jobs_lock);
+
+  // Drop queued jobs for the same player, they would be discarded anyway
+  _linux_cover_job_t** it = &_linux_state.cover_jobs_head;
+  _linux_state.cover_jobs_tail = NULL;
+  while (*it != NULL) {
+    if (g_strcmp0((*it)->player_name, job->player_name) == 0) {
+      _linux_cover_job_t* stale = *it;
+      *it = stale->next;
+      _linux_cover_job_free(stale);
+    } else {
+      _linux_state.cover_jobs_tail = *it;
+      it = &(*it)->next;
     }
   }
 
-  if (i > 0) {
-    size += i - 1;
+  if (_linux_state.cover_jobs_tail != NULL) {
+    _linux_state.cover_jobs_tail->next = job;
+  } else {
+    _linux_state.cover_jobs_head = job;
   }
+  _linux_state.cover_jobs_tail = job;
 
-  return size;
+  thread_mutex_unlock(&_linux_state.cover_jobs_lock);
+  thread_signal_raise(&_linux_state.cover_jobs_signal);
+}
+
+static void _linux_cover_threads_start()
+{
+  wnp_args_t args = {0};
+  __wnp_get_args(&args);
+
+  int count = args.cover_threads;
+  if (count <= 0) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    count = cpus < 1 ? 1 : cpus > 4 ? 4 : (int)cpus;
+  }
+  if (count > WNP_LINUX_MAX_COVER_THREADS) count = WNP_LINUX_MAX_COVER_THREADS;
+
+  thread_mutex_init(&_linux_state.cover_cache_lock);
+  thread_mutex_init(&_linux_state.cover_jobs_lock);
+  thread_signal_init(&_linux_state.cover_jobs_signal);
+  thread_atomic_int_store(&_linux_state.cover_threads_exit, 0);
+  _linux_state.cover_jobs_head = NULL;
+  _linux_state.cover_jobs_tail = NULL;
+
+  _linux_state.cover_thread_count = 0;
+  for (int i = 0; i < count; i++) {
+    thread_ptr_t thread = thread_create(_linux_cover_thread_func, NULL, THREAD_STACK_SIZE_DEFAULT);
+    if (thread == NULL) break;
+    _linux_state.cover_threads[_linux_state.cover_thread_count++] = thread;
+  }
+}
+
+static void _linux_cover_threads_stop()
+{
+  thread_atomic_int_store(&_linux_state.cover_threads_exit, 1);
+  thread_signal_raise(&_linux_state.cover_jobs_signal);
+  // `thread_destroy` joins the thread
+  for (int i = 0; i < _linux_state.cover_thread_count; i++) {
+    thread_destroy(_linux_state.cover_threads[i]);
+  }
+  _linux_state.cover_thread_count = 0;
+
+  while (_linux_state.cover_jobs_head != NULL) {
+    _linux_cover_job_t* job = _linux_state.cover_jobs_head;
+    _linux_state.cover_jobs_head = job->next;
+    _linux_cover_job_free(job);
+  }
+  _linux_state.cover_jobs_tail = NULL;
+
+  _linux_cover_cache_clear();
+  thread_signal_term(&_linux_state.cover_jobs_signal);
+  thread_mutex_term(&_linux_state.cover_jobs_lock);
+  thread_mutex_term(&_linux_state.cover_cache_lock);
+}
+
+/**
+ * Updates the players cover from an MPRIS artUrl.
+ * Cached covers are written right away, everything else is decoded on the cover threads
+ * and applied in a later update cycle, unless a newer cover was requested in the meantime.
+ */
+static void _linux_update_cover(wnp_player_t* player, const gchar* art_url)
+{
+  char cover_path[WNP_STR_LEN] = {0};
+  if (art_url == NULL || !__wnp_get_cover_path(player->id, cover_path)) {
+    _linux_assign_str(player->cover, "");
+    _linux_assign_str(player->cover_src, "");
+    return;
+  }
+
+  bool is_file = g_str_has_prefix(art_url, "file://");
+  if (!is_file && !g_str_has_prefix(art_url, "data:image")) {
+    return;
+  }
+
+  _linux_platform_data_t* platform_data = _linux_get_platform_data(player);
+  if (platform_data == NULL) return;
+
+  // Players re-emit Metadata with the same artUrl on every change, nothing to do if that cover is written or being decoded.
+  // That is checked before hashing, data URIs can be megabytes long. Covers that failed are not recorded, so they are tried again.
+  _linux_cover_key_t key;
+  _linux_cover_key_init(&key, art_url, is_file);
+  if (_linux_cover_key_equal(&platform_data->cover_key, &key) || _linux_cover_key_equal(&platform_data->pending_key, &key)) {
+    return;
+  }
+  _linux_cover_key_hash(&key);
+
+  platform_data->cover_generation = ++_linux_state.cover_generation;
+  _linux_cover_key_clear(&platform_data->pending_key);
+
+  // For data URIs only the type is exposed, e.g. "data:image/png;base64"
+  char cover_src[WNP_STR_LEN] = {0};
+  _linux_assign_str(cover_src, art_url);
+  if (!is_file) {
+    char* separator = strchr(cover_src, ',');
+    if (separator != NULL) *separator = '\0';
+  }
+
+  bool written = false;
+  bool cached = false;
+  thread_mutex_lock(&_linux_state.cover_cache_lock);
+  _linux_cover_cache_entry_t* entry = _linux_cover_cache_find(&key);
+  if (entry != NULL) {
+    cached = true;
+    written = __wnp_write_cover(player->id, entry->png, entry->png_size);
+  }
+  thread_mutex_unlock(&_linux_state.cover_cache_lock);
+
+  if (written) {
+    _linux_cover_key_copy(&platform_data->cover_key, &key);
+    _linux_assign_str(player->cover, cover_path);
+    _linux_assign_str(player->cover_src, cover_src);
+    return;
+  } else if (cached) {
+    return;
+  }
+
+  _linux_cover_job_t* job = calloc(1, sizeof(_linux_cover_job_t));
+  if (job == NULL) return;
+
+  if (!_linux_cover_key_copy(&job->key, &key)) {
+    free(job);
+    return;
+  }
+  _linux_cover_key_copy(&platform_data->pending_key, &key);
+
+  job->player_name = g_strdup(platform_data->player_name);
+  job->generation = platform_data->cover_generation;
+  _linux_assign_str(job->cover_src, cover_src);
+  _linux_cover_enqueue(job);
 }
 
 static void _linux_parse_metadata(wnp_player_t* player, GVariant* metadata)
@@ -194,49 +640,7 @@ static void _linux_parse_metadata(wnp_player_t* player, GVariant* metadata)
     if (g_strcmp0(key, "mpris:length") == 0) {
       player->duration = g_variant_get_int64(value) / 1000000;
     } else if (g_strcmp0(key, "mpris:artUrl") == 0) {
-      char cover_path[WNP_STR_LEN] = {0};
-      if (__wnp_get_cover_path(player->id, cover_path)) {
-        const gchar* art_url = g_variant_get_string(value, NULL);
-
-        if (g_str_has_prefix(art_url, "file://")) {
-          int width, height, channels;
-          unsigned char* image_data = stbi_load(art_url + 7, &width, &height, &channels, 0);
-          if (image_data == NULL) {
-            break;
-          }
-
-          stbi_write_png(cover_path + 7, width, height, channels, image_data, width * channels);
-          stbi_image_free(image_data);
-
-          _linux_assign_str(player->cover, cover_path);
-          _linux_assign_str(player->cover_src, art_url);
-        } else if (g_str_has_prefix(art_url, "data:image")) {
-          const char* cover_src = strtok((char*)art_url, ",");
-          const char* uri = strtok(NULL, ",");
-
-          size_t size = base64_decode_bytes(uri);
-          void* data = malloc(size);
-          if (data == NULL) break;
-          decode_base64(uri, data);
-
-          int width, height, channels;
-          unsigned char* image_data = stbi_load_from_memory(data, size, &width, &height, &channels, 0);
-          if (image_data == NULL) {
-            free(data);
-            break;
-          }
-
-          stbi_write_png(cover_path + 7, width, height, channels, image_data, width * channels);
-          stbi_image_free(image_data);
-
-          free(data);
-          _linux_assign_str(player->cover, cover_path);
-          _linux_assign_str(player->cover_src, cover_src);
-        }
-      } else {
-        _linux_assign_str(player->cover, "");
-        _linux_assign_str(player->cover_src, "");
-      }
+      _linux_update_cover(player, g_variant_get_string(value, NULL));
     } else if (g_strcmp0(key, "xesam:album") == 0) {
       _linux_assign_str(player->album, g_variant_get_string(value, NULL));
     } else if (g_strcmp0(key, "xesam:artist") == 0) {
@@ -604,6 +1008,7 @@ wnp_init_ret_t __wnp_platform_linux_init()
     return WNP_INIT_LINUX_DBUS_ERROR;
   }
 
+  _linux_cover_threads_start();
   _linux_init_active_players(_linux_state.connection);
 
   // clang-format off
@@ -635,6 +1040,7 @@ void __wnp_platform_linux_uninit()
   g_object_unref(_linux_state.connection);
   thread_join(_linux_state.loop_thread);
   thread_destroy(_linux_state.loop_thread);
+  _linux_cover_threads_stop();
 }
 
 void __wnp_platform_linux_free(void* _platform_data)
@@ -643,6 +1049,8 @@ void __wnp_platform_linux_free(void* _platform_data)
 
   if (platform_data != NULL) {
     g_dbus_connection_signal_unsubscribe(_linux_state.connection, platform_data->signal_subscription_id);
+    _linux_cover_key_clear(&platform_data->cover_key);
+    _linux_cover_key_clear(&platform_data->pending_key);
     free(platform_data->player_name);
     free(platform_data);
   }
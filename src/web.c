@@ -4,6 +4,13 @@
 #include "internal.h"
 #include "thread.h"
 #include "wnp.h"
+#include <limits.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
 
 /**
  * ================================
@@ -16,11 +23,31 @@ typedef enum {
   WNP_PLAYER_UPDATED = 1,
   WNP_PLAYER_REMOVED = 2,
   WNP_EVENT_RESULT = 3,
+  // Text only, switches the client to another revision: "4 <revision>"
+  WNP_SET_REVISION = 4,
+  // Binary only (revision 4), a cover: the port id followed by the image
+  WNP_PLAYER_COVER = 5,
+  // Text only, an update with just the fields that changed: "6 <port_id> <field mask> <values of the masked fields>"
+  WNP_PLAYER_DELTA = 6,
 } _web_message_type_t;
 
+/**
+ * Revision 3 sends everything as text, binary messages are covers.
+ * Revision 4 prefixes binary messages with their type and sends player messages as binary too:
+ * the port id as uint32 (little endian) followed by fields as [tag uint8][length uint16 LE][value].
+ * The tag is the index of the field in `_web_player_fields`, integers are little endian and 1 to 8 bytes long,
+ * strings are UTF-8 without a terminator. Fields that are not sent keep their value.
+ */
+#define WNP_TEXT_REVISION 3
+#define WNP_BINARY_REVISION 4
+
+#define WNP_PLAYER_FIELDS 26
+#define WNP_ALL_PLAYER_FIELDS ((1u << WNP_PLAYER_FIELDS) - 1)
+#define WNP_MAX_PLAYER_MESSAGE_SIZE 65536
+
 typedef struct {
   void* dest;
-  int type; // 0 = char[WNP_STR_LEN], 1 = int, 2 = uint64_t
+  int type; // 0 = char[WNP_STR_LEN], 1 = int, 2 = uint64_t, 3 = bool
 } _web_field_action_t;
 
 typedef struct {
@@ -28,17 +55,89 @@ typedef struct {
   int port_id;
 } _web_platform_data_t;
 
+/* A piece of a received message, not terminated */
+typedef struct {
+  const char* data;
+  size_t size;
+} _web_span_t;
+
+/**
+ * The fields of a player message, either the pipe separated `text` of the given fields
+ * or the tagged binary fields of revision 4 in `data`.
+ */
+typedef struct {
+  _web_span_t text;
+  uint32_t text_fields;
+  const unsigned char* data;
+  size_t data_size;
+} _web_player_fields_t;
+
 typedef struct {
   void* data;
   uint64_t data_size;
   cws_client_t* client;
   int port_id;
+  uint64_t created_at;
 } _web_cover_buffer_t;
 
+/**
+ * Covers can arrive before the player they belong to.
+ * They are held until the player is added, within these limits.
+ */
 #define WNP_MAX_COVER_BUFFERS WNP_MAX_PLAYERS
+#define WNP_COVER_BUFFERS_MAX_BYTES (8 * 1024 * 1024)
+#define WNP_COVER_BUFFERS_MAX_PER_CLIENT 8
+#define WNP_COVER_BUFFERS_MAX_CLIENT_BYTES (2 * 1024 * 1024)
+#define WNP_COVER_BUFFER_TTL_MS 10000
+
+/**
+ * A cover that is still being received.
+ * It goes straight into the players cover file if the player exists, and is held in memory until it is added otherwise.
+ */
+typedef struct {
+  cws_client_t* client;
+  unsigned char id[sizeof(uint32_t)];
+  size_t id_size;
+  int port_id;
+  // Set while the cover is written to the file of `player_id`
+  FILE* file;
+  int player_id;
+  char tmp_path[WNP_STR_LEN];
+  // Used otherwise
+  unsigned char* data;
+  uint64_t data_size;
+  uint64_t data_capacity;
+  bool failed;
+} _web_cover_stream_t;
+
+/* Attached to every open client */
+typedef struct {
+  int revision;
+  // Type of the binary message being received, -1 until its first byte arrived
+  int binary_type;
+  // Binary player messages are collected here
+  unsigned char* message;
+  size_t message_size;
+  size_t message_capacity;
+  bool message_failed;
+  // The cover being received, if any
+  _web_cover_stream_t* cover_stream;
+} _web_client_t;
+
+typedef struct {
+  uint64_t stored;
+  uint64_t claimed;
+  uint64_t replaced;
+  uint64_t expired;
+  uint64_t evicted;
+  uint64_t rejected;
+  uint64_t bytes;
+} _web_cover_buffer_stats_t;
+
 typedef struct {
   wnp_args_t args;
   _web_cover_buffer_t* cover_buffers[WNP_MAX_COVER_BUFFERS];
+  _web_cover_buffer_stats_t cover_buffer_stats;
   thread_mutex_t cover_buffers_lock;
 } _web_state_t;
 
@@ -50,6 +149,17 @@ static _web_state_t _web_state = {0};
  * ==============================
  */
 
+static uint64_t _web_timestamp()
+{
+#ifdef _WIN32
+  return GetTickCount64();
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+#endif
+}
+
 static _web_platform_data_t* _web_get_platform_data(wnp_player_t* player)
 {
   if (player == NULL || player->platform != WNP_PLATFORM_WEB) {
@@ -66,9 +176,10 @@ static void _web_assign_str(char dest[WNP_STR_LEN], const char* str)
   dest[len < WNP_STR_LEN ? len : WNP_STR_LEN - 1] = '\0';
 }
 
-static void _web_parse_player_text(wnp_player_t* player, char* data)
+/* The fields of a player in protocol order, the text protocol sends them in this order and revision 4 tags them with their index */
+static void _web_player_fields(wnp_player_t* player, _web_field_action_t actions_out[WNP_PLAYER_FIELDS])
 {
-  const _web_field_action_t actions[] = {
+  const _web_field_action_t actions[WNP_PLAYER_FIELDS] = {
       {&(((_web_platform_data_t*)player->_platform_data)->port_id), 1},
       {&(player->name), 0},
       {&(player->title), 0},
@@ -81,66 +192,658 @@ static void _web_parse_player_text(wnp_player_t* player, char* data)
       {&(player->volume), 1},
       {&(player->rating), 1},
       {&(player->repeat), 1},
-      {&(player->shuffle), 1},
+      {&(player->shuffle), 3},
       {&(player->rating_system), 1},
       {&(player->available_repeat), 1},
-      {&(player->can_set_state), 1},
-      {&(player->can_skip_previous), 1},
-      {&(player->can_skip_next), 1},
-      {&(player->can_set_position), 1},
-      {&(player->can_set_volume), 1},
-      {&(player->can_set_rating), 1},
-      {&(player->can_set_repeat), 1},
-      {&(player->can_set_shuffle), 1},
+      {&(player->can_set_state), 3},
+      {&(player->can_skip_previous), 3},
+      {&(player->can_skip_next), 3},
+      {&(player->can_set_position), 3},
+      {&(player->can_set_volume), 3},
+      {&(player->can_set_rating), 3},
+      {&(player->can_set_repeat), 3},
+      {&(player->can_set_shuffle), 3},
       {&(player->created_at), 2},
       {&(player->updated_at), 2},
       {&(player->active_at), 2},
   };
 
-  int field_len = sizeof(actions) / sizeof(actions[0]);
-  int field_counter = 0;
-  char* p = data;
-  char* token_start = p;
-
-  while (field_counter < field_len) {
-    if (*p == '\\' && *(p + 1) == '|') {
-      p++;
-    } else if (*p == '\0' || *p == '|') {
-      if (*p == '\0') break; // End of data
-
-      *p = '\0'; // Terminate the token
-      char* token = token_start;
-
-      char* src = token_start;
-      char* dest = token_start;
-      while (*src != '\0') {
-        if (*src == '\\' && *(src + 1) == '|') {
-          src++; // Skip the escape character
-        }
-        *dest++ = *src++;
+  memcpy(actions_out, actions, sizeof(actions));
+}
+
+/* Stores a value in a numeric field, returns whether that changed it. */
+static bool _web_set_number(const _web_field_action_t* action, uint64_t value)
+{
+  switch (action->type) {
+    case 1:
+      if (*(int*)action->dest == (int)value) return false;
+      *(int*)action->dest = (int)value;
+      return true;
+    case 2:
+      if (*(uint64_t*)action->dest == value) return false;
+      *(uint64_t*)action->dest = value;
+      return true;
+    case 3:
+      if (*(bool*)action->dest == (value != 0)) return false;
+      *(bool*)action->dest = value != 0;
+      return true;
+  }
+  return false;
+}
+
+/* Stores `len` bytes of `str` in a string field, truncated to fit. Returns whether that changed it. */
+static bool _web_set_str(char dest[WNP_STR_LEN], const char* str, size_t len)
+{
+  if (len > WNP_STR_LEN - 1) len = WNP_STR_LEN - 1;
+  if (memcmp(dest, str, len) == 0 && dest[len] == '\0') return false;
+  memcpy(dest, str, len);
+  dest[len] = '\0';
+  return true;
+}
+
+/* Splits `rest` at the first `sep`, returns the part before it and leaves the part after it in `rest`. */
+static _web_span_t _web_span_next(_web_span_t* rest, char sep)
+{
+  _web_span_t token = *rest;
+  const char* end = memchr(rest->data, sep, rest->size);
+  if (end == NULL) {
+    rest->data += rest->size;
+    rest->size = 0;
+    return token;
+  }
+
+  token.size = end - token.data;
+  rest->data = end + 1;
+  rest->size -= token.size + 1;
+  return token;
+}
+
+/* Like `_web_span_next` with '|', but skips escaped separators. The token is left escaped. */
+static _web_span_t _web_span_next_field(_web_span_t* rest)
+{
+  _web_span_t token = *rest;
+  for (size_t i = 0; i < rest->size; i++) {
+    // A '\' right before a '|' always escapes it, even if it follows another '\'
+    if (rest->data[i] == '|' && (i == 0 || rest->data[i - 1] != '\\')) {
+      token.size = i;
+      rest->data += i + 1;
+      rest->size -= i + 1;
+      return token;
+    }
+  }
+
+  rest->data += rest->size;
+  rest->size = 0;
+  return token;
+}
+
+/**
+ * Parses a decimal number at the start of `span` like `atoi` does, anything after the digits is ignored.
+ * Values that do not fit are clamped. Returns false if there are no digits.
+ */
+static bool _web_span_int(_web_span_t span, int64_t* out)
+{
+  size_t i = 0;
+  while (i < span.size && (span.data[i] == ' ' || (span.data[i] >= '\t' && span.data[i] <= '\r'))) i++;
+
+  bool negative = i < span.size && span.data[i] == '-';
+  if (negative || (i < span.size && span.data[i] == '+')) i++;
+
+  size_t start = i;
+  uint64_t value = 0;
+  for (; i < span.size && span.data[i] >= '0' && span.data[i] <= '9'; i++) {
+    value = value > (uint64_t)INT64_MAX / 10 ? (uint64_t)INT64_MAX + 1 : value * 10 + (span.data[i] - '0');
+  }
+  if (i == start) return false;
+
+  if (negative) {
+    *out = value > (uint64_t)INT64_MAX ? INT64_MIN : -(int64_t)value;
+  } else {
+    *out = value > (uint64_t)INT64_MAX ? INT64_MAX : (int64_t)value;
+  }
+  return true;
+}
+
+/* Unescapes a text field straight into `dest`, truncated to fit. Returns whether that changed it. */
+static bool _web_set_str_escaped(char dest[WNP_STR_LEN], _web_span_t token)
+{
+  if (memchr(token.data, '\\', token.size) == NULL) {
+    return _web_set_str(dest, token.data, token.size);
+  }
+
+  bool changed = false;
+  size_t n = 0;
+  for (size_t i = 0; i < token.size && n < WNP_STR_LEN - 1; i++, n++) {
+    char c = token.data[i];
+    if (c == '\\' && i + 1 < token.size && token.data[i + 1] == '|') {
+      c = token.data[++i];
+    }
+    if (dest[n] != c) {
+      dest[n] = c;
+      changed = true;
+    }
+  }
+
+  if (dest[n] != '\0') {
+    dest[n] = '\0';
+    changed = true;
+  }
+  return changed;
+}
+
+/**
+ * Parses pipe separated player text into the fields set in `fields`, in field order.
+ * Full messages carry all fields, `WNP_PLAYER_DELTA` only the ones in its mask. Empty values and numbers without digits are skipped.
+ * Values are copied straight from the message into the player, the message is left as it is. Returns a mask of the fields that changed.
+ */
+static uint32_t _web_parse_player_text(wnp_player_t* player, _web_span_t text, uint32_t fields)
+{
+  _web_field_action_t actions[WNP_PLAYER_FIELDS];
+  _web_player_fields(player, actions);
+
+  uint32_t changed = 0;
+  bool more = true;
+  for (int field = 0; field < WNP_PLAYER_FIELDS && more; field++) {
+    if (!(fields & (1u << field))) continue;
+
+    more = text.size > 0;
+    _web_span_t token = _web_span_next_field(&text);
+    if (token.size == 0) continue;
+
+    const _web_field_action_t* action = &actions[field];
+    bool field_changed = false;
+    int64_t value;
+    if (action->type == 0) {
+      if (*token.data == '\1') token.size = 0;
+      field_changed = _web_set_str_escaped(action->dest, token);
+    } else if (_web_span_int(token, &value)) {
+      if (action->type == 1) {
+        // Clamped to int like the other integer fields of the protocol
+        value = value < INT_MIN ? INT_MIN : value > INT_MAX ? INT_MAX : value;
       }
-      *dest = '\0'; // Terminate the processed token
-
-      if (*token != '\0') {
-        const _web_field_action_t* action = &actions[field_counter];
-        switch (action->type) {
-          case 0:
-            _web_assign_str(action->dest, (*token == '\1') ? "" : token);
-            break;
-          case 1:
-            *(int*)action->dest = atoi(token);
-            break;
-          case 2:
-            *(uint64_t*)action->dest = strtoll(token, NULL, 10);
-            break;
+      field_changed = _web_set_number(action, (uint64_t)value);
+    }
+
+    if (field_changed) changed |= 1u << field;
+  }
+
+  return changed;
+}
+
+static uint64_t _web_read_le(const unsigned char* data, size_t size)
+{
+  uint64_t value = 0;
+  for (size_t i = size; i > 0; i--) {
+    value = (value << 8) | data[i - 1];
+  }
+  return value;
+}
+
+/**
+ * Parses the fields of a revision 4 player message, a mask of the fields that changed goes to `changed_out`.
+ * Nothing is applied if the message is malformed.
+ */
+static bool _web_parse_player_binary(wnp_player_t* player, const unsigned char* data, size_t size, uint32_t* changed_out)
+{
+  _web_field_action_t actions[WNP_PLAYER_FIELDS];
+  _web_player_fields(player, actions);
+
+  *changed_out = 0;
+
+  // The first pass only validates
+  for (int apply = 0; apply < 2; apply++) {
+    size_t pos = 0;
+    while (pos < size) {
+      if (size - pos < 3) return false;
+
+      uint8_t tag = data[pos];
+      size_t len = data[pos + 1] | (data[pos + 2] << 8);
+      const unsigned char* value = data + pos + 3;
+      pos += 3;
+      if (size - pos < len) return false;
+      pos += len;
+
+      // Unknown fields are from newer clients
+      if (tag >= WNP_PLAYER_FIELDS) continue;
+
+      const _web_field_action_t* action = &actions[tag];
+      if (action->type != 0 && (len == 0 || len > sizeof(uint64_t))) return false;
+      if (!apply) continue;
+
+      bool field_changed;
+      if (action->type == 0) {
+        field_changed = _web_set_str(action->dest, (const char*)value, len);
+      } else {
+        field_changed = _web_set_number(action, _web_read_le(value, len));
+      }
+
+      if (field_changed) *changed_out |= 1u << tag;
+    }
+  }
+
+  return true;
+}
+
+/**
+ * Cover buffer helpers, all of these expect `cover_buffers_lock` to be held.
+ */
+
+static void _web_cover_buffer_free(size_t index)
+{
+  _web_cover_buffer_t* buf = _web_state.cover_buffers[index];
+  _web_state.cover_buffer_stats.bytes -= buf->data_size;
+  free(buf->data);
+  free(buf);
+  _web_state.cover_buffers[index] = NULL;
+}
+
+static void _web_cover_buffer_expire(uint64_t now)
+{
+  for (size_t i = 0; i < WNP_MAX_COVER_BUFFERS; i++) {
+    _web_cover_buffer_t* buf = _web_state.cover_buffers[i];
+    if (buf != NULL && now - buf->created_at > WNP_COVER_BUFFER_TTL_MS) {
+      _web_cover_buffer_free(i);
+      _web_state.cover_buffer_stats.expired++;
+    }
+  }
+}
+
+/* Evicts the oldest buffer of `client`, or of the client holding the most bytes if `client` is NULL. */
+static void _web_cover_buffer_evict(cws_client_t* client)
+{
+  if (client == NULL) {
+    uint64_t max_bytes = 0;
+    for (size_t i = 0; i < WNP_MAX_COVER_BUFFERS; i++) {
+      _web_cover_buffer_t* buf = _web_state.cover_buffers[i];
+      if (buf == NULL) continue;
+
+      uint64_t client_bytes = 0;
+      for (size_t j = 0; j < WNP_MAX_COVER_BUFFERS; j++) {
+        if (_web_state.cover_buffers[j] != NULL && _web_state.cover_buffers[j]->client == buf->client) {
+          client_bytes += _web_state.cover_buffers[j]->data_size;
         }
       }
 
-      token_start = p + 1;
-      field_counter++;
+      if (client == NULL || client_bytes > max_bytes) {
+        client = buf->client;
+        max_bytes = client_bytes;
+      }
+    }
+  }
+
+  int oldest = -1;
+  for (size_t i = 0; i < WNP_MAX_COVER_BUFFERS; i++) {
+    _web_cover_buffer_t* buf = _web_state.cover_buffers[i];
+    if (buf != NULL && buf->client == client && (oldest == -1 || buf->created_at < _web_state.cover_buffers[oldest]->created_at)) {
+      oldest = i;
+    }
+  }
+
+  if (oldest != -1) {
+    _web_cover_buffer_free(oldest);
+    _web_state.cover_buffer_stats.evicted++;
+  }
+}
+
+/* Takes ownership of `data`, which has to be allocated with malloc. */
+static void _web_cover_buffer_store(cws_client_t* client, int port_id, void* data, uint64_t data_size)
+{
+  if (data_size > WNP_COVER_BUFFERS_MAX_CLIENT_BYTES) {
+    _web_state.cover_buffer_stats.rejected++;
+    free(data);
+    return;
+  }
+
+  uint64_t now = _web_timestamp();
+  _web_cover_buffer_expire(now);
+
+  // A newer cover for the same player replaces the pending one
+  for (size_t i = 0; i < WNP_MAX_COVER_BUFFERS; i++) {
+    _web_cover_buffer_t* buf = _web_state.cover_buffers[i];
+    if (buf != NULL && buf->client == client && buf->port_id == port_id) {
+      _web_cover_buffer_free(i);
+      _web_state.cover_buffer_stats.replaced++;
+    }
+  }
+
+  for (;;) {
+    size_t client_count = 0;
+    uint64_t client_bytes = 0;
+    for (size_t i = 0; i < WNP_MAX_COVER_BUFFERS; i++) {
+      _web_cover_buffer_t* buf = _web_state.cover_buffers[i];
+      if (buf != NULL && buf->client == client) {
+        client_count++;
+        client_bytes += buf->data_size;
+      }
+    }
+
+    if (client_count < WNP_COVER_BUFFERS_MAX_PER_CLIENT && client_bytes + data_size <= WNP_COVER_BUFFERS_MAX_CLIENT_BYTES) break;
+    _web_cover_buffer_evict(client);
+  }
+
+  int slot = -1;
+  for (;;) {
+    for (size_t i = 0; i < WNP_MAX_COVER_BUFFERS && slot == -1; i++) {
+      if (_web_state.cover_buffers[i] == NULL) slot = i;
+    }
+
+    if (slot != -1 && _web_state.cover_buffer_stats.bytes + data_size <= WNP_COVER_BUFFERS_MAX_BYTES) break;
+    _web_cover_buffer_evict(NULL);
+  }
+
+  _web_cover_buffer_t* cover_buffer = calloc(1, sizeof(_web_cover_buffer_t));
+  if (cover_buffer == NULL) {
+    free(data);
+    return;
+  }
+
+  cover_buffer->client = client;
+  cover_buffer->data = data;
+  cover_buffer->data_size = data_size;
+  cover_buffer->port_id = port_id;
+  cover_buffer->created_at = now;
+  _web_state.cover_buffers[slot] = cover_buffer;
+  _web_state.cover_buffer_stats.bytes += data_size;
+  _web_state.cover_buffer_stats.stored++;
+}
+
+/* Removes and returns the pending cover for a player, the caller owns the result. */
+static _web_cover_buffer_t* _web_cover_buffer_claim(cws_client_t* client, int port_id)
+{
+  _web_cover_buffer_expire(_web_timestamp());
+
+  for (size_t i = 0; i < WNP_MAX_COVER_BUFFERS; i++) {
+    _web_cover_buffer_t* buf = _web_state.cover_buffers[i];
+    if (buf != NULL && buf->client == client && buf->port_id == port_id) {
+      _web_state.cover_buffers[i] = NULL;
+      _web_state.cover_buffer_stats.bytes -= buf->data_size;
+      _web_state.cover_buffer_stats.claimed++;
+      return buf;
+    }
+  }
+
+  return NULL;
+}
+
+/* Finds the player `port_id` of `client` in `players`. */
+static wnp_player_t* _web_find_player(wnp_player_t* players, int count, cws_client_t* client, int port_id)
+{
+  for (int i = 0; i < count; i++) {
+    _web_platform_data_t* platform_data = _web_get_platform_data(&players[i]);
+    if (platform_data != NULL && platform_data->port_id == port_id && platform_data->client == client) {
+      return &players[i];
+    }
+  }
+
+  return NULL;
+}
+
+/**
+ * Cover stream helpers. Each client has at most one stream, which only its own callbacks use.
+ */
+
+static _web_cover_stream_t* _web_cover_stream_get(cws_client_t* client, bool create)
+{
+  _web_client_t* web_client = cws_get_data(client);
+  if (web_client == NULL) return NULL;
+
+  if (web_client->cover_stream == NULL && create) {
+    _web_cover_stream_t* stream = calloc(1, sizeof(_web_cover_stream_t));
+    if (stream != NULL) {
+      stream->client = client;
+      stream->player_id = -1;
+      web_client->cover_stream = stream;
+    }
+  }
+
+  return web_client->cover_stream;
+}
+
+/* Removes and frees a stream, discarding whatever was not handed on yet. */
+static void _web_cover_stream_free(_web_cover_stream_t* stream)
+{
+  _web_client_t* web_client = cws_get_data(stream->client);
+  if (web_client != NULL && web_client->cover_stream == stream) {
+    web_client->cover_stream = NULL;
+  }
+
+  if (stream->file != NULL) {
+    __wnp_close_cover(stream->player_id, stream->file, stream->tmp_path, false);
+  }
+  free(stream->data);
+  free(stream);
+}
+
+/* Called once the port id is known, covers of existing players are written to disk as they arrive. */
+static void _web_cover_stream_open(_web_cover_stream_t* stream)
+{
+  uint32_t port_id;
+  memcpy(&port_id, stream->id, sizeof(port_id));
+  stream->port_id = (int)port_id;
+
+  wnp_player_t players[WNP_MAX_PLAYERS] = {0};
+  int count = __wnp_start_update_cycle(players);
+  wnp_player_t* player = _web_find_player(players, count, stream->client, stream->port_id);
+  int player_id = player != NULL ? player->id : -1;
+  __wnp_end_update_cycle();
+
+  if (player_id != -1) {
+    stream->file = __wnp_open_cover(player_id, stream->tmp_path);
+    if (stream->file != NULL) {
+      stream->player_id = player_id;
+    }
+  }
+}
+
+static void _web_cover_stream_write(_web_cover_stream_t* stream, const unsigned char* chunk, uint64_t size)
+{
+  if (stream->file != NULL) {
+    if (fwrite(chunk, sizeof(unsigned char), size, stream->file) != size) {
+      stream->failed = true;
+    }
+    return;
+  }
+
+  // Anything larger would be rejected by the cover buffers anyway
+  if (stream->data_size + size > WNP_COVER_BUFFERS_MAX_CLIENT_BYTES) {
+    stream->failed = true;
+    return;
+  }
+
+  if (stream->data_size + size > stream->data_capacity) {
+    uint64_t capacity = stream->data_capacity < 65536 ? 65536 : stream->data_capacity;
+    while (capacity < stream->data_size + size) {
+      capacity *= 2;
+    }
+
+    unsigned char* data = realloc(stream->data, capacity);
+    if (data == NULL) {
+      stream->failed = true;
+      return;
+    }
+    stream->data = data;
+    stream->data_capacity = capacity;
+  }
+
+  memcpy(stream->data + stream->data_size, chunk, size);
+  stream->data_size += size;
+}
+
+/* Hands a completely received cover to its player, or to the cover buffers if the player was not added yet. */
+static void _web_cover_stream_finish(_web_cover_stream_t* stream)
+{
+  if (stream->id_size < sizeof(stream->id) || stream->failed) {
+    if (stream->file == NULL) {
+      thread_mutex_lock(&_web_state.cover_buffers_lock);
+      _web_state.cover_buffer_stats.rejected++;
+      thread_mutex_unlock(&_web_state.cover_buffers_lock);
     }
-    p++;
+    _web_cover_stream_free(stream);
+    return;
+  }
+
+  bool in_memory = stream->file == NULL;
+  bool written = false;
+
+  wnp_player_t players[WNP_MAX_PLAYERS] = {0};
+  int count = __wnp_start_update_cycle(players);
+  wnp_player_t* player = _web_find_player(players, count, stream->client, stream->port_id);
+  if (!in_memory) {
+    // The player could have been removed and its id reused while the cover was received
+    written = __wnp_close_cover(stream->player_id, stream->file, stream->tmp_path, player != NULL && player->id == stream->player_id);
+    stream->file = NULL;
+  } else if (player != NULL) {
+    written = __wnp_write_cover(player->id, stream->data, stream->data_size);
+  }
+
+  char cover_path[WNP_STR_LEN] = {0};
+  if (written && __wnp_get_cover_path(player->id, cover_path)) {
+    _web_assign_str(player->cover, cover_path);
+    __wnp_update_player(player);
   }
+  __wnp_end_update_cycle();
+
+  if (in_memory && player == NULL) {
+    thread_mutex_lock(&_web_state.cover_buffers_lock);
+    _web_cover_buffer_store(stream->client, stream->port_id, stream->data, stream->data_size);
+    thread_mutex_unlock(&_web_state.cover_buffers_lock);
+    stream->data = NULL;
+  }
+
+  _web_cover_stream_free(stream);
+}
+
+/**
+ * Player messages, shared by both revisions.
+ * Updates only reach `__wnp_update_player` if a field changed, so unchanged players do not trigger callbacks.
+ */
+
+static bool _web_parse_player(wnp_player_t* player, const _web_player_fields_t* msg, uint32_t* changed_out)
+{
+  if (msg->text.data != NULL) {
+    *changed_out = _web_parse_player_text(player, msg->text, msg->text_fields);
+    return true;
+  }
+
+  return _web_parse_player_binary(player, msg->data, msg->data_size, changed_out);
+}
+
+static void _web_add_player(cws_client_t* client, int port_id, const _web_player_fields_t* msg)
+{
+  _web_platform_data_t* platform_data = (_web_platform_data_t*)calloc(1, sizeof(_web_platform_data_t));
+  if (platform_data == NULL) return;
+
+  platform_data->client = client;
+  platform_data->port_id = port_id;
+
+  wnp_player_t player = WNP_DEFAULT_PLAYER;
+  player._platform_data = platform_data;
+  player.platform = WNP_PLATFORM_WEB;
+
+  uint32_t changed;
+  if (!_web_parse_player(&player, msg, &changed)) {
+    free(platform_data);
+    return;
+  }
+
+  __wnp_start_update_cycle(NULL);
+  player.id = __wnp_add_player(&player);
+  if (player.id == -1) {
+    free(platform_data);
+    __wnp_end_update_cycle();
+    return;
+  }
+
+  thread_mutex_lock(&_web_state.cover_buffers_lock);
+  _web_cover_buffer_t* buf = _web_cover_buffer_claim(client, port_id);
+  thread_mutex_unlock(&_web_state.cover_buffers_lock);
+
+  if (buf != NULL) {
+    __wnp_write_cover(player.id, buf->data, buf->data_size);
+    char cover_path[WNP_STR_LEN] = {0};
+    if (__wnp_get_cover_path(player.id, cover_path)) {
+      _web_assign_str(player.cover, cover_path);
+    }
+    free(buf->data);
+    free(buf);
+  }
+
+  __wnp_update_player(&player);
+  __wnp_end_update_cycle();
+}
+
+static void _web_update_player(cws_client_t* client, int port_id, const _web_player_fields_t* msg)
+{
+  wnp_player_t players[WNP_MAX_PLAYERS] = {0};
+  int count = __wnp_start_update_cycle(players);
+  wnp_player_t* player = _web_find_player(players, count, client, port_id);
+  uint32_t changed;
+  if (player != NULL && _web_parse_player(player, msg, &changed) && changed != 0) {
+    __wnp_update_player(player);
+  }
+  __wnp_end_update_cycle();
+}
+
+static void _web_remove_player(cws_client_t* client, int port_id)
+{
+  wnp_player_t players[WNP_MAX_PLAYERS] = {0};
+  int count = __wnp_start_update_cycle(players);
+  for (int i = 0; i < count; i++) {
+    _web_platform_data_t* platform_data = _web_get_platform_data(&players[i]);
+    if (platform_data != NULL && platform_data->port_id == port_id && platform_data->client == client) {
+      __wnp_remove_player(players[i].id);
+    }
+  }
+  __wnp_end_update_cycle();
+}
+
+/* Handles a complete revision 4 player message, without its type byte. */
+static void _web_player_message(cws_client_t* client, int type, const unsigned char* data, size_t size)
+{
+  if (size < sizeof(uint32_t)) return;
+
+  int port_id = (int)_web_read_le(data, sizeof(uint32_t));
+  data += sizeof(uint32_t);
+  size -= sizeof(uint32_t);
+
+  const _web_player_fields_t msg = {.data = data, .data_size = size};
+  switch (type) {
+    case WNP_PLAYER_ADDED:
+      _web_add_player(client, port_id, &msg);
+      break;
+    case WNP_PLAYER_UPDATED:
+      _web_update_player(client, port_id, &msg);
+      break;
+    case WNP_PLAYER_REMOVED:
+      _web_remove_player(client, port_id);
+      break;
+  }
+}
+
+static void _web_player_message_write(_web_client_t* web_client, const unsigned char* chunk, size_t size)
+{
+  if (web_client->message_size + size > WNP_MAX_PLAYER_MESSAGE_SIZE) {
+    web_client->message_failed = true;
+    return;
+  }
+
+  if (web_client->message_size + size > web_client->message_capacity) {
+    size_t capacity = web_client->message_capacity < 1024 ? 1024 : web_client->message_capacity;
+    while (capacity < web_client->message_size + size) {
+      capacity *= 2;
+    }
+
+    unsigned char* message = realloc(web_client->message, capacity);
+    if (message == NULL) {
+      web_client->message_failed = true;
+      return;
+    }
+    web_client->message = message;
+    web_client->message_capacity = capacity;
+  }
+
+  memcpy(web_client->message + web_client->message_size, chunk, size);
+  web_client->message_size += size;
 }
 
 /**
@@ -151,16 +854,33 @@ static void _web_parse_player_text(wnp_player_t* player, char* data)
 
 void _web_ws_on_open(cws_client_t* client)
 {
+  // Clients start out on the text revision and may switch with `WNP_SET_REVISION`
+  _web_client_t* web_client = calloc(1, sizeof(_web_client_t));
+  if (web_client != NULL) {
+    web_client->revision = WNP_TEXT_REVISION;
+    web_client->binary_type = -1;
+    cws_set_data(client, web_client);
+  }
+
   char buffer[WNP_STR_LEN] = {0};
-  snprintf(buffer, WNP_STR_LEN - 1, "ADAPTER_VERSION %s;WNPLIB_REVISION 3", _web_state.args.adapter_version);
+  snprintf(buffer, WNP_STR_LEN - 1, "ADAPTER_VERSION %s;WNPLIB_REVISION %d;WNPLIB_MAX_REVISION %d", _web_state.args.adapter_version,
+           WNP_TEXT_REVISION, web_client != NULL ? WNP_BINARY_REVISION : WNP_TEXT_REVISION);
   cws_send(client, buffer, strlen(buffer), CWS_TYPE_TEXT);
 }
 
+void _web_ws_on_reject(int reason, int clients)
+{
+  if (_web_state.args.on_web_client_rejected != NULL) {
+    wnp_web_reject_reason_t web_reason = reason == CWS_REJECT_NO_MEMORY ? WNP_WEB_REJECT_NO_MEMORY : WNP_WEB_REJECT_FULL;
+    _web_state.args.on_web_client_rejected(web_reason, clients, _web_state.args.callback_data);
+  }
+}
+
 void _web_ws_on_close(cws_client_t* client)
 {
   wnp_player_t players[WNP_MAX_PLAYERS] = {0};
   int count = __wnp_start_update_cycle(players);
-  for (size_t i = 0; i < count; i++) {
+  for (int i = 0; i < count; i++) {
     _web_platform_data_t* platform_data = _web_get_platform_data(&players[i]);
     if (platform_data != NULL && platform_data->client == client) {
       __wnp_remove_player(players[i].id);
@@ -171,176 +891,141 @@ void _web_ws_on_close(cws_client_t* client)
   thread_mutex_lock(&_web_state.cover_buffers_lock);
   for (size_t i = 0; i < WNP_MAX_COVER_BUFFERS; i++) {
     if (_web_state.cover_buffers[i] != NULL && _web_state.cover_buffers[i]->client == client) {
-      free(_web_state.cover_buffers[i]->data);
-      free(_web_state.cover_buffers[i]);
-      _web_state.cover_buffers[i] = NULL;
+      _web_cover_buffer_free(i);
     }
   }
   thread_mutex_unlock(&_web_state.cover_buffers_lock);
+
+  _web_cover_stream_t* stream = _web_cover_stream_get(client, false);
+  if (stream != NULL) {
+    _web_cover_stream_free(stream);
+  }
+
+  _web_client_t* web_client = cws_get_data(client);
+  if (web_client != NULL) {
+    free(web_client->message);
+    free(web_client);
+    cws_set_data(client, NULL);
+  }
 }
 
-void _web_ws_on_message(cws_client_t* client, const unsigned char* _msg, uint64_t msg_size, int type)
+/* A piece of a cover: a 4 byte port id followed by the image. */
+static void _web_cover_chunk(cws_client_t* client, const unsigned char* chunk, uint64_t size, bool first, bool fin)
 {
-  if (type == CWS_TYPE_BINARY) {
-    size_t id_size = sizeof(uint32_t);
-    if (msg_size < id_size) {
-      return;
-    }
-    unsigned int received_id;
-    memcpy(&received_id, _msg, id_size);
+  _web_cover_stream_t* stream = _web_cover_stream_get(client, first);
+  if (stream == NULL) return;
 
-    uint64_t data_size = msg_size - id_size;
-    const unsigned char* data = _msg + id_size;
+  if (size > 0 && stream->id_size < sizeof(stream->id)) {
+    size_t n = sizeof(stream->id) - stream->id_size;
+    if (n > size) n = size;
+    memcpy(stream->id + stream->id_size, chunk, n);
+    stream->id_size += n;
+    chunk += n;
+    size -= n;
 
-    wnp_player_t* player = NULL;
-    wnp_player_t players[WNP_MAX_PLAYERS] = {0};
-    int count = __wnp_start_update_cycle(players);
-    for (size_t i = 0; i < count; i++) {
-      _web_platform_data_t* platform_data = _web_get_platform_data(&players[i]);
-      if (platform_data != NULL && platform_data->port_id == received_id && platform_data->client == client) {
-        player = &players[i];
-        break;
-      }
+    if (stream->id_size == sizeof(stream->id)) {
+      _web_cover_stream_open(stream);
     }
+  }
 
-    if (player == NULL) {
-      __wnp_end_update_cycle();
-      thread_mutex_lock(&_web_state.cover_buffers_lock);
-      for (size_t i = 0; i < WNP_MAX_COVER_BUFFERS; i++) {
-        if (_web_state.cover_buffers[i] == NULL) {
-          _web_cover_buffer_t* cover_buffer = calloc(1, sizeof(_web_cover_buffer_t));
-          if (cover_buffer == NULL) {
-            break;
-          }
-
-          cover_buffer->client = client;
-          cover_buffer->data_size = data_size;
-          cover_buffer->port_id = received_id;
-          // need to copy data since it gets freed after onmessage
-          cover_buffer->data = calloc(1, data_size);
-          if (cover_buffer->data == NULL) {
-            free(cover_buffer);
-            break;
-          }
-
-          memcpy(cover_buffer->data, data, data_size);
-          _web_state.cover_buffers[i] = cover_buffer;
-          break;
-        }
-      }
-      thread_mutex_unlock(&_web_state.cover_buffers_lock);
-      return;
-    }
+  if (size > 0 && !stream->failed) {
+    _web_cover_stream_write(stream, chunk, size);
+  }
 
-    __wnp_write_cover(player->id, (void*)data, data_size);
-    char cover_path[WNP_STR_LEN] = {0};
-    if (__wnp_get_cover_path(player->id, cover_path)) {
-      _web_assign_str(player->cover, cover_path);
-      __wnp_update_player(player);
-      __wnp_end_update_cycle();
-    }
-    return;
+  if (fin) {
+    _web_cover_stream_finish(stream);
   }
+}
 
-  char* msg = (char*)_msg;
-  char* type_str = strtok(msg, " ");
-  if (type_str == NULL) return;
-  char* data_str = strtok(NULL, "");
-  if (data_str == NULL) return;
+/* Binary messages are covers in revision 3, revision 4 starts them with their type. */
+void _web_ws_on_stream(cws_client_t* client, const unsigned char* chunk, uint64_t size, uint64_t offset, bool fin)
+{
+  _web_client_t* web_client = cws_get_data(client);
+  if (web_client == NULL || web_client->revision < WNP_BINARY_REVISION) {
+    _web_cover_chunk(client, chunk, size, offset == 0, fin);
+    return;
+  }
 
-  switch (atoi(type_str)) {
-    case WNP_PLAYER_ADDED: {
-      char* id_str = strtok(data_str, " ");
-      if (id_str == NULL) return;
-      int id = atoi(id_str);
+  bool first = false;
+  if (web_client->binary_type == -1 && size > 0) {
+    web_client->binary_type = chunk[0];
+    web_client->message_size = 0;
+    web_client->message_failed = false;
+    first = true;
+    chunk++;
+    size--;
+  }
 
-      char* player_text = strtok(NULL, "");
-      if (player_text == NULL) return;
+  if (web_client->binary_type == WNP_PLAYER_COVER) {
+    _web_cover_chunk(client, chunk, size, first, fin);
+  } else if (web_client->binary_type != -1 && size > 0 && !web_client->message_failed) {
+    _web_player_message_write(web_client, chunk, size);
+  }
 
-      _web_platform_data_t* platform_data = (_web_platform_data_t*)calloc(1, sizeof(_web_platform_data_t));
-      if (platform_data == NULL) return;
+  if (fin) {
+    if (web_client->binary_type != WNP_PLAYER_COVER && web_client->binary_type != -1 && !web_client->message_failed) {
+      _web_player_message(client, web_client->binary_type, web_client->message, web_client->message_size);
+    }
+    web_client->binary_type = -1;
+  }
+}
 
-      platform_data->client = client;
+/* Text messages are "<type> <data>", the data depends on the type. Messages are parsed in place and never modified. */
+void _web_ws_on_message(cws_client_t* client, const unsigned char* msg, uint64_t msg_size, int type)
+{
+  // Binary messages go to `_web_ws_on_stream`
+  if (type != CWS_TYPE_TEXT) return;
 
-      wnp_player_t player = WNP_DEFAULT_PLAYER;
-      player._platform_data = platform_data;
-      player.platform = WNP_PLATFORM_WEB;
+  _web_span_t rest = {(const char*)msg, msg_size};
+  int64_t message_type;
+  if (!_web_span_int(_web_span_next(&rest, ' '), &message_type) || rest.size == 0) return;
 
-      __wnp_start_update_cycle(NULL);
-      player.id = __wnp_add_player(&player);
-      if (player.id == -1) {
-        free(platform_data);
-        return;
-      }
+  switch (message_type) {
+    case WNP_PLAYER_ADDED:
+    case WNP_PLAYER_UPDATED:
+    case WNP_PLAYER_DELTA: {
+      int64_t id;
+      if (!_web_span_int(_web_span_next(&rest, ' '), &id)) return;
 
-      thread_mutex_lock(&_web_state.cover_buffers_lock);
-      for (size_t i = 0; i < WNP_MAX_COVER_BUFFERS; i++) {
-        _web_cover_buffer_t* buf = _web_state.cover_buffers[i];
-        if (buf != NULL && buf->client == client && buf->port_id == id) {
-          __wnp_write_cover(player.id, buf->data, buf->data_size);
-          char cover_path[WNP_STR_LEN] = {0};
-          if (__wnp_get_cover_path(player.id, cover_path)) {
-            _web_assign_str(player.cover, cover_path);
-          }
-          free(buf->data);
-          free(buf);
-          _web_state.cover_buffers[i] = NULL;
-          break;
-        }
+      _web_player_fields_t player_msg = {.text_fields = WNP_ALL_PLAYER_FIELDS};
+      if (message_type == WNP_PLAYER_DELTA) {
+        // Values are positional, so fields this revision does not know could not be skipped
+        int64_t mask;
+        if (!_web_span_int(_web_span_next(&rest, ' '), &mask) || mask <= 0 || mask > WNP_ALL_PLAYER_FIELDS) return;
+        player_msg.text_fields = (uint32_t)mask;
       }
-      thread_mutex_unlock(&_web_state.cover_buffers_lock);
 
-      _web_parse_player_text(&player, player_text);
-      __wnp_update_player(&player);
-      __wnp_end_update_cycle();
+      if (rest.size == 0) return;
+      player_msg.text = rest;
 
-      break;
-    }
-    case WNP_PLAYER_UPDATED: {
-      char* id_str = strtok(data_str, " ");
-      if (id_str == NULL) return;
-      int id = atoi(id_str);
-
-      char* player_text = strtok(NULL, "");
-      if (player_text == NULL) return;
-
-      wnp_player_t players[WNP_MAX_PLAYERS] = {0};
-      int count = __wnp_start_update_cycle(players);
-      for (size_t i = 0; i < count; i++) {
-        _web_platform_data_t* platform_data = _web_get_platform_data(&players[i]);
-        if (platform_data != NULL && platform_data->port_id == id && platform_data->client == client) {
-          _web_parse_player_text(&players[i], player_text);
-          __wnp_update_player(&players[i]);
-        }
+      if (message_type == WNP_PLAYER_ADDED) {
+        _web_add_player(client, (int)id, &player_msg);
+      } else {
+        _web_update_player(client, (int)id, &player_msg);
       }
-      __wnp_end_update_cycle();
       break;
     }
     case WNP_PLAYER_REMOVED: {
-      int id = atoi(data_str);
-
-      wnp_player_t players[WNP_MAX_PLAYERS] = {0};
-      int count = __wnp_start_update_cycle(players);
-      for (size_t i = 0; i < count; i++) {
-        _web_platform_data_t* platform_data = _web_get_platform_data(&players[i]);
-        if (platform_data != NULL && platform_data->port_id == id && platform_data->client == client) {
-          __wnp_remove_player(players[i].id);
-        }
+      int64_t id;
+      if (_web_span_int(rest, &id)) {
+        _web_remove_player(client, (int)id);
       }
-      __wnp_end_update_cycle();
       break;
     }
     case WNP_EVENT_RESULT: {
-      char* event_id_str = strtok(data_str, " ");
-      if (event_id_str == NULL) return;
-
-      char* event_result_str = strtok(NULL, "");
-      if (event_result_str == NULL) return;
-
-      int event_id = atoi(event_id_str);
+      int64_t event_id, event_result;
+      if (!_web_span_int(_web_span_next(&rest, ' '), &event_id) || !_web_span_int(rest, &event_result)) return;
       if (event_id > WNP_MAX_EVENT_RESULTS - 1 || event_id < 0) return;
 
-      __wnp_set_event_result(event_id, atoi(event_result_str));
+      __wnp_set_event_result((int)event_id, (wnp_event_result_t)event_result);
+      break;
+    }
+    case WNP_SET_REVISION: {
+      _web_client_t* web_client = cws_get_data(client);
+      int64_t revision;
+      if (web_client != NULL && _web_span_int(rest, &revision) && (revision == WNP_TEXT_REVISION || revision == WNP_BINARY_REVISION)) {
+        web_client->revision = (int)revision;
+      }
       break;
     }
   }
@@ -360,23 +1045,50 @@ wnp_init_ret_t __wnp_platform_web_init()
     return WNP_INIT_SUCCESS;
   }
 
+  for (size_t i = 0; i < WNP_MAX_COVER_BUFFERS; i++) {
+    _web_state.cover_buffers[i] = NULL;
+  }
+  memset(&_web_state.cover_buffer_stats, 0, sizeof(_web_cover_buffer_stats_t));
+  thread_mutex_init(&_web_state.cover_buffers_lock);
+
+  cws_endpoint_t endpoints[] = {
+      {.type = CWS_ENDPOINT_IPV4},
+      {.type = CWS_ENDPOINT_IPV6, .optional = true},
+      {.type = CWS_ENDPOINT_UNIX, .path = _web_state.args.web_unix_socket},
+  };
+#ifdef _WIN32
+  // No Unix sockets here, the TCP endpoints still work
+  int endpoint_count = 2;
+#else
+  int endpoint_count = _web_state.args.web_unix_socket[0] != '\0' ? 3 : 2;
+#endif
+
   int ret = cws_start((cws_server_t){
       .port = _web_state.args.web_port,
+      .endpoints = endpoints,
+      .endpoint_count = endpoint_count,
+      .ping_interval_ms = _web_state.args.web_ping_interval_ms,
+      .pong_timeout_ms = _web_state.args.web_pong_timeout_ms,
+      .idle_timeout_ms = _web_state.args.web_idle_timeout_ms,
+      .disable_deflate = _web_state.args.web_disable_deflate,
+      .max_clients = _web_state.args.web_max_clients,
       .on_open = &_web_ws_on_open,
       .on_close = &_web_ws_on_close,
       .on_message = &_web_ws_on_message,
+      .on_stream = &_web_ws_on_stream,
+      .on_reject = &_web_ws_on_reject,
   });
 
-  if (ret != 0) {
-    return WNP_INIT_WEB_PORT_IN_USE;
-  }
-
-  for (size_t i = 0; i < WNP_MAX_COVER_BUFFERS; i++) {
-    _web_state.cover_buffers[i] = NULL;
+  switch (ret) {
+    case CWS_START_SUCCESS:
+      return WNP_INIT_SUCCESS;
+    case CWS_START_PORT_FAILED:
+      return WNP_INIT_WEB_PORT_IN_USE;
+    case CWS_START_UNIX_SOCKET_FAILED:
+      return WNP_INIT_WEB_UNIX_SOCKET_FAILED;
+    default:
+      return WNP_INIT_WEB_FAILED;
   }
-  thread_mutex_init(&_web_state.cover_buffers_lock);
-
-  return WNP_INIT_SUCCESS;
 }
 
 void __wnp_platform_web_uninit()
@@ -388,7 +1100,9 @@ void __wnp_platform_web_uninit()
   cws_stop();
   memset(&_web_state.args, 0, sizeof(wnp_args_t));
   for (size_t i = 0; i < WNP_MAX_COVER_BUFFERS; i++) {
-    _web_state.cover_buffers[i] = NULL;
+    if (_web_state.cover_buffers[i] != NULL) {
+      _web_cover_buffer_free(i);
+    }
   }
   thread_mutex_term(&_web_state.cover_buffers_lock);
 }
@@ -402,6 +1116,38 @@ void __wnp_platform_web_free(void* _platform_data)
   }
 }
 
+bool __wnp_platform_web_stats(wnp_web_stats_t* stats_out)
+{
+  if (_web_state.args.web_port == 0) {
+    return false;
+  }
+
+  memset(stats_out, 0, sizeof(wnp_web_stats_t));
+
+  thread_mutex_lock(&_web_state.cover_buffers_lock);
+  stats_out->pending_covers_stored = _web_state.cover_buffer_stats.stored;
+  stats_out->pending_covers_claimed = _web_state.cover_buffer_stats.claimed;
+  stats_out->pending_covers_replaced = _web_state.cover_buffer_stats.replaced;
+  stats_out->pending_covers_expired = _web_state.cover_buffer_stats.expired;
+  stats_out->pending_covers_evicted = _web_state.cover_buffer_stats.evicted;
+  stats_out->pending_covers_rejected = _web_state.cover_buffer_stats.rejected;
+  stats_out->pending_cover_bytes = _web_state.cover_buffer_stats.bytes;
+  thread_mutex_unlock(&_web_state.cover_buffers_lock);
+
+  cws_stats_t cws_stats;
+  if (cws_get_stats(&cws_stats) == 0) {
+    stats_out->clients = cws_stats.clients;
+    stats_out->peak_clients = cws_stats.peak_clients;
+    stats_out->max_clients = cws_stats.max_clients;
+    stats_out->clients_accepted = cws_stats.accepted;
+    stats_out->clients_rejected = cws_stats.rejected;
+    stats_out->client_bytes = cws_stats.table_bytes + cws_stats.buffer_bytes + cws_stats.queued_bytes;
+    stats_out->queued_bytes = cws_stats.queued_bytes;
+  }
+
+  return true;
+}
+
 void __wnp_platform_web_event(wnp_player_t* player, wnp_event_t event, int event_id, int data)
 {
   _web_platform_data_t* platform_data = _web_get_platform_data(player);
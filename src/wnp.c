@@ -2,6 +2,13 @@
 #include "internal.h"
 #include "thread.h"
 
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <dirent.h>
+#include <unistd.h>
+#endif
+
 /**
  * ================================
  * | Definitions and global state |
@@ -20,6 +27,9 @@ typedef struct {
   int update_cycle_added_players[WNP_MAX_PLAYERS];
   int update_cycle_updated_players[WNP_MAX_PLAYERS];
   wnp_player_t update_cycle_removed_players[WNP_MAX_PLAYERS];
+  char cover_dir[WNP_STR_LEN];
+  bool cover_dir_owned;
+  thread_atomic_int_t cover_tmp_counter;
   bool is_initialized;
 } _wnp_state_t;
 
@@ -200,6 +210,123 @@ void _wnp_free_platform_data(wnp_player_t* player)
   player->_platform_data = NULL;
 }
 
+/**
+ * Covers are written into a directory owned by this wnp_init call, so multiple
+ * processes using libwnp never overwrite each other's covers.
+ * Paths always use forward slashes.
+ */
+static void _wnp_create_cover_dir()
+{
+  _wnp_state.cover_dir[0] = '\0';
+  _wnp_state.cover_dir_owned = false;
+
+#if defined(__linux__) || defined(__APPLE__)
+  const char* tmp_dir = getenv("TMPDIR");
+  if (!tmp_dir) {
+    tmp_dir = "/tmp";
+  }
+#ifdef __linux__
+  // Prefer tmpfs, covers are rewritten often and don't need to survive a reboot
+  if (getenv("XDG_RUNTIME_DIR") != NULL && access(getenv("XDG_RUNTIME_DIR"), W_OK | X_OK) == 0) {
+    tmp_dir = getenv("XDG_RUNTIME_DIR");
+  } else if (access("/dev/shm", W_OK | X_OK) == 0) {
+    tmp_dir = "/dev/shm";
+  }
+#endif
+
+  snprintf(_wnp_state.cover_dir, WNP_STR_LEN, "%s/libwnp-%d-XXXXXX", tmp_dir, (int)getpid());
+  if (mkdtemp(_wnp_state.cover_dir) != NULL) {
+    _wnp_state.cover_dir_owned = true;
+  } else {
+    snprintf(_wnp_state.cover_dir, WNP_STR_LEN, "%s", tmp_dir);
+  }
+#elif _WIN32
+  const char* tmp = getenv("TEMP");
+  if (tmp == NULL || strlen(tmp) + 64 > WNP_STR_LEN) {
+    return;
+  }
+
+  snprintf(_wnp_state.cover_dir, WNP_STR_LEN, "%s/libwnp-%lu-%llu", tmp, GetCurrentProcessId(), GetTickCount64());
+  if (CreateDirectoryA(_wnp_state.cover_dir, NULL)) {
+    _wnp_state.cover_dir_owned = true;
+  } else {
+    snprintf(_wnp_state.cover_dir, WNP_STR_LEN, "%s", tmp);
+  }
+
+  for (size_t i = 0; _wnp_state.cover_dir[i] != '\0'; i++) {
+    if (_wnp_state.cover_dir[i] == '\\') {
+      _wnp_state.cover_dir[i] = '/';
+    }
+  }
+#else
+  // Fallback for unknown systems, just use /tmp/
+  snprintf(_wnp_state.cover_dir, WNP_STR_LEN, "/tmp");
+#endif
+}
+
+static void _wnp_remove_cover_dir()
+{
+  if (_wnp_state.cover_dir[0] == '\0') {
+    return;
+  }
+
+  if (!_wnp_state.cover_dir_owned) {
+    // A shared directory, only our own covers can be told apart
+    for (int i = 0; i < WNP_MAX_PLAYERS; i++) {
+      char cover_path[WNP_STR_LEN] = {0};
+      if (__wnp_get_cover_path(i, cover_path)) {
+        remove(cover_path + 7);
+      }
+    }
+  } else {
+    // Our own directory, this also catches temporary files an interrupted cover write left behind
+    char path[WNP_STR_LEN] = {0};
+#ifdef _WIN32
+    WIN32_FIND_DATAA find_data;
+    snprintf(path, WNP_STR_LEN, "%s/libwnp-cover-*", _wnp_state.cover_dir);
+    HANDLE find = FindFirstFileA(path, &find_data);
+    if (find != INVALID_HANDLE_VALUE) {
+      do {
+        // A truncated path could name another file
+        if (snprintf(path, WNP_STR_LEN, "%s/%s", _wnp_state.cover_dir, find_data.cFileName) < WNP_STR_LEN) {
+          DeleteFileA(path);
+        }
+      } while (FindNextFileA(find, &find_data));
+      FindClose(find);
+    }
+
+    RemoveDirectoryA(_wnp_state.cover_dir);
+#else
+    DIR* dir = opendir(_wnp_state.cover_dir);
+    if (dir != NULL) {
+      struct dirent* entry;
+      while ((entry = readdir(dir)) != NULL) {
+        // A truncated path could name another file
+        if (strncmp(entry->d_name, "libwnp-cover-", 13) == 0 &&
+            snprintf(path, WNP_STR_LEN, "%s/%s", _wnp_state.cover_dir, entry->d_name) < WNP_STR_LEN) {
+          unlink(path);
+        }
+      }
+      closedir(dir);
+    }
+
+    rmdir(_wnp_state.cover_dir);
+#endif
+  }
+
+  _wnp_state.cover_dir[0] = '\0';
+  _wnp_state.cover_dir_owned = false;
+}
+
+static bool _wnp_replace_file(const char* from, const char* to)
+{
+#ifdef _WIN32
+  return MoveFileExA(from, to, MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+  return rename(from, to) == 0;
+#endif
+}
+
 /**
  * =============================
  * | Shared internal functions |
@@ -343,53 +470,49 @@ void __wnp_end_update_cycle()
 
 bool __wnp_get_cover_path(int player_id, char cover_path_out[WNP_STR_LEN])
 {
-  char file_name[WNP_STR_LEN] = {0};
-  snprintf(file_name, WNP_STR_LEN, "libwnp-cover-%d.png", player_id);
-
-#if defined(__linux__) || defined(__APPLE__)
-  const char* tmp_dir = getenv("TMPDIR");
-  if (!tmp_dir) {
-    tmp_dir = "/tmp";
-  }
-  snprintf(cover_path_out, WNP_STR_LEN, "file://%s/%s", tmp_dir, file_name);
-#elif _WIN32
-  char* tmp = getenv("TEMP");
-  if (tmp == NULL || strlen(tmp) + strlen(file_name) + 2 > WNP_STR_LEN) {
+  if (_wnp_state.cover_dir[0] == '\0') {
     return false;
   }
 
-  for (size_t i = 0; tmp[i] != '\0'; i++) {
-    if (tmp[i] == '\\') {
-      tmp[i] = '/';
-    }
+  int len = snprintf(cover_path_out, WNP_STR_LEN, "file://%s/libwnp-cover-%d.png", _wnp_state.cover_dir, player_id);
+  return len > 0 && len < WNP_STR_LEN;
+}
+
+FILE* __wnp_open_cover(int player_id, char tmp_path_out[WNP_STR_LEN])
+{
+  char file_path[WNP_STR_LEN] = {0};
+  if (!__wnp_get_cover_path(player_id, file_path)) {
+    return NULL;
   }
-  snprintf(cover_path_out, WNP_STR_LEN, "file://%s/%s", tmp, file_name);
-#else
-  // Fallback for unknown systems, just use /tmp/
-  snprintf(cover_path_out, WNP_STR_LEN, "file:///tmp/%s", file_name);
-#endif
 
-  return true;
+  // Write next to the cover and rename it into place, readers only ever see complete files.
+  int len = snprintf(tmp_path_out, WNP_STR_LEN, "%s.%d.tmp", file_path + 7, thread_atomic_int_inc(&_wnp_state.cover_tmp_counter));
+  if (len <= 0 || len >= WNP_STR_LEN) {
+    return NULL;
+  }
+
+  return fopen(tmp_path_out, "wb");
 }
 
-bool __wnp_write_cover(int player_id, void* data, uint64_t size)
+bool __wnp_close_cover(int player_id, FILE* file, const char tmp_path[WNP_STR_LEN], bool commit)
 {
   char file_path[WNP_STR_LEN] = {0};
-  if (!__wnp_get_cover_path(player_id, file_path)) {
+  if (fclose(file) != 0 || !commit || !__wnp_get_cover_path(player_id, file_path) || !_wnp_replace_file(tmp_path, file_path + 7)) {
+    remove(tmp_path);
     return false;
   }
+  return true;
+}
 
-  FILE* file = fopen(file_path + 7, "wb");
+bool __wnp_write_cover(int player_id, void* data, uint64_t size)
+{
+  char tmp_path[WNP_STR_LEN] = {0};
+  FILE* file = __wnp_open_cover(player_id, tmp_path);
   if (file == NULL) {
     return false;
   }
   size_t bytes_written = fwrite(data, sizeof(unsigned char), size, file);
-  if (bytes_written != size) {
-    fclose(file);
-    return false;
-  }
-  fclose(file);
-  return true;
+  return __wnp_close_cover(player_id, file, tmp_path, bytes_written == size);
 }
 
 void __wnp_set_event_result(int event_id, wnp_event_result_t result)
@@ -556,6 +679,7 @@ wnp_init_ret_t wnp_init(wnp_args_t* args)
   }
 
   _wnp_init_state(args);
+  _wnp_create_cover_dir();
   _wnp_state.is_initialized = true;
 
   void (*uninit_functions[4])() = {0};
@@ -579,6 +703,7 @@ wnp_init_ret_t wnp_init(wnp_args_t* args)
     for (size_t i = 0; i < uninit_num; i++) {
       uninit_functions[i]();
     }
+    _wnp_remove_cover_dir();
     _wnp_init_state(false);
     _wnp_state.is_initialized = false;
   }
@@ -606,6 +731,7 @@ void wnp_uninit()
 #endif /* WNP_BUILD_PLATFORM_WINDOWS */
 
   /* cleanup state */
+  _wnp_remove_cover_dir();
   _wnp_state.is_initialized = true;
   _wnp_init_state(false);
   /* end cleanup state */
@@ -659,6 +785,17 @@ int wnp_get_all_players(wnp_player_t players_out[WNP_MAX_PLAYERS])
   return _wnp_get_all_players_lockable(players_out, true, true);
 }
 
+bool wnp_get_web_stats(wnp_web_stats_t* stats_out)
+{
+  if (!wnp_is_initialized()) return false;
+
+#ifdef WNP_BUILD_PLATFORM_WEB
+  return __wnp_platform_web_stats(stats_out);
+#else
+  return false;
+#endif /* WNP_BUILD_PLATFORM_WEB */
+}
+
 /**
  * ============================
  * | Public utility functions |